@@ -0,0 +1,433 @@
+// Row group filters
+// -----------------
+//
+// parquet use ... if exp writes the expression to a temporary file,
+// followed by the Stata names of the variables being read (one per
+// line, same order as __sparquet_colix). We parse the top-level
+// conjuncts of the expression that have the form `var op literal`
+// (or `literal op var`) and check them against each row group's column
+// chunk statistics. A row group is pruned only if some conjunct cannot
+// be true for any of its rows; Stata applies the full expression to the
+// rows that are read, so anything we cannot parse is simply ignored.
+// If every conjunct was parsed the filter is exact: the low-level
+// reader can then evaluate it row by row (see parquet-reader-ll-select)
+// and Stata does not need to apply it again.
+//
+// Stata reads parquet nulls as system missing (.) for numbers and as
+// blanks ("") for strings, and missing sorts above every number, so
+// a numeric chunk with nulls is treated as having max = . and a string
+// chunk with nulls as having min = "".
+
+enum sf_filter_op {
+    SF_FILTER_EQ,
+    SF_FILTER_NE,
+    SF_FILTER_LT,
+    SF_FILTER_LE,
+    SF_FILTER_GT,
+    SF_FILTER_GE
+};
+
+struct sf_filter_pred {
+    int64_t j;
+    int64_t op;
+    bool isstr;
+    ST_double vdouble;
+    std::string vstr;
+};
+
+struct sf_filter {
+    std::vector<sf_filter_pred> preds;
+    bool exact;
+    int64_t nchecked;
+    int64_t npruned;
+};
+
+std::string sf_filter_trim(const std::string &s)
+{
+    size_t a = s.find_first_not_of(" \t\r\n");
+    size_t b = s.find_last_not_of(" \t\r\n");
+    return a == std::string::npos? std::string(): s.substr(a, b - a + 1);
+}
+
+// Strip parentheses that enclose the entire expression, e.g. ((x > 1))
+
+std::string sf_filter_unwrap(std::string s)
+{
+    size_t k;
+    int64_t depth;
+    bool inquote, enclosed;
+
+    s = sf_filter_trim(s);
+    while ( s.size() > 1 && s[0] == '(' && s[s.size() - 1] == ')' ) {
+        depth = 0;
+        inquote = false;
+        enclosed = true;
+        for (k = 0; k < s.size(); k++) {
+            if ( s[k] == '"' ) inquote = !inquote;
+            if ( inquote ) continue;
+            if ( s[k] == '(' ) depth++;
+            if ( s[k] == ')' ) depth--;
+            if ( depth == 0 && k < s.size() - 1 ) {
+                enclosed = false;
+                break;
+            }
+        }
+        if ( !enclosed ) break;
+        s = sf_filter_trim(s.substr(1, s.size() - 2));
+    }
+    return s;
+}
+
+// Split on top-level &; returns false if there is a top-level | (then
+// no single conjunct has to hold and nothing can be pruned).
+
+bool sf_filter_split(const std::string &s, std::vector<std::string> &conjuncts)
+{
+    size_t k, from = 0;
+    int64_t depth = 0;
+    bool inquote = false;
+
+    for (k = 0; k < s.size(); k++) {
+        if ( s[k] == '"' ) inquote = !inquote;
+        if ( inquote ) continue;
+        if ( s[k] == '(' ) depth++;
+        if ( s[k] == ')' ) depth--;
+        if ( depth == 0 && s[k] == '|' ) return false;
+        if ( depth == 0 && s[k] == '&' ) {
+            conjuncts.push_back(s.substr(from, k - from));
+            from = k + 1;
+        }
+    }
+    conjuncts.push_back(s.substr(from));
+    return true;
+}
+
+bool sf_filter_isname(const std::string &s)
+{
+    size_t k;
+    if ( s.empty() || !(isalpha(s[0]) || s[0] == '_') ) return false;
+    for (k = 1; k < s.size(); k++) {
+        if ( !(isalnum(s[k]) || s[k] == '_') ) return false;
+    }
+    return true;
+}
+
+// Stata numeric literals only: a sign, digits with at most one point,
+// and an exponent. strtod would also take inf, nan and hex, which Stata
+// reads as names or rejects.
+
+bool sf_filter_isnumber(const std::string &s)
+{
+    size_t k = 0, ndigit = 0;
+    if ( k < s.size() && (s[k] == '-' || s[k] == '+') ) k++;
+    while ( k < s.size() && isdigit(s[k]) ) { k++; ndigit++; }
+    if ( k < s.size() && s[k] == '.' ) k++;
+    while ( k < s.size() && isdigit(s[k]) ) { k++; ndigit++; }
+    if ( ndigit == 0 ) return false;
+    if ( k < s.size() && (s[k] == 'e' || s[k] == 'E') ) {
+        k++;
+        if ( k < s.size() && (s[k] == '-' || s[k] == '+') ) k++;
+        if ( k >= s.size() || !isdigit(s[k]) ) return false;
+        while ( k < s.size() && isdigit(s[k]) ) k++;
+    }
+    return k == s.size();
+}
+
+// Literals: numbers, system missing (.), and "strings" or `"strings"'
+
+bool sf_filter_literal(const std::string &s, sf_filter_pred *pred)
+{
+    char *end;
+    if ( s.size() >= 2 && s[0] == '"' && s[s.size() - 1] == '"' ) {
+        pred->isstr = true;
+        pred->vstr  = s.substr(1, s.size() - 2);
+        return pred->vstr.find('"') == std::string::npos;
+    }
+    if ( s.size() >= 4 && s[0] == '`' && s[1] == '"' && s[s.size() - 2] == '"' && s[s.size() - 1] == '\'' ) {
+        pred->isstr = true;
+        pred->vstr  = s.substr(2, s.size() - 4);
+        return true;
+    }
+    pred->isstr = false;
+    if ( s == "." ) {
+        pred->vdouble = SV_missval;
+        return true;
+    }
+    if ( !sf_filter_isnumber(s) ) return false;
+    pred->vdouble = strtod(s.c_str(), &end);
+    return *end == '\0';
+}
+
+int64_t sf_filter_flip(int64_t op)
+{
+    switch (op) {
+        case SF_FILTER_LT: return SF_FILTER_GT;
+        case SF_FILTER_LE: return SF_FILTER_GE;
+        case SF_FILTER_GT: return SF_FILTER_LT;
+        case SF_FILTER_GE: return SF_FILTER_LE;
+        default: return op;
+    }
+}
+
+bool sf_filter_conjunct(
+    const std::string &s,
+    const std::vector<std::string> &vnames,
+    sf_filter_pred *pred)
+{
+    size_t k, oplen;
+    int64_t j;
+    bool inquote = false;
+    std::string lhs, rhs;
+
+    for (k = 0; k < s.size(); k++) {
+        if ( s[k] == '"' ) inquote = !inquote;
+        if ( inquote ) continue;
+        if ( strchr("=!~<>", s[k]) ) break;
+    }
+    if ( k >= s.size() ) return false;
+
+    oplen = 1;
+    if ( s.compare(k, 2, "==") == 0 ) { pred->op = SF_FILTER_EQ; oplen = 2; }
+    else if ( s.compare(k, 2, "!=") == 0 ) { pred->op = SF_FILTER_NE; oplen = 2; }
+    else if ( s.compare(k, 2, "~=") == 0 ) { pred->op = SF_FILTER_NE; oplen = 2; }
+    else if ( s.compare(k, 2, "<=") == 0 ) { pred->op = SF_FILTER_LE; oplen = 2; }
+    else if ( s.compare(k, 2, ">=") == 0 ) { pred->op = SF_FILTER_GE; oplen = 2; }
+    else if ( s[k] == '<' ) { pred->op = SF_FILTER_LT; }
+    else if ( s[k] == '>' ) { pred->op = SF_FILTER_GT; }
+    else return false;
+
+    lhs = sf_filter_unwrap(s.substr(0, k));
+    rhs = sf_filter_unwrap(s.substr(k + oplen));
+    if ( !sf_filter_isname(lhs) ) {
+        std::swap(lhs, rhs);
+        pred->op = sf_filter_flip(pred->op);
+    }
+    if ( !sf_filter_isname(lhs) ) return false;
+    if ( !sf_filter_literal(rhs, pred) ) return false;
+
+    for (j = 0; j < (int64_t) vnames.size(); j++) {
+        if ( vnames[j] == lhs ) {
+            pred->j = j;
+            return true;
+        }
+    }
+    return false;
+}
+
+ST_retcode sf_filter_parse(
+    const char *ffilter,
+    const int64_t ncol,
+    sf_filter *filter,
+    const int debug)
+{
+    std::string exp, line;
+    std::vector<std::string> vnames, conjuncts;
+    std::ifstream fstream;
+    sf_filter_pred pred;
+    size_t k;
+
+    filter->preds.clear();
+    filter->exact    = false;
+    filter->nchecked = 0;
+    filter->npruned  = 0;
+
+    fstream.open(ffilter);
+    if ( !fstream.is_open() ) {
+        sf_errprintf("Unable to read file '%s'\n", ffilter);
+        return (601);
+    }
+    std::getline(fstream, exp);
+    while ( std::getline(fstream, line) ) {
+        vnames.push_back(line);
+    }
+    fstream.close();
+
+    if ( (int64_t) vnames.size() != ncol ) {
+        sf_errprintf("Filter expects %ld variables but got %ld\n", ncol, (int64_t) vnames.size());
+        return (198);
+    }
+
+    if ( !sf_filter_split(sf_filter_unwrap(exp), conjuncts) ) {
+        sf_printf_debug(debug, "\t(filter has a top-level |; no row groups pruned)\n");
+        return (0);
+    }
+
+    filter->exact = true;
+    for (k = 0; k < conjuncts.size(); k++) {
+        if ( sf_filter_conjunct(sf_filter_unwrap(conjuncts[k]), vnames, &pred) ) {
+            filter->preds.push_back(pred);
+            sf_printf_debug(debug, "\tFilter on %s\n", vnames[pred.j].c_str());
+        }
+        else {
+            filter->exact = false;
+        }
+    }
+
+    return (0);
+}
+
+// Whether a single value satisfies a predicate, given the sign of the
+// comparison of the value against the literal.
+
+inline bool sf_filter_cmp(int64_t op, int c)
+{
+    switch (op) {
+        case SF_FILTER_EQ: return c == 0;
+        case SF_FILTER_NE: return c != 0;
+        case SF_FILTER_LT: return c <  0;
+        case SF_FILTER_LE: return c <= 0;
+        case SF_FILTER_GT: return c >  0;
+        case SF_FILTER_GE: return c >= 0;
+        default: return true;
+    }
+}
+
+inline bool sf_filter_value(const sf_filter_pred &pred, ST_double z)
+{
+    return sf_filter_cmp(pred.op, z < pred.vdouble? -1: (pred.vdouble < z? 1: 0));
+}
+
+inline bool sf_filter_value(const sf_filter_pred &pred, const uint8_t *ptr, int64_t len)
+{
+    int64_t vlen = pred.vstr.size();
+    int c = memcmp(ptr, pred.vstr.data(), std::min(len, vlen));
+    if ( c == 0 ) c = len < vlen? -1: (vlen < len? 1: 0);
+    return sf_filter_cmp(pred.op, c);
+}
+
+// Whether a predicate can be true for some value in [lo, hi]
+
+template <typename T>
+bool sf_filter_range(int64_t op, const T &lo, const T &hi, const T &v)
+{
+    switch (op) {
+        case SF_FILTER_EQ: return !(v < lo) && !(hi < v);
+        case SF_FILTER_NE: return (lo < v) || (v < lo) || (hi < v) || (v < hi);
+        case SF_FILTER_LT: return lo < v;
+        case SF_FILTER_LE: return !(v < lo);
+        case SF_FILTER_GT: return v < hi;
+        case SF_FILTER_GE: return !(hi < v);
+        default: return true;
+    }
+}
+
+template <typename DType>
+bool sf_filter_numeric(
+    const std::shared_ptr<parquet::Statistics> &stats,
+    const sf_filter_pred &pred,
+    const sf_convert &convert)
+{
+    ST_double lo, hi;
+    std::shared_ptr<parquet::TypedStatistics<DType>> typed =
+        std::static_pointer_cast<parquet::TypedStatistics<DType>>(stats);
+
+    // Dates, times and decimals are compared as Stata values
+    if ( stats->HasMinMax() ) {
+        lo = sf_convert_value(convert, (ST_double) typed->min());
+        hi = stats->null_count() > 0? SV_missval: sf_convert_value(convert, (ST_double) typed->max());
+    }
+    else if ( stats->num_values() == 0 ) {
+        lo = hi = SV_missval;
+    }
+    else {
+        return true;
+    }
+    return sf_filter_range<ST_double>(pred.op, lo, hi, pred.vdouble);
+}
+
+bool sf_filter_string(
+    const std::shared_ptr<parquet::Statistics> &stats,
+    const sf_filter_pred &pred)
+{
+    std::string lo, hi;
+    if ( stats->HasMinMax() ) {
+        lo = stats->null_count() > 0? std::string(): stats->EncodeMin();
+        hi = stats->EncodeMax();
+    }
+    else if ( stats->num_values() == 0 ) {
+        lo = hi = std::string();
+    }
+    else {
+        return true;
+    }
+    return sf_filter_range<std::string>(pred.op, lo, hi, pred.vstr);
+}
+
+// Returns false if the row group cannot contain rows that satisfy the
+// filter; colix maps the read varlist to parquet columns.
+
+bool sf_filter_rowgroup(
+    const parquet::RowGroupMetaData *rg_metadata,
+    sf_filter *filter,
+    const int64_t *colix)
+{
+    size_t k;
+    std::shared_ptr<parquet::Statistics> stats;
+    std::unique_ptr<parquet::ColumnChunkMetaData> cc_metadata;
+    const parquet::ColumnDescriptor *descr;
+    sf_convert convert;
+
+    filter->nchecked++;
+    for (k = 0; k < filter->preds.size(); k++) {
+        const sf_filter_pred &pred = filter->preds[k];
+        descr = rg_metadata->schema()->Column(colix[pred.j]);
+        cc_metadata = rg_metadata->ColumnChunk(colix[pred.j]);
+        if ( !cc_metadata->is_stats_set() ) continue;
+
+        // Unsigned chunks are ordered differently from how they are
+        // read into Stata; decimals are only compared when stored as
+        // integers (the statistics are then scaled like the values)
+        switch (descr->converted_type()) {
+            case ConvertedType::UINT_8:
+            case ConvertedType::UINT_16:
+            case ConvertedType::UINT_32:
+            case ConvertedType::UINT_64:
+                continue;
+            case ConvertedType::DECIMAL:
+                if ( descr->physical_type() != Type::INT32 && descr->physical_type() != Type::INT64 ) continue;
+                break;
+            default:
+                break;
+        }
+
+        stats = cc_metadata->statistics();
+        convert = sf_convert_type(descr);
+        switch (descr->physical_type()) {
+            case Type::BOOLEAN:
+                if ( pred.isstr ) continue;
+                if ( !sf_filter_numeric<parquet::BooleanType>(stats, pred, convert) ) goto prune;
+                break;
+            case Type::INT32:
+                if ( pred.isstr ) continue;
+                if ( !sf_filter_numeric<parquet::Int32Type>(stats, pred, convert) ) goto prune;
+                break;
+            case Type::INT64:
+                if ( pred.isstr ) continue;
+                if ( !sf_filter_numeric<parquet::Int64Type>(stats, pred, convert) ) goto prune;
+                break;
+            case Type::FLOAT:
+                if ( pred.isstr ) continue;
+                if ( !sf_filter_numeric<parquet::FloatType>(stats, pred, convert) ) goto prune;
+                break;
+            case Type::DOUBLE:
+                if ( pred.isstr ) continue;
+                if ( !sf_filter_numeric<parquet::DoubleType>(stats, pred, convert) ) goto prune;
+                break;
+            case Type::BYTE_ARRAY:
+                if ( !pred.isstr ) continue;
+                if ( !sf_filter_string(stats, pred) ) goto prune;
+                break;
+            case Type::FIXED_LEN_BYTE_ARRAY:
+                if ( !pred.isstr ) continue;
+                if ( !sf_filter_string(stats, pred) ) goto prune;
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+
+prune:
+    filter->npruned++;
+    return false;
+}
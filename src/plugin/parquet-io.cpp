@@ -0,0 +1,304 @@
+// File input for the readers
+// --------------------------
+//
+// Files are opened as a regular file, a memory map (mmap option), or a
+// regular file behind a coalescing layer (coalesce option). Once the
+// reader knows which row groups it will read, sf_io_select works out
+// the byte range of each of their selected column chunks from the
+// footer and merges ranges that are at most holesize bytes apart into
+// reads of at most rangesize bytes; ReadAt calls are then served from
+// those merged reads. Ranges are only read when first needed and are
+// released once every chunk in them has been served.
+//
+// parquet-cpp requests each column chunk with a single ReadAt, so one
+// merged read replaces many small ones; this matters on high-latency
+// file systems. Anything outside the ranges (e.g. the footer) goes to
+// the file directly.
+
+struct sf_io {
+    int64_t usemmap;
+    int64_t coalesce;
+    int64_t holesize;
+    int64_t rangesize;
+};
+
+// Read I/O options; defaults follow Arrow's coalescing defaults
+//
+// scalars
+//     __sparquet_mmap
+//     __sparquet_coalesce
+//     __sparquet_holesize
+//     __sparquet_rangesize
+
+ST_retcode sf_io_init(sf_io *io)
+{
+    ST_retcode rc = 0, any_rc = 0;
+
+    io->usemmap   = 0;
+    io->coalesce  = 0;
+    io->holesize  = 8192;
+    io->rangesize = 32 * 1024 * 1024;
+
+    if ( (rc = sf_scalar_int("__sparquet_mmap",      15, &io->usemmap))   ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_coalesce",  19, &io->coalesce))  ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_holesize",  19, &io->holesize))  ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_rangesize", 20, &io->rangesize)) ) any_rc = rc;
+
+    return (any_rc);
+}
+
+struct sf_io_range {
+    int64_t offset;
+    int64_t length;
+    int64_t nchunks;
+    int64_t nread;
+    bool loading;
+    std::shared_ptr<arrow::Buffer> data;
+};
+
+bool sf_io_range_cmp(const sf_io_range &a, const sf_io_range &b)
+{
+    return (a.offset < b.offset);
+}
+
+// Merged byte ranges of the selected columns in the row groups read
+
+std::vector<sf_io_range> sf_io_ranges(
+    std::shared_ptr<parquet::FileMetaData> file_metadata,
+    const std::vector<int64_t> &rowgroups,
+    const int64_t *colix,
+    int64_t ncol,
+    int64_t holesize,
+    int64_t rangesize)
+{
+    int64_t j, start, end;
+    size_t r;
+    std::vector<sf_io_range> chunks, ranges;
+    sf_io_range range;
+
+    range.nread = 0;
+    range.nchunks = 1;
+    range.loading = false;
+    for (r = 0; r < rowgroups.size(); r++) {
+        std::unique_ptr<parquet::RowGroupMetaData> rg_metadata = file_metadata->RowGroup(rowgroups[r]);
+        for (j = 0; j < ncol; j++) {
+            std::unique_ptr<parquet::ColumnChunkMetaData> cc_metadata = rg_metadata->ColumnChunk(colix[j]);
+            start = cc_metadata->data_page_offset();
+            if ( cc_metadata->has_dictionary_page()
+                    && cc_metadata->dictionary_page_offset() > 0
+                    && cc_metadata->dictionary_page_offset() < start ) {
+                start = cc_metadata->dictionary_page_offset();
+            }
+            range.offset = start;
+            range.length = cc_metadata->total_compressed_size();
+            chunks.push_back(range);
+        }
+    }
+
+    std::sort(chunks.begin(), chunks.end(), sf_io_range_cmp);
+    for (j = 0; j < (int64_t) chunks.size(); j++) {
+        end = chunks[j].offset + chunks[j].length;
+        if ( !ranges.empty()
+                && chunks[j].offset - (ranges.back().offset + ranges.back().length) <= holesize
+                && end - ranges.back().offset <= rangesize ) {
+            start = ranges.back().offset;
+            ranges.back().length  = std::max(end, start + ranges.back().length) - start;
+            ranges.back().nchunks++;
+        }
+        else {
+            ranges.push_back(chunks[j]);
+        }
+    }
+
+    return (ranges);
+}
+
+class sf_io_coalesced : public arrow::io::RandomAccessFile {
+public:
+    sf_io_coalesced(std::shared_ptr<arrow::io::RandomAccessFile> file):
+        file_(file), pos_(0) {}
+
+    void SetRanges(const std::vector<sf_io_range> &ranges)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        ranges_ = ranges;
+    }
+
+    arrow::Status Close() override { return file_->Close(); }
+    bool closed() const override { return file_->closed(); }
+    arrow::Status GetSize(int64_t *size) override { return file_->GetSize(size); }
+
+    arrow::Status Tell(int64_t *position) const override
+    {
+        *position = pos_;
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Seek(int64_t position) override
+    {
+        pos_ = position;
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Read(int64_t nbytes, int64_t *bytes_read, void *out) override
+    {
+        ARROW_RETURN_NOT_OK(ReadAt(pos_, nbytes, bytes_read, out));
+        pos_ += *bytes_read;
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Read(int64_t nbytes, std::shared_ptr<arrow::Buffer> *out) override
+    {
+        ARROW_RETURN_NOT_OK(ReadAt(pos_, nbytes, out));
+        pos_ += (*out)->size();
+        return arrow::Status::OK();
+    }
+
+    arrow::Status ReadAt(int64_t position, int64_t nbytes, int64_t *bytes_read, void *out) override
+    {
+        std::shared_ptr<arrow::Buffer> buffer;
+        ARROW_RETURN_NOT_OK(ReadAt(position, nbytes, &buffer));
+        memcpy(out, buffer->data(), buffer->size());
+        *bytes_read = buffer->size();
+        return arrow::Status::OK();
+    }
+
+    arrow::Status ReadAt(int64_t position, int64_t nbytes, std::shared_ptr<arrow::Buffer> *out) override
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        std::shared_ptr<arrow::Buffer> data;
+        sf_io_range key;
+        key.offset = position;
+
+        // Last range starting at or before position
+        std::vector<sf_io_range>::iterator it =
+            std::upper_bound(ranges_.begin(), ranges_.end(), key, sf_io_range_cmp);
+        if ( it == ranges_.begin() || position + nbytes > (it - 1)->offset + (it - 1)->length ) {
+            lock.unlock();
+            return file_->ReadAt(position, nbytes, out);
+        }
+        --it;
+
+        // The first request for a range reads it while later ones for
+        // the same range wait; the lock is not held during the read, so
+        // threads() workers are served from other ranges meanwhile.
+        cv_.wait(lock, [&]{ return !it->loading; });
+        if ( it->data == nullptr ) {
+            it->loading = true;
+            lock.unlock();
+            arrow::Status status = file_->ReadAt(it->offset, it->length, &data);
+            lock.lock();
+            it->loading = false;
+            cv_.notify_all();
+            ARROW_RETURN_NOT_OK(status);
+            if ( data->size() < it->length ) {
+                lock.unlock();
+                return file_->ReadAt(position, nbytes, out);
+            }
+            it->data = data;
+        }
+        *out = arrow::SliceBuffer(it->data, position - it->offset, nbytes);
+        if ( ++(it->nread) >= it->nchunks ) {
+            it->data.reset();
+            it->nread = 0;
+        }
+
+        return arrow::Status::OK();
+    }
+
+private:
+    std::shared_ptr<arrow::io::RandomAccessFile> file_;
+    std::vector<sf_io_range> ranges_;
+    int64_t pos_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+};
+
+// Open fname per io. With coalesce, reads go straight to the file
+// until sf_io_select sets the ranges to merge.
+
+std::shared_ptr<arrow::io::RandomAccessFile> sf_io_open(
+    const std::string &fname,
+    sf_io *io)
+{
+    std::shared_ptr<arrow::io::MemoryMappedFile> mmfile;
+    std::shared_ptr<arrow::io::ReadableFile> rfile;
+
+    if ( io->usemmap ) {
+        PARQUET_THROW_NOT_OK(arrow::io::MemoryMappedFile::Open(
+            fname, arrow::io::FileMode::READ, &mmfile));
+        return (mmfile);
+    }
+
+    PARQUET_THROW_NOT_OK(arrow::io::ReadableFile::Open(
+        fname, arrow::default_memory_pool(), &rfile));
+    if ( !io->coalesce ) {
+        return (rfile);
+    }
+
+    return (std::make_shared<sf_io_coalesced>(rfile));
+}
+
+// Coalesce the reads of the selected columns (0-indexed colix) in the
+// row groups the reader is going to read (0-indexed rowgroups). Call it
+// before any of their column chunks is read: a chunk read before then
+// is not counted against its range, which is then kept until the read
+// ends. Does not print anything when verbose is 0 so it can run on
+// worker threads.
+
+void sf_io_select(
+    std::shared_ptr<arrow::io::RandomAccessFile> source,
+    sf_io *io,
+    std::shared_ptr<parquet::FileMetaData> file_metadata,
+    const std::vector<int64_t> &rowgroups,
+    const int64_t *colix,
+    int64_t ncol,
+    const int verbose)
+{
+    std::shared_ptr<sf_io_coalesced> coalesced;
+    std::vector<sf_io_range> ranges;
+
+    if ( !io->coalesce ) return;
+    coalesced = std::dynamic_pointer_cast<sf_io_coalesced>(source);
+    if ( coalesced == nullptr ) return;
+
+    ranges = sf_io_ranges(file_metadata, rowgroups, colix, ncol, io->holesize, io->rangesize);
+    sf_printf_debug(verbose, "\tCoalesced %ld column chunks into %ld reads\n",
+                    (int64_t) rowgroups.size() * ncol, (int64_t) ranges.size());
+    coalesced->SetRanges(ranges);
+}
+
+// Row groups the low-level readers decode: those in rowgix (0-indexed;
+// every group if readrg is 0) with a row in the selected runs. As in
+// sf_ll_chunk_runs, rows are numbered across the groups considered,
+// starting at ix, and runs not yet read start at index u.
+
+std::vector<int64_t> sf_io_rowgroups(
+    std::shared_ptr<parquet::FileMetaData> file_metadata,
+    int64_t readrg,
+    const int64_t *rowgix,
+    const std::vector<int64_t> &runs,
+    int64_t u,
+    int64_t ix)
+{
+    int64_t r, rg = 0, rgrows;
+    std::vector<int64_t> rowgroups;
+
+    for (r = 0; r < file_metadata->num_row_groups(); r++) {
+        if ( readrg ) {
+            if ( rg < readrg && r == rowgix[rg] ) {
+                rg++;
+            }
+            else {
+                continue;
+            }
+        }
+        rgrows = file_metadata->RowGroup(r)->num_rows();
+        while ( u + 1 < (int64_t) runs.size() && runs[u] + runs[u + 1] <= ix ) u += 2;
+        if ( u + 1 >= (int64_t) runs.size() ) break;
+        if ( runs[u] < ix + rgrows ) rowgroups.push_back(r);
+        ix += rgrows;
+    }
+
+    return (rowgroups);
+}
@@ -0,0 +1,259 @@
+// High-level Arrow to Stata conversion
+// ------------------------------------
+//
+// Numeric columns are converted a segment at a time into an ST_double
+// staging buffer straight from the array's value buffer and validity
+// bitmap, and only then stored into Stata. The bitmap is read 64 bits
+// at a time: words with no nulls are a plain cast, words with only
+// nulls are a fill, and mixed words use a select the compiler can
+// vectorize. The staging buffer is what a bulk store would consume.
+
+inline bool sf_hl_bit(const uint8_t *bitmap, int64_t i)
+{
+    return (bitmap[i >> 3] >> (i & 7)) & 1;
+}
+
+// Convert n values (already offset) with validity bits starting at bit
+// offset of bitmap (nullptr if there are no nulls) into out.
+
+template <typename T>
+void sf_hl_convert(
+    const T *values,
+    const uint8_t *bitmap,
+    int64_t offset,
+    int64_t n,
+    ST_double *out)
+{
+    int64_t k = 0, l;
+    uint64_t word;
+
+    if ( bitmap == nullptr ) {
+        for (k = 0; k < n; k++)
+            out[k] = (ST_double) values[k];
+        return;
+    }
+
+    // Leading bits up to a byte boundary of the bitmap
+    for (; k < n && ((offset + k) & 7); k++)
+        out[k] = sf_hl_bit(bitmap, offset + k)? (ST_double) values[k]: SV_missval;
+
+    for (; k + 64 <= n; k += 64) {
+        memcpy(&word, bitmap + ((offset + k) >> 3), sizeof(word));
+        if ( word == ~((uint64_t) 0) ) {
+            for (l = 0; l < 64; l++)
+                out[k + l] = (ST_double) values[k + l];
+        }
+        else if ( word == 0 ) {
+            for (l = 0; l < 64; l++)
+                out[k + l] = SV_missval;
+        }
+        else {
+            for (l = 0; l < 64; l++)
+                out[k + l] = ((word >> l) & 1)? (ST_double) values[k + l]: SV_missval;
+        }
+    }
+
+    for (; k < n; k++)
+        out[k] = sf_hl_bit(bitmap, offset + k)? (ST_double) values[k]: SV_missval;
+}
+
+// Booleans are bit-packed as well; only the value lookup differs
+
+void sf_hl_convert_bool(
+    const uint8_t *values,
+    const uint8_t *bitmap,
+    int64_t offset,
+    int64_t n,
+    ST_double *out)
+{
+    int64_t k;
+    if ( bitmap == nullptr ) {
+        for (k = 0; k < n; k++)
+            out[k] = (ST_double) sf_hl_bit(values, offset + k);
+    }
+    else {
+        for (k = 0; k < n; k++)
+            out[k] = sf_hl_bit(bitmap, offset + k)? (ST_double) sf_hl_bit(values, offset + k): SV_missval;
+    }
+}
+
+// Decimals are 16-byte integers scaled by 10^-s; each one is formatted
+// with its scale and parsed back as a double.
+
+void sf_hl_convert_decimal(
+    const std::shared_ptr<arrow::Array> &array,
+    int64_t from,
+    int64_t n,
+    ST_double *out)
+{
+    int64_t k;
+    int32_t scale = static_cast<const arrow::DecimalType&>(*array->type()).scale();
+    const arrow::FixedSizeBinaryArray &values = static_cast<const arrow::FixedSizeBinaryArray&>(*array);
+    for (k = 0; k < n; k++) {
+        out[k] = values.IsNull(from + k)? SV_missval:
+            strtod(arrow::Decimal128(values.GetValue(from + k)).ToString(scale).c_str(), NULL);
+    }
+}
+
+template <typename T>
+void sf_hl_convert_array(
+    const std::shared_ptr<arrow::Array> &array,
+    int64_t from,
+    int64_t n,
+    ST_double *out)
+{
+    const uint8_t *bitmap = array->null_count()? array->null_bitmap_data(): nullptr;
+    if ( bitmap != nullptr && array->null_count() == array->length() ) {
+        std::fill(out, out + n, SV_missval);
+        return;
+    }
+    sf_hl_convert<T>(
+        array->data()->GetValues<T>(1) + from,
+        bitmap,
+        array->offset() + from,
+        n,
+        out
+    );
+}
+
+// Copy rows [from, to) of a record batch column into Stata variable
+// j + 1, starting at observation sobs + 1
+
+ST_retcode sf_hl_store_numeric(
+    const std::shared_ptr<arrow::Array> &array,
+    int64_t j,
+    int64_t from,
+    int64_t to,
+    int64_t sobs,
+    std::vector<ST_double> &vdouble)
+{
+    ST_retcode rc = 0;
+    int64_t k, n = to - from;
+    ST_double *out;
+
+    if ( (int64_t) vdouble.size() < n ) vdouble.resize(n);
+    out = vdouble.data();
+
+    switch (array->type_id()) {
+        case arrow::Type::BOOL:
+            sf_hl_convert_bool(
+                array->data()->buffers[1]->data(),
+                array->null_count()? array->null_bitmap_data(): nullptr,
+                array->offset() + from,
+                n,
+                out
+            );
+            break;
+        case arrow::Type::INT8:
+            sf_hl_convert_array<int8_t>(array, from, n, out);
+            break;
+        case arrow::Type::UINT8:
+            sf_hl_convert_array<uint8_t>(array, from, n, out);
+            break;
+        case arrow::Type::INT16:
+            sf_hl_convert_array<int16_t>(array, from, n, out);
+            break;
+        case arrow::Type::UINT16:
+            sf_hl_convert_array<uint16_t>(array, from, n, out);
+            break;
+        case arrow::Type::INT32:
+        case arrow::Type::DATE32:
+        case arrow::Type::TIME32:
+            sf_hl_convert_array<int32_t>(array, from, n, out);
+            break;
+        case arrow::Type::UINT32:
+            sf_hl_convert_array<uint32_t>(array, from, n, out);
+            break;
+        case arrow::Type::INT64:
+        case arrow::Type::DATE64:
+        case arrow::Type::TIME64:
+        case arrow::Type::TIMESTAMP:
+            sf_hl_convert_array<int64_t>(array, from, n, out);
+            break;
+        case arrow::Type::UINT64:
+            sf_hl_convert_array<uint64_t>(array, from, n, out);
+            break;
+        case arrow::Type::FLOAT:
+            sf_hl_convert_array<float>(array, from, n, out);
+            break;
+        case arrow::Type::DOUBLE:
+            sf_hl_convert_array<double>(array, from, n, out);
+            break;
+        case arrow::Type::DECIMAL:
+            sf_hl_convert_decimal(array, from, n, out);
+            break;
+        default:
+            sf_errprintf("Unknown parquet type.\n");
+            return (17100);
+    }
+
+    // Dates and times to Stata dates and datetimes
+    sf_convert_apply(sf_convert_arrow(array->type()), out, n);
+
+    for (k = 0; k < n; k++) {
+        if ( (rc = SF_vstore(j + 1, sobs + k + 1, out[k])) ) return (rc);
+    }
+
+    return (rc);
+}
+
+ST_retcode sf_hl_store_string(
+    const std::shared_ptr<arrow::Array> &array,
+    int64_t j,
+    int64_t from,
+    int64_t to,
+    int64_t sobs,
+    int64_t vtype,
+    char *vstr)
+{
+    ST_retcode rc = 0;
+    int64_t i;
+    int32_t vlen;
+    const uint8_t *vptr;
+    std::shared_ptr<arrow::StringArray> values = std::static_pointer_cast<arrow::StringArray>(array);
+
+    // TODO: Check GetString won't fail w/actyally binary data
+    sobs -= from - 1;
+    for (i = from; i < to; i++) {
+        // Copy only the value and terminate it; there is no
+        // need to clear the rest of the buffer.
+        vptr = values->GetValue(i, &vlen);
+        if ( vlen > vtype ) {
+            sf_errprintf("Buffer (%d) too small; re-run with larger buffer or -strscan(.)-\n",
+                         vtype);
+            sf_errprintf("Row %d, col %d had a string of length %d.\n",
+                         sobs + i, j, vlen);
+            return (17103);
+        }
+        memcpy(vstr, vptr, vlen);
+        vstr[vlen] = '\0';
+        if ( (rc = SF_sstore(j + 1, sobs + i, vstr)) ) return (rc);
+    }
+
+    return (rc);
+}
+
+ST_retcode sf_hl_store_flstring(
+    const std::shared_ptr<arrow::Array> &array,
+    int64_t j,
+    int64_t from,
+    int64_t to,
+    int64_t sobs,
+    char *vstr)
+{
+    ST_retcode rc = 0;
+    int64_t i;
+    std::shared_ptr<arrow::FixedSizeBinaryArray> values =
+        std::static_pointer_cast<arrow::FixedSizeBinaryArray>(array);
+
+    // TODO: Check this actually works?
+    // TODO: GetString won't fail w/actyally binary data
+    sobs -= from - 1;
+    for (i = from; i < to; i++) {
+        memcpy(vstr, values->GetValue(i), values->byte_width());
+        vstr[values->byte_width()] = '\0';
+        if ( (rc = SF_sstore(j + 1, sobs + i, vstr)) ) return (rc);
+    }
+
+    return (rc);
+}
@@ -12,33 +12,52 @@
 //     __sparquet_readrg
 //     __sparquet_progress
 //     __sparquet_check
+//     __sparquet_filter
+//     __sparquet_batchsize
+//     __sparquet_mmap
+//     __sparquet_coalesce
+//     __sparquet_holesize
+//     __sparquet_rangesize
+
+// The reader streams record batches from the selected row groups and
+// copies each one into Stata before the next is decoded, so at most one
+// batch of the projected columns is held in memory besides the Stata
+// dataset (parquet-cpp may still decode a whole row group at a time).
+// Row groups outside in() or pruned by the if condition are not read.
 
 ST_retcode sf_hl_read_varlist(
     const char *fname,
+    const char *ffilter,
     const int verbose,
     const int debug,
     const uint64_t strbuffer)
 {
-    ST_double z, progress;
+    ST_double progress;
     ST_retcode rc = 0, any_rc = 0;
-    clock_t timer = clock();
-    clock_t stimer = clock();
-    int64_t r, i, j, c, ig, ix, ic, ir, readrg, _readrg, ngroup;
-    int64_t nfields, narrfrom, narrlen, nchunks, tobs, ttot, tevery, tread;
+    sf_clock timer = sf_clock_now();
+    sf_clock stimer = sf_clock_now();
+    int64_t r, j, k, b, ig, ir, readrg, _readrg, ngroup, nrg, koff, seg, row, from, to;
+    int64_t tobs, ttot, tevery, tread, batchsize = 65536, rgbytes, ceiling = 0;
     int64_t maxstrlen = 1, nthreads = 1, ncol = 1, infrom = 1, into = 1, nread = 0;
+    int64_t usefilter = 0, nrow_groups, rgrows;
+    sf_filter filter;
+    sf_io io;
 
     // int64_t vtype;
     SPARQUET_CHAR(vmatrix, 32);
     SPARQUET_CHAR(vscalar, 32);
 
-    if ( (rc = sf_scalar_int("__sparquet_threads",  18, &nthreads)) ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_ncol",     15, &ncol))     ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_infrom",   17, &infrom))   ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_into",     15, &into))     ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_readrg",   17, &readrg))   ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_ngroup",   17, &ngroup))   ) any_rc = rc;
-    if ( (rc = sf_scalar_dbl("__sparquet_progress", 19, &progress)) ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_check",    16, &tevery))   ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_threads",   18, &nthreads))  ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_ncol",      15, &ncol))      ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_infrom",    17, &infrom))    ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_into",      15, &into))      ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_readrg",    17, &readrg))    ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_ngroup",    17, &ngroup))    ) any_rc = rc;
+    if ( (rc = sf_scalar_dbl("__sparquet_progress",  19, &progress))  ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_check",     16, &tevery))    ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_filter",    17, &usefilter)) ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_batchsize", 20, &batchsize)) ) any_rc = rc;
+    if ( (rc = sf_io_init(&io)) ) any_rc = rc;
 
     // You don't adjust into in this case because we can loop from the
     // start, so no while ... trick
@@ -66,23 +85,39 @@ ST_retcode sf_hl_read_varlist(
     for (j = 0; j < ncol; j++)
         colix[j] = --_colix[j];
 
+    // Parse types
+    if ( (rc = sf_matrix_int("__sparquet_coltypes", 19, ncol, vtypes)) ) any_rc = rc;
+    for (j = 0; j < ncol; j++)
+        if ( vtypes[j] > maxstrlen ) maxstrlen = vtypes[j];
+
     if ( any_rc ) {
         rc = any_rc;
         goto exit;
     }
 
+    // Parse if condition into row group filters
+    if ( usefilter ) {
+        if ( (rc = sf_filter_parse(ffilter, ncol, &filter, debug)) ) goto exit;
+    }
+
     try {
 
-        // Read entire table
-        // -----------------
+        // Open file
+        // ---------
+
+        // With mmap, pages are sliced from the mapping instead of being
+        // read into buffers from the memory pool; with coalesce, column
+        // chunks of the row groups read come from merged reads.
+
+        std::shared_ptr<arrow::io::RandomAccessFile> infile = sf_io_open(fname, &io);
 
-        std::shared_ptr<arrow::io::ReadableFile> infile;
-        PARQUET_THROW_NOT_OK(arrow::io::ReadableFile::Open(
-            fname, arrow::default_memory_pool(), &infile));
+        parquet::arrow::ArrowReaderProperties arrow_properties;
+        arrow_properties.set_batch_size(batchsize);
 
+        // The footer parsed by earlier calls in this session is reused
         std::unique_ptr<parquet::arrow::FileReader> reader;
-        PARQUET_THROW_NOT_OK(
-            parquet::arrow::OpenFile(infile, arrow::default_memory_pool(), &reader));
+        PARQUET_THROW_NOT_OK(parquet::arrow::FileReader::Make(
+            arrow::default_memory_pool(), sf_session_reader(fname, infile), arrow_properties, &reader));
 
         if ( nthreads > 1 ) {
 
@@ -93,370 +128,165 @@ ST_retcode sf_hl_read_varlist(
             reader->set_use_threads(true);
         }
 
-        std::vector<std::shared_ptr<arrow::Table>> tables(_readrg, nullptr);
-        if ( readrg ) {
-            for (j = 0; j < _readrg; ++j) {
-                PARQUET_THROW_NOT_OK(reader->ReadRowGroup({rowgix[j]}, colix, &tables[j]));
+        // Row groups to read
+        // ------------------
+
+        // rgstart[k] is the first row of group rgs[k] relative to the
+        // row groups being considered (the file, or the rg() subset),
+        // so in() keeps its meaning when groups are skipped. With an if
+        // condition, only groups whose statistics do not rule it out
+        // are read.
+
+        std::shared_ptr<parquet::FileMetaData> file_metadata =
+            reader->parquet_reader()->metadata();
+
+        std::vector<int> rgs;
+        std::vector<int64_t> rgstart, rgnrow;
+
+        ir = 0;
+        nrow_groups = file_metadata->num_row_groups();
+        for (r = 0; r < (readrg? readrg: nrow_groups); ++r) {
+            ig = readrg? rowgix[r]: r;
+            if ( ig >= nrow_groups ) {
+                sf_errprintf("Attempted to row group %ld but file only had %ld.\n",
+                             ig + 1, nrow_groups);
+                rc = 17301;
+                goto exit;
             }
+            rgrows = file_metadata->RowGroup(ig)->num_rows();
+            if ( (ir + rgrows <= infrom) || (ir >= into) ) {
+                ir += rgrows;
+                continue;
+            }
+            if ( usefilter && !sf_filter_rowgroup(file_metadata->RowGroup(ig).get(), &filter, _colix) ) {
+                ir += rgrows;
+                continue;
+            }
+
+            // Decoded size of the projected columns; a batch is at most
+            // this large, or batchsize rows of it if that is smaller.
+            rgbytes = 0;
+            for (j = 0; j < ncol; j++)
+                rgbytes += file_metadata->RowGroup(ig)->ColumnChunk(colix[j])->total_uncompressed_size();
+            if ( rgrows > batchsize ) rgbytes = (int64_t) ((ST_double) rgbytes * batchsize / rgrows);
+            if ( rgbytes > ceiling ) ceiling = rgbytes;
+
+            rgs.push_back((int) ig);
+            rgstart.push_back(ir);
+            rgnrow.push_back(rgrows);
+            ir += rgrows;
         }
-        else {
-            PARQUET_THROW_NOT_OK(reader->ReadTable(colix, &tables[0]));
-        }
+        nrg = rgs.size();
+        sf_io_select(infile, &io, file_metadata, std::vector<int64_t>(rgs.begin(), rgs.end()),
+                     _colix, ncol, verbose);
 
-        sf_running_timer (&timer, "Read data into Arrow table"); 
-        ncol = tables[0]->num_columns();
-        for (j = 1; j < _readrg; ++j) {
-            if ( ncol != tables[j]->num_columns() ) {
-                sf_errprintf("Inconsistent columns across row groups\n");
-                rc = 17302;
-                goto exit;
-            }
+        if ( usefilter ) {
+            sf_printf("(note: if condition pruned %ld of %ld row groups)\n",
+                      filter.npruned, filter.nchecked);
         }
 
-        // Parse types
-        // -----------
+        sf_printf_debug(verbose, "\tFile:    %s\n",  fname);
+        sf_printf_debug(verbose, "\tGroups:  %ld of %ld\n", nrg, nrow_groups);
+        sf_printf_debug(verbose, "\tColumns: %ld\n", ncol);
+        sf_printf_debug(verbose, "\tRows:    %ld\n", into - infrom);
+        sf_printf_debug(verbose, "\tBatch:   %ld rows\n", batchsize);
+        sf_printf_debug(verbose, "\tMemory ceiling: %.1f MiB per batch (uncompressed size of the largest batch)\n",
+                        (ST_double) ceiling / 1024 / 1024);
 
-        if ( (rc = sf_matrix_int("__sparquet_coltypes", 19, ncol, vtypes)) ) any_rc = rc;
-        for (j = 0; j < ncol; j++)
-            if ( vtypes[j] > maxstrlen ) maxstrlen = vtypes[j];
+        SPARQUET_CHAR (vstr, maxstrlen + 1);
+        std::vector<ST_double> vdouble;
 
-        SPARQUET_CHAR (vstr, maxstrlen);
+        // Stream batches into Stata
+        // -------------------------
 
-        // Copy to stata
-        // -------------
+        // Batches are not guaranteed to line up with row groups, so each
+        // batch is copied in segments that do not cross a group boundary.
 
         parquet::Type::type id;
-        std::shared_ptr<arrow::BooleanArray>         boolarray;
-        std::shared_ptr<arrow::Int32Array>           i32array;
-        std::shared_ptr<arrow::Int64Array>           i64array;
-        std::shared_ptr<arrow::FloatArray>           floatarray;
-        std::shared_ptr<arrow::DoubleArray>          doublearray;
-        std::shared_ptr<arrow::StringArray>          strarray;
-        std::shared_ptr<arrow::FixedSizeBinaryArray> flstrarray;
-
-        ir = ic = ix = ig = 0;
-        for (r = 0; r < _readrg; ++r) {
-            ig = 0;
-            for (j = 0; j < ncol; j++) {
-                // vtype = vtypes[j];
-
-                // TODO version warning: table->column()->data() maybe got
-                // deprecated? just do table->column() in later versions.
-
-                // auto data = tables[r]->column(j);
-                auto data = tables[r]->column(j)->data();
-                nchunks = data->num_chunks();
-                ix = 0;
-                ic = 0;
-                id = get_physical_type(data->type()->id());
-                for (c = 0; c < nchunks; c++) {
-                    if ( id == Type::BOOLEAN )   {
-                        boolarray = std::static_pointer_cast<arrow::BooleanArray>(data->chunk(c));
-                        nfields = boolarray->num_fields();
-                        if ( nfields > 1 ) {
-                            sf_errprintf("Multiple fields not supported\n");
-                            rc = 17042;
-                            goto exit;
-                        }
-                        narrlen  = boolarray->length();
-                        narrfrom = 0;
-                        if ( narrlen > (into - (ir + ic)) ) {
-                            narrlen = into - (ir + ic);
-                        }
-                        if ( infrom > (ir + ic) ) {
-                            narrfrom = infrom - (ir + ic);
-                        }
-                        for (i = narrfrom; i < narrlen; i++) {
-                            if ( (ix + nread) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, ngroup,
-                                    j + 1, ncol,
-                                    ix + nread, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            if (boolarray->IsNull(i)) {
-                                z = SV_missval;
-                            }
-                            else {
-                                z = (double) boolarray->Value(i);
-                            }
-                            if ( (rc = SF_vstore(j + 1, ++ix + nread, z)) ) goto exit;
-                        }
-                        ic += boolarray->length();
-                    }
-                    else if ( id == Type::INT32 ) {
-                        i32array = std::static_pointer_cast<arrow::Int32Array>(data->chunk(c));
-                        nfields = i32array->num_fields();
-                        if ( nfields > 1 ) {
-                            sf_errprintf("Multiple fields not supported\n");
-                            rc = 17042;
-                            goto exit;
-                        }
-                        narrlen  = i32array->length();
-                        narrfrom = 0;
-                        if ( narrlen > (into - (ir + ic)) ) {
-                            narrlen = into - (ir + ic);
-                        }
-                        if ( infrom > (ir + ic) ) {
-                            narrfrom = infrom - (ir + ic);
-                        }
-                        for (i = narrfrom; i < narrlen; i++) {
-                            if ( (ix + nread) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, ngroup,
-                                    j + 1, ncol,
-                                    ix + nread, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            if (i32array->IsNull(i)) {
-                                z = SV_missval;
-                            }
-                            else {
-                                z = (double) i32array->Value(i);
-                            }
-                            if ( (rc = SF_vstore(j + 1, ++ix + nread, z)) ) goto exit;
-                        }
-                        ic += i32array->length();
+        std::shared_ptr<arrow::RecordBatchReader> batch_reader;
+        std::shared_ptr<arrow::RecordBatch> batch;
+        std::shared_ptr<arrow::Array> array;
+
+        k = koff = 0;
+        if ( nrg > 0 ) {
+            PARQUET_THROW_NOT_OK(reader->GetRecordBatchReader(rgs, colix, &batch_reader));
+        }
+        while ( k < nrg && rgstart[k] < into ) {
+            PARQUET_THROW_NOT_OK(batch_reader->ReadNext(&batch));
+            if ( batch == nullptr ) break;
+            if ( batch->num_columns() != ncol ) {
+                sf_errprintf("Inconsistent columns across row groups\n");
+                rc = 17302;
+                goto exit;
+            }
+
+            for (b = 0; b < batch->num_rows() && k < nrg; b += seg) {
+                seg  = std::min(batch->num_rows() - b, rgnrow[k] - koff);
+                row  = rgstart[k] + koff;
+                from = std::max(row, infrom);
+                to   = std::min(row + seg, into);
+                for (j = 0; j < ncol && from < to; j++) {
+                    array = batch->column(j);
+                    if ( array->num_fields() > 1 ) {
+                        sf_errprintf("Multiple fields not supported\n");
+                        rc = 17042;
+                        goto exit;
                     }
-                    else if ( id == Type::INT64 )  {
-                        i64array = std::static_pointer_cast<arrow::Int64Array>(data->chunk(c));
-                        nfields = i64array->num_fields();
-                        if ( nfields > 1 ) {
-                            sf_errprintf("Multiple fields not supported\n");
-                            rc = 17042;
-                            goto exit;
-                        }
-                        narrlen  = i64array->length();
-                        narrfrom = 0;
-                        if ( narrlen > (into - (ir + ic)) ) {
-                            narrlen = into - (ir + ic);
-                        }
-                        if ( infrom > (ir + ic) ) {
-                            narrfrom = infrom - (ir + ic);
-                        }
-                        for (i = narrfrom; i < narrlen; i++) {
-                            if ( (ix + nread) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, ngroup,
-                                    j + 1, ncol,
-                                    ix + nread, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            if (i64array->IsNull(i)) {
-                                z = SV_missval;
-                            }
-                            else {
-                                z = (double) i64array->Value(i);
-                            }
-                            if ( (rc = SF_vstore(j + 1, ++ix + nread, z)) ) goto exit;
-                        }
-                        ic += i64array->length();
+                    if ( array->type()->id() == arrow::Type::DICTIONARY ) {
+                        sf_errprintf("Dictionary arrays not supported by the high-level reader; try -encode-.\n");
+                        rc = 17100;
+                        goto exit;
                     }
-                    else if ( id == Type::INT96 ) {
+
+                    id = get_physical_type(array->type()->id());
+                    if ( id == Type::INT96 ) {
                         sf_errprintf("96-bit integers not implemented.\n");
                         rc = 17101;
-                        goto exit;
-                    }
-                    else if ( id == Type::FLOAT ) {
-                        floatarray = std::static_pointer_cast<arrow::FloatArray>(data->chunk(c));
-                        nfields = floatarray->num_fields();
-                        if ( nfields > 1 ) {
-                            sf_errprintf("Multiple fields not supported\n");
-                            rc = 17042;
-                            goto exit;
-                        }
-                        narrlen  = floatarray->length();
-                        narrfrom = 0;
-                        if ( narrlen > (into - (ir + ic)) ) {
-                            narrlen = into - (ir + ic);
-                        }
-                        if ( infrom > (ir + ic) ) {
-                            narrfrom = infrom - (ir + ic);
-                        }
-                        for (i = narrfrom; i < narrlen; i++) {
-                            if ( (ix + nread) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, ngroup,
-                                    j + 1, ncol,
-                                    ix + nread, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            if (floatarray->IsNull(i)) {
-                                z = SV_missval;
-                            }
-                            else {
-                                z = (double) floatarray->Value(i);
-                            }
-                            if ( (rc = SF_vstore(j + 1, ++ix + nread, z)) ) goto exit;
-                        }
-                        ic += floatarray->length();
-                    }
-                    else if ( id == Type::DOUBLE )     {
-                        doublearray = std::static_pointer_cast<arrow::DoubleArray>(data->chunk(c));
-                        nfields = doublearray->num_fields();
-                        if ( nfields > 1 ) {
-                            sf_errprintf("Multiple fields not supported\n");
-                            rc = 17042;
-                            goto exit;
-                        }
-                        narrlen  = doublearray->length();
-                        narrfrom = 0;
-                        if ( narrlen > (into - (ir + ic)) ) {
-                            narrlen = into - (ir + ic);
-                        }
-                        if ( infrom > (ir + ic) ) {
-                            narrfrom = infrom - (ir + ic);
-                        }
-                        for (i = narrfrom; i < narrlen; i++) {
-                            if ( (ix + nread) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, ngroup,
-                                    j + 1, ncol,
-                                    ix + nread, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            if (doublearray->IsNull(i)) {
-                                z = SV_missval;
-                            }
-                            else {
-                                z = doublearray->Value(i);
-                            }
-                            if ( (rc = SF_vstore(j + 1, ++ix + nread, z)) ) goto exit;
-                        }
-                        ic += doublearray->length();
                     }
                     else if ( id == Type::BYTE_ARRAY ) {
-                        strarray = std::static_pointer_cast<arrow::StringArray>(data->chunk(c));
-                        nfields = strarray->num_fields();
-                        if ( nfields > 1 ) {
-                            sf_errprintf("Multiple fields not supported\n");
-                            rc = 17042;
-                            goto exit;
-                        }
-                        narrlen  = strarray->length();
-                        narrfrom = 0;
-                        if ( narrlen > (into - (ir + ic)) ) {
-                            narrlen = into - (ir + ic);
-                        }
-                        if ( infrom > (ir + ic) ) {
-                            narrfrom = infrom - (ir + ic);
-                        }
-                        // TODO: Check GetString won't fail w/actyally binary data
-                        for (i = narrfrom; i < narrlen; i++) {
-                            if ( (ix + nread) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, ngroup,
-                                    j + 1, ncol,
-                                    ix + nread, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            // memcpy(vstr, strarray->GetString(i), strarray->value_length(i));
-                            if ( strarray->value_length(i) > vtypes[j] ) {
-                                sf_errprintf("Buffer (%d) too small; re-run with larger buffer or -strscan(.)-\n",
-                                             vtypes[j]);
-                                sf_errprintf("Chunk %d, row %d, col %d had a string of length %d.\n",
-                                             c, i + ix + 1, j, strarray->value_length(i));
-                                rc = 17103;
-                                goto exit;
-                            }
-                            strarray->GetString(i).copy(vstr, vtypes[j]);
-                            if ( (rc = SF_sstore(j + 1, ++ix + nread, vstr)) ) goto exit;
-                            memset(vstr, '\0', maxstrlen);
-                        }
-                        ic += strarray->length();
+                        rc = sf_hl_store_string(array, j, b + from - row, b + to - row, nread, vtypes[j], vstr);
                     }
-                    else if ( id == Type::FIXED_LEN_BYTE_ARRAY ) {
-                        flstrarray = std::static_pointer_cast<arrow::FixedSizeBinaryArray>(data->chunk(c));
-                        nfields = flstrarray->num_fields();
-                        if ( nfields > 1 ) {
-                            sf_errprintf("Multiple fields not supported\n");
-                            rc = 17042;
-                            goto exit;
-                        }
-                        narrlen  = flstrarray->length();
-                        narrfrom = 0;
-                        if ( narrlen > (into - (ir + ic)) ) {
-                            narrlen = into - (ir + ic);
-                        }
-                        if ( infrom > (ir + ic) ) {
-                            narrfrom = infrom - (ir + ic);
-                        }
-                        // TODO: Check this actually works?
-                        // TODO: GetString won't fail w/actyally binary data
-                        for (i = narrfrom; i < narrlen; i++) {
-                            if ( (ix + nread) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, ngroup,
-                                    j + 1, ncol,
-                                    ix + nread, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            memcpy(vstr, flstrarray->GetValue(i), flstrarray->byte_width());
-                            // memcpy(vstr, flstrarray->GetValue(i), vtype);
-                            if ( (rc = SF_sstore(j + 1, ++ix + nread, vstr)) ) goto exit;
-                            memset(vstr, '\0', maxstrlen);
-                        }
-                        ic += flstrarray->length();
+                    else if ( id == Type::FIXED_LEN_BYTE_ARRAY && array->type()->id() != arrow::Type::DECIMAL ) {
+                        rc = sf_hl_store_flstring(array, j, b + from - row, b + to - row, nread, vstr);
                     }
                     else {
-                        sf_errprintf("Unknown parquet type.\n");
-                        rc = 17100;
-                        goto exit;
+                        rc = sf_hl_store_numeric(array, j, b + from - row, b + to - row, nread, vdouble);
                     }
+                    if ( rc ) goto exit;
+
+                    tread += to - from;
+                    sf_running_progress_read(
+                        &timer,
+                        &stimer,
+                        progress,
+                        rgs[k] + 1, ngroup,
+                        j + 1, ncol,
+                        nread + to - from, tobs,
+                        100 * (ST_double) tread / ttot
+                    );
+                }
+                nread += from < to? to - from: 0;
+                koff  += seg;
+                if ( koff >= rgnrow[k] ) {
+                    k++;
+                    koff = 0;
                 }
-                ig = ix > ig? ix: ig;
             }
-            nread += ig;
-            ir += tables[r]->num_rows();
-        }
 
-        sf_running_timer (&timer, "Copied table into Stata");
+            // Release the batch before the next one is decoded
+            batch.reset();
+        }
 
-        sf_printf_debug(verbose, "\tFile:    %s\n",  fname);
-        sf_printf_debug(verbose, "\tColumns: %ld\n", ncol);
-        sf_printf_debug(verbose, "\tRows:    %ld\n", into - infrom);
+        sf_running_timer (&timer, "Copied batches into Stata");
+        sf_printf_debug(verbose, "\tArrow memory peak: %.1f MiB\n",
+                        (ST_double) arrow::default_memory_pool()->max_memory() / 1024 / 1024);
 
     } catch (const std::exception& e) {
         sf_errprintf("Parquet read error: %s\n", e.what());
         return(-1);
     }
 
-    if ( (into - infrom) != nread ) {
+    if ( !usefilter && (into - infrom) != nread ) {
         sf_errprintf("Warning: Expected %ld obs but found %ld\n",
                      (into - infrom), nread);
     }
@@ -0,0 +1,453 @@
+// Low-level batched column decoding
+// ---------------------------------
+//
+// The scanner API decodes one value per virtual call. Instead we pull
+// up to SPARQUET_BATCH levels at a time from TypedColumnReader::ReadBatch
+// into preallocated value and definition-level buffers, convert them to
+// ST_double in a tight loop, and only then store them into Stata.
+
+struct sf_ll_batch {
+    int64_t size;
+    int64_t maxstrlen;
+    std::vector<int16_t>   deflevels;
+    std::vector<int64_t>   values;   // 16 bytes per value fits every physical type
+    std::vector<ST_double> vdouble;
+    std::vector<char>      vstr;
+};
+
+void sf_ll_batch_init(sf_ll_batch *batch, int64_t size, int64_t maxstrlen)
+{
+    batch->size      = size;
+    batch->maxstrlen = maxstrlen;
+    batch->deflevels.assign(size, 0);
+    batch->values.assign(2 * size, 0);
+    batch->vdouble.assign(size, 0);
+    batch->vstr.assign(maxstrlen + 1, '\0');
+}
+
+// Column chunk to read: runs holds (first row, number of rows) pairs,
+// relative to the start of the row group and in increasing order. The
+// rows in each run are stored in Stata variable j + 1 one after the
+// other starting at Stata observation sobs + 1; rows between runs are
+// skipped. Progress info is passed through so the caller's timer is
+// updated once per batch.
+
+// Encoded string column (encode option): values get codes 1, 2, ...
+// in order of first appearance across row groups (and files); labels
+// holds the string for each code, to be turned into a value label.
+
+struct sf_ll_encoder {
+    std::unordered_map<std::string, int64_t> codes;
+    std::vector<std::string> labels;
+};
+
+// Code of the len bytes at ptr, added if new; 0 once there would be
+// more codes than a value label holds. The column types only encode
+// columns whose dictionaries fit, but a chunk can fall back to plain
+// pages with values outside its dictionary.
+
+int64_t sf_ll_encoder_code(sf_ll_encoder *encoder, const char *ptr, int64_t len)
+{
+    std::string value(ptr, len);
+    std::unordered_map<std::string, int64_t>::iterator code = encoder->codes.find(value);
+    if ( code != encoder->codes.end() ) return (code->second);
+    if ( (int64_t) encoder->labels.size() >= SPARQUET_LABELMAX ) return (0);
+    encoder->labels.push_back(value);
+    encoder->codes.insert(std::make_pair(value, (int64_t) encoder->labels.size()));
+    return ((int64_t) encoder->labels.size());
+}
+
+ST_retcode sf_ll_encoder_full(int64_t j)
+{
+    sf_errprintf("Column %ld has over %d distinct values, more than a value label holds; read it without -encode-.\n",
+                 j + 1, SPARQUET_LABELMAX);
+    return (17105);
+}
+
+struct sf_ll_chunk {
+    int64_t j;
+    int64_t vtype;
+    sf_ll_encoder *encoder;
+    std::vector<int64_t> runs;
+    int64_t sobs;
+    int64_t nread;
+    int64_t warn_strings;
+
+    // progress
+    sf_clock *timer;
+    sf_clock *stimer;
+    ST_double progress;
+    int64_t *tread;
+    int64_t ttot;
+    int64_t tobs;
+    int64_t r;
+    int64_t nrow_groups;
+    int64_t ncol;
+};
+
+void sf_ll_chunk_progress(sf_ll_chunk *chunk, int64_t levels)
+{
+    *(chunk->tread) += levels;
+    sf_running_progress_read(
+        chunk->timer,
+        chunk->stimer,
+        chunk->progress,
+        chunk->r + 1, chunk->nrow_groups,
+        chunk->j + 1, chunk->ncol,
+        chunk->sobs + chunk->nread, chunk->tobs,
+        100 * (ST_double) *(chunk->tread) / chunk->ttot
+    );
+}
+
+// Set the chunk runs for rows [ix, ix + rgrows) of a row group from the
+// selected runs, which are numbered across row groups. Runs are in
+// increasing order, so *u (the first run not yet fully read) only moves
+// forward. Returns false if no row in the group is selected.
+
+bool sf_ll_chunk_runs(
+    sf_ll_chunk *chunk,
+    const std::vector<int64_t> &runs,
+    int64_t *u,
+    int64_t ix,
+    int64_t rgrows)
+{
+    int64_t from, to, end;
+    chunk->runs.clear();
+    while ( *u + 1 < (int64_t) runs.size() && runs[*u] < ix + rgrows ) {
+        end  = runs[*u] + runs[*u + 1];
+        from = std::max(runs[*u], ix);
+        to   = std::min(end, ix + rgrows);
+        chunk->runs.push_back(from - ix);
+        chunk->runs.push_back(to - from);
+        if ( end > ix + rgrows ) break;
+        *u += 2;
+    }
+    return (!chunk->runs.empty());
+}
+
+// Skip rows before the next run. ColumnReader::Skip drops whole pages
+// without decoding them whenever the skip spans the rest of the page,
+// and only decodes (and discards) values within the first page that
+// has rows we want.
+
+template <typename DType>
+void sf_ll_skip_rows(
+    parquet::TypedColumnReader<DType> *reader,
+    int64_t nskip)
+{
+    if ( nskip > 0 ) {
+        reader->Skip(nskip);
+    }
+}
+
+// Numeric types: bool, int32, int64, int96, float, double, and
+// decimals stored as byte arrays. Each value is decoded with
+// sf_convert_raw (a cast for the plain numeric types) and dates, times
+// and decimals are then scaled to Stata units (see sf_convert_type).
+
+template <typename DType>
+ST_retcode sf_ll_read_numeric_batch(
+    parquet::ColumnReader *column_reader,
+    const parquet::ColumnDescriptor *descr,
+    sf_ll_batch *batch,
+    sf_ll_chunk *chunk)
+{
+    ST_retcode rc = 0;
+    typedef typename DType::c_type T;
+    parquet::TypedColumnReader<DType> *reader =
+        static_cast<parquet::TypedColumnReader<DType>*>(column_reader);
+
+    T *values = reinterpret_cast<T*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    ST_double *vdouble = batch->vdouble.data();
+    int16_t maxdef = descr->max_definition_level();
+    int64_t u, k, v, levels, nvalues, sobs, nwant, pos = 0;
+    int64_t type_length = descr->type_length();
+    sf_convert convert = sf_convert_type(descr);
+
+    for (u = 0; u + 1 < (int64_t) chunk->runs.size(); u += 2) {
+        sf_ll_skip_rows<DType>(reader, chunk->runs[u] - pos);
+        pos   = chunk->runs[u];
+        nwant = chunk->nread + chunk->runs[u + 1];
+        while ( chunk->nread < nwant && reader->HasNext() ) {
+            levels = reader->ReadBatch(
+                std::min(nwant - chunk->nread, batch->size),
+                deflevels,
+                nullptr,
+                values,
+                &nvalues
+            );
+
+            // All values present is the common case; otherwise values are
+            // packed and we expand them along the definition levels.
+            if ( nvalues == levels ) {
+                for (k = 0; k < levels; k++)
+                    vdouble[k] = sf_convert_raw(values[k], type_length);
+            }
+            else {
+                for (k = v = 0; k < levels; k++)
+                    vdouble[k] = deflevels[k] < maxdef? SV_missval: sf_convert_raw(values[v++], type_length);
+            }
+            sf_convert_apply(convert, vdouble, levels);
+
+            sobs = chunk->sobs + chunk->nread + 1;
+            for (k = 0; k < levels; k++) {
+                if ( (rc = SF_vstore(chunk->j + 1, sobs + k, vdouble[k])) ) return (rc);
+            }
+
+            pos += levels;
+            chunk->nread += levels;
+            sf_ll_chunk_progress(chunk, levels);
+        }
+    }
+
+    return (rc);
+}
+
+// String types: ByteArray and FixedLenByteArray
+//
+// SF_sstore only needs a NUL-terminated string, so each value is copied
+// into vstr and terminated at its own length; nothing past it is cleared
+// (the buffer is as wide as the widest string variable, and clearing all
+// of it per value was the bulk of the cost for short strings). Within a
+// batch, a value that points to the same bytes as the previous one (e.g.
+// consecutive repeats from a dictionary page) is not copied again.
+
+inline const uint8_t *sf_ll_strptr(const parquet::ByteArray &value) { return value.ptr; }
+inline const uint8_t *sf_ll_strptr(const parquet::FixedLenByteArray &value) { return value.ptr; }
+inline int64_t sf_ll_strlen(const parquet::ByteArray &value, int64_t) { return value.len; }
+inline int64_t sf_ll_strlen(const parquet::FixedLenByteArray &, int64_t len) { return len; }
+
+template <typename DType>
+ST_retcode sf_ll_read_string_batch(
+    parquet::ColumnReader *column_reader,
+    const parquet::ColumnDescriptor *descr,
+    sf_ll_batch *batch,
+    sf_ll_chunk *chunk)
+{
+    ST_retcode rc = 0;
+    typedef typename DType::c_type T;
+    parquet::TypedColumnReader<DType> *reader =
+        static_cast<parquet::TypedColumnReader<DType>*>(column_reader);
+
+    T *values = reinterpret_cast<T*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    char *vstr = batch->vstr.data();
+    int16_t maxdef = descr->max_definition_level();
+    int64_t u, k, v, vlen, levels, nvalues, sobs, nwant, pos = 0;
+    int64_t type_length = descr->type_length();
+    const uint8_t *vptr, *prevptr;
+    int64_t prevlen;
+
+    for (u = 0; u + 1 < (int64_t) chunk->runs.size(); u += 2) {
+        sf_ll_skip_rows<DType>(reader, chunk->runs[u] - pos);
+        pos   = chunk->runs[u];
+        nwant = chunk->nread + chunk->runs[u + 1];
+        while ( chunk->nread < nwant && reader->HasNext() ) {
+            levels = reader->ReadBatch(
+                std::min(nwant - chunk->nread, batch->size),
+                deflevels,
+                nullptr,
+                values,
+                &nvalues
+            );
+
+            // Pointers are only comparable within a batch; the decoder
+            // may reuse its buffers across calls to ReadBatch.
+            prevptr = nullptr;
+            prevlen = -1;
+
+            sobs = chunk->sobs + chunk->nread + 1;
+            for (k = v = 0; k < levels; k++) {
+                if ( nvalues < levels && deflevels[k] < maxdef ) {
+                    chunk->warn_strings++;
+                    continue;
+                }
+                vptr = sf_ll_strptr(values[v]);
+                vlen = sf_ll_strlen(values[v++], type_length);
+                if ( vlen > chunk->vtype ) {
+                    sf_errprintf("Buffer (%d) too small; re-run with larger buffer or -strscan(.)-\n",
+                                 chunk->vtype);
+                    sf_errprintf("Group %d, row %d, col %d had a string of length %d.\n",
+                                 chunk->r, pos + k, chunk->j, vlen);
+                    return (17103);
+                }
+                if ( vptr != prevptr || vlen != prevlen ) {
+                    memcpy(vstr, vptr, vlen);
+                    vstr[vlen] = '\0';
+                    prevptr = vptr;
+                    prevlen = vlen;
+                }
+                if ( (rc = SF_sstore(chunk->j + 1, sobs + k, vstr)) ) return (rc);
+            }
+
+            pos += levels;
+            chunk->nread += levels;
+            sf_ll_chunk_progress(chunk, levels);
+        }
+    }
+
+    return (rc);
+}
+
+// Dictionary-encoded strings read as codes (encode option)
+//
+// parquet-cpp does not expose the dictionary indices, but values read
+// from a dictionary page all point into the decoded dictionary, so
+// within a batch each distinct pointer is looked up in the string map
+// only once. Empty strings and nulls are stored as missing, as with
+// Stata's encode.
+
+ST_retcode sf_ll_read_encoded_batch(
+    parquet::ColumnReader *column_reader,
+    const parquet::ColumnDescriptor *descr,
+    sf_ll_batch *batch,
+    sf_ll_chunk *chunk)
+{
+    ST_retcode rc = 0;
+    parquet::TypedColumnReader<parquet::ByteArrayType> *reader =
+        static_cast<parquet::TypedColumnReader<parquet::ByteArrayType>*>(column_reader);
+
+    parquet::ByteArray *values = reinterpret_cast<parquet::ByteArray*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    ST_double *vdouble = batch->vdouble.data();
+    int16_t maxdef = descr->max_definition_level();
+    int64_t u, k, v, levels, nvalues, sobs, nwant, code, pos = 0;
+    sf_ll_encoder *encoder = chunk->encoder;
+    std::unordered_map<const uint8_t*, int64_t> ptrcodes;
+    std::unordered_map<const uint8_t*, int64_t>::iterator ptrcode;
+
+    for (u = 0; u + 1 < (int64_t) chunk->runs.size(); u += 2) {
+        sf_ll_skip_rows<parquet::ByteArrayType>(reader, chunk->runs[u] - pos);
+        pos   = chunk->runs[u];
+        nwant = chunk->nread + chunk->runs[u + 1];
+        while ( chunk->nread < nwant && reader->HasNext() ) {
+            levels = reader->ReadBatch(
+                std::min(nwant - chunk->nread, batch->size),
+                deflevels,
+                nullptr,
+                values,
+                &nvalues
+            );
+
+            // Pointers are only comparable within a batch
+            ptrcodes.clear();
+            for (k = v = 0; k < levels; k++) {
+                if ( nvalues < levels && deflevels[k] < maxdef ) {
+                    vdouble[k] = SV_missval;
+                    continue;
+                }
+                if ( values[v].len == 0 ) {
+                    vdouble[k] = SV_missval;
+                    v++;
+                    continue;
+                }
+                ptrcode = ptrcodes.find(values[v].ptr);
+                if ( ptrcode == ptrcodes.end() ) {
+                    code = sf_ll_encoder_code(encoder, reinterpret_cast<const char*>(values[v].ptr), values[v].len);
+                    if ( code == 0 ) return (sf_ll_encoder_full(chunk->j));
+                    ptrcode = ptrcodes.insert(std::make_pair(values[v].ptr, code)).first;
+                }
+                vdouble[k] = (ST_double) ptrcode->second;
+                v++;
+            }
+
+            sobs = chunk->sobs + chunk->nread + 1;
+            for (k = 0; k < levels; k++) {
+                if ( (rc = SF_vstore(chunk->j + 1, sobs + k, vdouble[k])) ) return (rc);
+            }
+
+            pos += levels;
+            chunk->nread += levels;
+            sf_ll_chunk_progress(chunk, levels);
+        }
+    }
+
+    return (rc);
+}
+
+// Write the value labels of the encoded columns: for each, a line with
+// the Stata variable index and number of codes, then each label as a
+// line with its length in bytes followed by the label and a newline.
+// Strings can contain newlines, so labels are not read as lines.
+
+ST_retcode sf_ll_encoder_write(
+    const char *flabels,
+    std::vector<sf_ll_encoder> &encoders)
+{
+    size_t j, k;
+    std::ofstream fstream;
+    fstream.open(flabels, std::ios::binary | std::ios::trunc);
+    if ( !fstream.is_open() ) {
+        sf_errprintf("Unable to write file '%s'\n", flabels);
+        return (603);
+    }
+    for (j = 0; j < encoders.size(); j++) {
+        if ( encoders[j].labels.empty() ) continue;
+        fstream << j + 1 << " " << encoders[j].labels.size() << "\n";
+        for (k = 0; k < encoders[j].labels.size(); k++) {
+            fstream << encoders[j].labels[k].size() << "\n" << encoders[j].labels[k] << "\n";
+        }
+    }
+    fstream.close();
+    return (0);
+}
+
+// Dispatch on the physical type of the column chunk
+
+ST_retcode sf_ll_read_chunk(
+    std::shared_ptr<parquet::RowGroupReader> row_group_reader,
+    const parquet::ColumnDescriptor *descr,
+    int64_t jsel,
+    sf_ll_batch *batch,
+    sf_ll_chunk *chunk)
+{
+    std::shared_ptr<parquet::ColumnReader> column_reader;
+
+    chunk->nread = 0;
+    switch (descr->physical_type()) {
+        case Type::BOOLEAN:    // byte
+            column_reader = row_group_reader->Column(jsel);
+            return (sf_ll_read_numeric_batch<parquet::BooleanType>(column_reader.get(), descr, batch, chunk));
+        case Type::INT32:      // long
+            column_reader = row_group_reader->Column(jsel);
+            return (sf_ll_read_numeric_batch<parquet::Int32Type>(column_reader.get(), descr, batch, chunk));
+        case Type::INT64:      // double
+            column_reader = row_group_reader->Column(jsel);
+            return (sf_ll_read_numeric_batch<parquet::Int64Type>(column_reader.get(), descr, batch, chunk));
+        case Type::INT96:      // double (%tc)
+            column_reader = row_group_reader->Column(jsel);
+            return (sf_ll_read_numeric_batch<parquet::Int96Type>(column_reader.get(), descr, batch, chunk));
+        case Type::FLOAT:      // float
+            column_reader = row_group_reader->Column(jsel);
+            return (sf_ll_read_numeric_batch<parquet::FloatType>(column_reader.get(), descr, batch, chunk));
+        case Type::DOUBLE:     // double
+            column_reader = row_group_reader->Column(jsel);
+            return (sf_ll_read_numeric_batch<parquet::DoubleType>(column_reader.get(), descr, batch, chunk));
+        case Type::BYTE_ARRAY: // str#, strL; long with encode; double if decimal
+            column_reader = row_group_reader->Column(jsel);
+            if ( sf_convert_type(descr).fmt == SPARQUET_FMT_DECIMAL ) {
+                return (sf_ll_read_numeric_batch<parquet::ByteArrayType>(column_reader.get(), descr, batch, chunk));
+            }
+            if ( chunk->encoder ) {
+                return (sf_ll_read_encoded_batch(column_reader.get(), descr, batch, chunk));
+            }
+            return (sf_ll_read_string_batch<parquet::ByteArrayType>(column_reader.get(), descr, batch, chunk));
+        case Type::FIXED_LEN_BYTE_ARRAY: // str#; double if decimal
+            if ( sf_convert_type(descr).fmt == SPARQUET_FMT_DECIMAL ) {
+                column_reader = row_group_reader->Column(jsel);
+                return (sf_ll_read_numeric_batch<parquet::FLBAType>(column_reader.get(), descr, batch, chunk));
+            }
+            if ( descr->type_length() > chunk->vtype ) {
+                sf_errprintf("Buffer (%d) too small; error parsing FixedLenByteArray.\n", chunk->vtype);
+                sf_errprintf("Group %d, col %d had a string of length %d.\n",
+                             chunk->r, chunk->j, descr->type_length());
+                return (17103);
+            }
+            column_reader = row_group_reader->Column(jsel);
+            return (sf_ll_read_string_batch<parquet::FLBAType>(column_reader.get(), descr, batch, chunk));
+        default:
+            sf_errprintf("Unknown parquet type.\n");
+            return (17100);
+    }
+}
@@ -8,53 +8,43 @@
 //     __sparquet_into
 //     __sparquet_infrom
 //     __sparquet_progress
-//     __sparquet_check
+//     __sparquet_filter
+//     __sparquet_nselect
+//     __sparquet_threads
+//     __sparquet_prefetch
+//     __sparquet_mmap
+//     __sparquet_coalesce
+//     __sparquet_holesize
+//     __sparquet_rangesize
 
 ST_retcode sf_ll_read_varlist_multi(
     const char *flist,
+    const char *fselect,
+    const char *flabels,
     const int verbose,
     const int debug,
     const uint64_t strbuffer)
 {
     ST_retcode rc = 0, any_rc = 0;
 
-    bool is_null;
     ST_double progress;
-    int64_t nrow, nrow_groups, maxstrlen, tobs, ttot, tevery, tread, ngroup;
-    int64_t r, i, j, jsel, ix, ig, f;
-    int64_t warn_strings = 0, ncol = 1, infrom = 0, into = 0, nfiles = 0, nread = 0;
+    int64_t nrow_groups, maxstrlen, tobs, ttot, tread, ngroup, rgrows;
+    int64_t r, j, jsel, ix, u, f, rgread, rgskip = 0;
+    int64_t ncol = 1, infrom = 0, into = 0, nfiles = 0, nread = 0, usefilter = 0;
+    int64_t nthreads = 1, ngroups = 0, prefetch = 0, nahead;
     SPARQUET_CHAR(vscalar, 32);
 
-    // Declare all the value types
-    // ---------------------------
-
-    bool vbool;
-    int32_t vint32;
-    int64_t vint64;
-    float vfloat;
-    double vdouble;
-    parquet::ByteArray vbytearray;
-    parquet::FixedLenByteArray vfixedlen;
-
     // Declare all the readers
     // -----------------------
 
-    // std::shared_ptr<parquet::ColumnReader> column_reader;
     std::shared_ptr<parquet::RowGroupReader> row_group_reader;
-
-    std::shared_ptr<parquet::BoolScanner>  bool_scanner;
-    std::shared_ptr<parquet::Int32Scanner> int32_scanner;
-    std::shared_ptr<parquet::Int64Scanner> int64_scanner;
-    std::shared_ptr<parquet::FloatScanner> float_scanner;
-    std::shared_ptr<parquet::DoubleScanner> double_scanner;
-    std::shared_ptr<parquet::ByteArrayScanner> ba_scanner;
-    std::shared_ptr<parquet::FixedLenByteArrayScanner> flba_scanner;
-
-    // Not implemented in Stata
-    // ------------------------
-
-    // parquet::Int96 vint96;
-    // parquet::Int96Reader* int96_reader;
+    sf_ll_batch batch;
+    std::vector<sf_ll_encoder> encoders;
+    sf_ll_chunk chunk;
+    std::vector<int64_t> runs;
+    std::vector<sf_ll_task> tasks;
+    std::vector<std::string> fnames;
+    sf_io io;
 
     // File reader
     // -----------
@@ -68,14 +58,10 @@ ST_retcode sf_ll_read_varlist_multi(
         if ( (rc = sf_scalar_int("__sparquet_into",     15, &into))     ) any_rc = rc;
         if ( (rc = sf_scalar_int("__sparquet_ngroup",   17, &ngroup))   ) any_rc = rc;
         if ( (rc = sf_scalar_dbl("__sparquet_progress", 19, &progress)) ) any_rc = rc;
-        if ( (rc = sf_scalar_int("__sparquet_check",    16, &tevery))   ) any_rc = rc;
-        --into; --infrom;
-
-        tobs   = into - infrom + 1;
-        ttot   = ncol * tobs;
-        tread  = 0;
-        // tevery = 100000;
-
+        if ( (rc = sf_scalar_int("__sparquet_filter",   17, &usefilter))) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_threads",  18, &nthreads)) ) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_prefetch", 19, &prefetch)) ) any_rc = rc;
+        if ( (rc = sf_io_init(&io)) ) any_rc = rc;
         maxstrlen = 1;
         int64_t vtypes[ncol];
         int64_t colix[ncol];
@@ -90,16 +76,34 @@ ST_retcode sf_ll_read_varlist_multi(
         for (j = 0; j < ncol; j++)
             if ( vtypes[j] > maxstrlen ) maxstrlen = vtypes[j];
 
-        SPARQUET_CHAR(vstr, maxstrlen);
+        sf_ll_batch_init(&batch, SPARQUET_BATCH, maxstrlen);
+        encoders.resize(ncol);
         if ( any_rc ) {
             rc = any_rc;
             goto exit;
         }
 
+        // Rows to read; with an if condition they were selected by
+        // sf_ll_select_varlist, otherwise it is the in() range.
+        if ( usefilter ) {
+            if ( (rc = sf_ll_select_read(fselect, runs)) ) goto exit;
+        }
+        else {
+            runs.push_back(infrom - 1);
+            runs.push_back(into - infrom + 1);
+        }
+
+        for (tobs = 0, u = 1; u < (int64_t) runs.size(); u += 2)
+            tobs += runs[u];
+
+        ttot   = ncol * tobs;
+        tread  = 0;
+
         // Loop through files
         // ------------------
 
         std::shared_ptr<parquet::FileMetaData> file_metadata;
+        std::shared_ptr<arrow::io::RandomAccessFile> source;
         std::unique_ptr<parquet::ParquetFileReader> parquet_reader;
 
         std::string fname;
@@ -108,18 +112,44 @@ ST_retcode sf_ll_read_varlist_multi(
 
         f = 0;
         if ( fstream.is_open() ) {
-            ix = ig = 0;
-            clock_t  timer = clock();
-            clock_t stimer = clock();
+            ix = u = 0;
+            sf_clock  timer = sf_clock_now();
+            sf_clock stimer = sf_clock_now();
+
+            chunk.warn_strings = 0;
+            chunk.timer        = &timer;
+            chunk.stimer       = &stimer;
+            chunk.progress     = progress;
+            chunk.tread        = &tread;
+            chunk.ttot         = ttot;
+            chunk.tobs         = tobs;
+            chunk.nrow_groups  = ngroup;
+            chunk.ncol         = ncol;
+
             while ( std::getline(fstream, fname) ) {
+                if ( u >= (int64_t) runs.size() ) break;
                 f++;
-                parquet_reader = parquet::ParquetFileReader::OpenFile(fname, false);
+                source         = sf_io_open(fname, &io);
+                parquet_reader = sf_session_reader(fname, source);
                 file_metadata  = parquet_reader->metadata();
                 nrow_groups    = file_metadata->num_row_groups();
 
                 sf_printf_debug(verbose, "\tFile: %s (%ld rows)\n",
                                 fname.c_str(), file_metadata->num_rows());
 
+                // Files that end before the next selected row are skipped whole
+                if ( ix + file_metadata->num_rows() <= runs[u] ) {
+                    ix += file_metadata->num_rows();
+                    rgskip += nrow_groups;
+                    ++nfiles;
+                    continue;
+                }
+                if ( nthreads <= 1 && prefetch <= 0 ) {
+                    sf_io_select(source, &io, file_metadata,
+                                 sf_io_rowgroups(file_metadata, 0, nullptr, runs, u, ix),
+                                 colix, ncol, 0);
+                }
+
                 // Read all the observations in the file
                 // -------------------------------------
 
@@ -127,231 +157,63 @@ ST_retcode sf_ll_read_varlist_multi(
                 // For each column, loop through each row
 
                 for (r = 0; r < nrow_groups; ++r) {
-                    ix += ig;
-                    ig = 0;
-                    if ( ix > into ) break;
+                    if ( u >= (int64_t) runs.size() ) break;
+
+                    // Jump over groups with no selected rows using only the
+                    // footer metadata; no column chunk is touched.
+                    rgrows = file_metadata->RowGroup(r)->num_rows();
+                    if ( !sf_ll_chunk_runs(&chunk, runs, &u, ix, rgrows) ) {
+                        ix += rgrows;
+                        rgskip++;
+                        continue;
+                    }
+
+                    // With threads(#) or prefetch(#) only queue the column
+                    // chunks; they are decoded by the worker pool once all
+                    // files are known.
+                    chunk.sobs = nread;
+                    if ( nthreads > 1 || prefetch > 0 ) {
+                        if ( fnames.empty() || fnames.back() != fname ) fnames.push_back(fname);
+                        nread += sf_ll_tasks_add(tasks, fnames.size() - 1, r, ngroups++, &chunk, ncol, colix, vtypes,
+                                                 file_metadata->RowGroup(r).get());
+                        ix += rgrows;
+                        continue;
+                    }
+
+                    rgread = 0;
                     row_group_reader = parquet_reader->RowGroup(r);
+
+                    chunk.r    = f - 1;
                     for (j = 0; j < ncol; j++) {
-                        i = 0;
                         jsel = colix[j];
-                        // column_reader = row_group_reader->Column(jsel);
                         descr = file_metadata->schema()->Column(jsel);
-                        switch (descr->physical_type()) {
-                            case Type::BOOLEAN:    // byte
-                                bool_scanner = std::make_shared<parquet::BoolScanner>(row_group_reader->Column(jsel));
-                                while ( bool_scanner->HasNext() && i++ < (infrom - ix) ) {
-                                    bool_scanner->NextValue(&vbool, &is_null);
-                                }
-                                i--;
-                                while ( bool_scanner->HasNext() && i++ <= (into - ix) ) {
-                                    if ( (i - infrom) % tevery == 0 ) {
-                                        tread += tevery;
-                                        sf_running_progress_read(
-                                            &timer,
-                                            &stimer,
-                                            progress,
-                                            f, ngroup,
-                                            j + 1, ncol,
-                                            i + ix - infrom, tobs,
-                                            100 * tread / ttot
-                                        );
-                                    }
-                                    bool_scanner->NextValue(&vbool, &is_null);
-                                    // sf_printf_debug(2, "\t(bool, %ld, %ld): %9.4f\n", j, i + ix, (ST_double) vbool);
-                                    if ( (rc = SF_vstore(j + 1, i + ix - infrom, is_null? SV_missval: (ST_double) vbool)) ) goto exit;
-                                }
-                                break;
-                            case Type::INT32:      // long
-                                int32_scanner = std::make_shared<parquet::Int32Scanner>(row_group_reader->Column(jsel));
-                                while ( int32_scanner->HasNext() && i++ < (infrom - ix) ) {
-                                    int32_scanner->NextValue(&vint32, &is_null);
-                                }
-                                i--;
-                                while ( int32_scanner->HasNext() && i++ <= (into - ix) ) {
-                                    if ( (i - infrom) % tevery == 0 ) {
-                                        tread += tevery;
-                                        sf_running_progress_read(
-                                            &timer,
-                                            &stimer,
-                                            progress,
-                                            f, ngroup,
-                                            j + 1, ncol,
-                                            i + ix - infrom, tobs,
-                                            100 * tread / ttot
-                                        );
-                                    }
-                                    int32_scanner->NextValue(&vint32, &is_null);
-                                    // sf_printf_debug(2, "\t(int32, %ld, %ld): %9.4f\n", j, i + ix, (ST_double) vint32);
-                                    if ( (rc = SF_vstore(j + 1, i + ix - infrom, is_null? SV_missval: (ST_double) vint32)) ) goto exit;
-                                }
-                                break;
-                            case Type::INT64:      // double
-                                int64_scanner = std::make_shared<parquet::Int64Scanner>(row_group_reader->Column(jsel));
-                                while ( int64_scanner->HasNext() && i++ < (infrom - ix) ) {
-                                    int64_scanner->NextValue(&vint64, &is_null);
-                                }
-                                i--;
-                                while ( int64_scanner->HasNext() && i++ <= (into - ix) ) {
-                                    if ( (i - infrom) % tevery == 0 ) {
-                                        tread += tevery;
-                                        sf_running_progress_read(
-                                            &timer,
-                                            &stimer,
-                                            progress,
-                                            f, ngroup,
-                                            j + 1, ncol,
-                                            i + ix - infrom, tobs,
-                                            100 * tread / ttot
-                                        );
-                                    }
-                                    int64_scanner->NextValue(&vint64, &is_null);
-                                    // sf_printf_debug(2, "\t(int64, %ld, %ld): %9.4f\n", j, i + ix, (ST_double) vint64);
-                                    if ( (rc = SF_vstore(j + 1, i + ix - infrom, is_null? SV_missval: (ST_double) vint64)) ) goto exit;
-                                }
-                                break;
-                            case Type::INT96:
-                                sf_errprintf("96-bit integers not implemented.\n");
-                                rc = 17101;
-                                goto exit;
-                            case Type::FLOAT:      // float
-                                float_scanner = std::make_shared<parquet::FloatScanner>(row_group_reader->Column(jsel));
-                                while ( float_scanner->HasNext() && i++ < (infrom - ix) ) {
-                                    float_scanner->NextValue(&vfloat, &is_null);
-                                }
-                                i--;
-                                while ( float_scanner->HasNext() && i++ <= (into - ix) ) {
-                                    if ( (i - infrom) % tevery == 0 ) {
-                                        tread += tevery;
-                                        sf_running_progress_read(
-                                            &timer,
-                                            &stimer,
-                                            progress,
-                                            f, ngroup,
-                                            j + 1, ncol,
-                                            i + ix - infrom, tobs,
-                                            100 * tread / ttot
-                                        );
-                                    }
-                                    float_scanner->NextValue(&vfloat, &is_null);
-                                    // sf_printf_debug(2, "\t(float, %ld, %ld): %9.4f\n", j, i + ix, (ST_double) vfloat);
-                                    if ( (rc = SF_vstore(j + 1, i + ix - infrom, is_null? SV_missval: (ST_double) vfloat)) ) goto exit;
-                                }
-                                break;
-                            case Type::DOUBLE:     // double
-                                double_scanner = std::make_shared<parquet::DoubleScanner>(row_group_reader->Column(jsel));
-                                while ( double_scanner->HasNext() && i++ < (infrom - ix) ) {
-                                    double_scanner->NextValue(&vdouble, &is_null);
-                                }
-                                i--;
-                                while ( double_scanner->HasNext() && i++ <= (into - ix) ) {
-                                    if ( (i - infrom) % tevery == 0 ) {
-                                        tread += tevery;
-                                        sf_running_progress_read(
-                                            &timer,
-                                            &stimer,
-                                            progress,
-                                            f, ngroup,
-                                            j + 1, ncol,
-                                            i + ix - infrom, tobs,
-                                            100 * tread / ttot
-                                        );
-                                    }
-                                    double_scanner->NextValue(&vdouble, &is_null);
-                                    // sf_printf_debug(debug, "\t(double, %ld, %ld): %9.4f\n", j, i + ix, (ST_double) vdouble);
-                                    if ( (rc = SF_vstore(j + 1, i + ix - infrom, is_null? SV_missval: vdouble)) ) goto exit;
-                                }
-                                break;
-                            case Type::BYTE_ARRAY: // str#, strL
-                                ba_scanner = std::make_shared<parquet::ByteArrayScanner>(row_group_reader->Column(jsel));
-                                while ( ba_scanner->HasNext() && i++ < (infrom - ix) ) {
-                                    ba_scanner->NextValue(&vbytearray, &is_null);
-                                }
-                                i--;
-                                while ( ba_scanner->HasNext() && i++ <= (into - ix) ) {
-                                    if ( (i - infrom) % tevery == 0 ) {
-                                        tread += tevery;
-                                        sf_running_progress_read(
-                                            &timer,
-                                            &stimer,
-                                            progress,
-                                            f, ngroup,
-                                            j + 1, ncol,
-                                            i + ix - infrom, tobs,
-                                            100 * tread / ttot
-                                        );
-                                    }
-                                    ba_scanner->NextValue(&vbytearray, &is_null);
-                                    if ( is_null ) {
-                                        warn_strings++;
-                                    }
-                                    else if ( vbytearray.len > vtypes[j] ) {
-                                        sf_errprintf("Buffer (%d) too small; re-run with larger buffer or -strscan(.)-\n", vtypes[j]);
-                                        sf_errprintf("Group %d, row %d, col %d had a string of length %d.\n", r, i + ix, j, vbytearray.len);
-                                        rc = 17103;
-                                        goto exit;
-                                    }
-                                    else {
-                                        memcpy(vstr, vbytearray.ptr, vbytearray.len);
-                                        // sf_printf_debug(debug, "\t(BA, %ld, %ld): %s\n", j, i + ix, vstr);
-                                        if ( (rc = SF_sstore(j + 1, i + ix - infrom, vstr)) ) goto exit;
-                                        memset(vstr, '\0', maxstrlen);
-                                    }
-                                }
-                                break;
-                            case Type::FIXED_LEN_BYTE_ARRAY:
-                                if ( descr->type_length() > vtypes[j] ) {
-                                    sf_errprintf("Buffer (%d) too small; error parsing FixedLenByteArray.\n", vtypes[j]);
-                                    sf_errprintf("Group %d, row %d, col %d had a string of length %d.\n", r, i + ix, j, descr->type_length());
-                                    rc = 17103;
-                                    goto exit;
-                                }
-                                else {
-                                    flba_scanner = std::make_shared<parquet::FixedLenByteArrayScanner>(row_group_reader->Column(jsel));
-                                    while ( flba_scanner->HasNext() && i++ < (infrom - ix) ) {
-                                        flba_scanner->NextValue(&vfixedlen, &is_null);
-                                    }
-                                    i--;
-                                    while ( flba_scanner->HasNext() && i++ <= (into - ix) ) {
-                                        if ( (i - infrom) % tevery == 0 ) {
-                                            tread += tevery;
-                                            sf_running_progress_read(
-                                                &timer,
-                                                &stimer,
-                                                progress,
-                                                f, ngroup,
-                                                j + 1, ncol,
-                                                i + ix - infrom, tobs,
-                                                100 * tread / ttot
-                                            );
-                                        }
-                                        flba_scanner->NextValue(&vfixedlen, &is_null);
-                                        if ( is_null ) {
-                                            warn_strings++;
-                                        }
-                                        else {
-                                            memcpy(vstr, vfixedlen.ptr, descr->type_length());
-                                            // sf_printf_debug(debug, "\t(FLBA, %ld, %ld): %s\n", j, i + ix, vstr);
-                                            if ( (rc = SF_sstore(j + 1, i + ix - infrom, vstr)) ) goto exit;
-                                            memset(vstr, '\0', maxstrlen);
-                                        }
-                                    }
-                                }
-                                break;
-                            default:
-                                sf_errprintf("Unknown parquet type.\n");
-                                rc = 17100;
-                                goto exit;
-                        }
-                        ig = i > ig? i: ig;
+                        chunk.j     = j;
+                        chunk.vtype = vtypes[j];
+                        chunk.encoder = vtypes[j] < 0 && descr->physical_type() == Type::BYTE_ARRAY? &encoders[j]: nullptr;
+                        if ( (rc = sf_ll_read_chunk(row_group_reader, descr, jsel, &batch, &chunk)) ) goto exit;
+                        rgread = chunk.nread > rgread? chunk.nread: rgread;
                     }
-                    nread += ig;
+                    nread += rgread;
+                    ix += rgrows;
                 }
                 ++nfiles;
-                if ( ix > into ) break;
             }
             fstream.close();
-            if ( warn_strings > 0 ) {
-                sf_printf("Warning: %ld NaN values in string variables coerced to blanks ('').\n", warn_strings);
+            if ( nthreads > 1 || prefetch > 0 ) {
+                nahead   = nthreads > 1? 2 * nthreads: 2 * ncol;
+                prefetch = prefetch * 1024 * 1024;
+                sf_printf_debug(verbose, "\tDecoding %ld column chunks on %ld threads (%ld chunks, %ld MiB ahead)\n",
+                                (int64_t) tasks.size(), nthreads, nahead, prefetch / 1024 / 1024);
+                if ( (rc = sf_ll_read_threaded(fnames, &io, colix, ncol, tasks, nthreads, nahead, prefetch, encoders, &chunk, &nread)) ) goto exit;
+            }
+            if ( rgskip > 0 ) {
+                sf_printf_debug(verbose, "\tSkipped %ld row groups with no rows to read\n", rgskip);
+            }
+            if ( chunk.warn_strings > 0 ) {
+                sf_printf("Warning: %ld NaN values in string variables coerced to blanks ('').\n", chunk.warn_strings);
+            }
+            if ( flabels[0] != '\0' ) {
+                if ( (rc = sf_ll_encoder_write(flabels, encoders)) ) goto exit;
             }
             sf_running_timer(&timer, "Read data from disk");
         }
@@ -361,10 +223,9 @@ ST_retcode sf_ll_read_varlist_multi(
         return(-1);
     }
 
-    if ( (rc = sf_scalar_int("__sparquet_nrow", 15, &nrow)) ) goto exit;
-    if ( nrow != nread ) {
+    if ( tobs != nread ) {
         sf_errprintf("Warning: Expected %ld obs but only found %ld\n",
-                     nrow, nread);
+                     tobs, nread);
     }
 
     memcpy(vscalar, "__sparquet_nread", 16);
@@ -0,0 +1,560 @@
+// Low-level row selection
+// -----------------------
+//
+// parquet use ... if exp with the low-level reader runs in two phases.
+// First we decode only the columns in the if condition and build a
+// selection of the rows that satisfy it (row groups ruled out by their
+// statistics are never touched). Stata then sizes the dataset to the
+// number of selected rows and the reader decodes every column, skipping
+// the rows (and whole pages and row groups) that were not selected.
+//
+// The selection is a list of (first row, number of rows) runs, where
+// rows are numbered from 0 across the row groups being read (i.e. the
+// row groups in rg(), if any, or every row group of every file). It is
+// passed between the two plugin calls as a binary file of int64 pairs.
+// If the condition could not be parsed in full the selection is every
+// row of the row groups that were not pruned, and Stata applies the
+// condition itself afterwards.
+
+struct sf_ll_select {
+    sf_filter filter;
+    std::vector<int64_t> runs;
+    std::vector<uint8_t> sel;
+    int64_t nselect;
+};
+
+void sf_ll_select_run(sf_ll_select *select, int64_t from, int64_t nrows)
+{
+    int64_t n = select->runs.size();
+    if ( nrows <= 0 ) return;
+    if ( n > 0 && select->runs[n - 2] + select->runs[n - 1] == from ) {
+        select->runs[n - 1] += nrows;
+    }
+    else {
+        select->runs.push_back(from);
+        select->runs.push_back(nrows);
+    }
+    select->nselect += nrows;
+}
+
+// Evaluate one predicate over nobs rows after skipping skip rows of the
+// column chunk; rows where it is false are dropped from sel.
+
+template <typename DType>
+void sf_ll_select_numeric(
+    parquet::ColumnReader *column_reader,
+    const parquet::ColumnDescriptor *descr,
+    const sf_filter_pred &pred,
+    int64_t skip,
+    int64_t nobs,
+    sf_ll_batch *batch,
+    uint8_t *sel)
+{
+    typedef typename DType::c_type T;
+    parquet::TypedColumnReader<DType> *reader =
+        static_cast<parquet::TypedColumnReader<DType>*>(column_reader);
+
+    T *values = reinterpret_cast<T*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    int16_t maxdef = descr->max_definition_level();
+    int64_t k, v, levels, nvalues, nread = 0;
+    int64_t type_length = descr->type_length();
+    ST_double z;
+    sf_convert convert = sf_convert_type(descr);
+
+    sf_ll_skip_rows<DType>(reader, skip);
+    while ( nread < nobs && reader->HasNext() ) {
+        levels = reader->ReadBatch(
+            std::min(nobs - nread, batch->size),
+            deflevels,
+            nullptr,
+            values,
+            &nvalues
+        );
+        for (k = v = 0; k < levels; k++) {
+            if ( nvalues < levels && deflevels[k] < maxdef ) {
+                z = SV_missval;
+            }
+            else {
+                z = sf_convert_value(convert, sf_convert_raw(values[v++], type_length));
+            }
+            sel[nread + k] &= sf_filter_value(pred, z);
+        }
+        nread += levels;
+    }
+    for (k = nread; k < nobs; k++)
+        sel[k] = 0;
+}
+
+template <typename DType>
+void sf_ll_select_string(
+    parquet::ColumnReader *column_reader,
+    const parquet::ColumnDescriptor *descr,
+    const sf_filter_pred &pred,
+    int64_t skip,
+    int64_t nobs,
+    sf_ll_batch *batch,
+    uint8_t *sel)
+{
+    typedef typename DType::c_type T;
+    parquet::TypedColumnReader<DType> *reader =
+        static_cast<parquet::TypedColumnReader<DType>*>(column_reader);
+
+    T *values = reinterpret_cast<T*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    int16_t maxdef = descr->max_definition_level();
+    int64_t k, v, levels, nvalues, nread = 0;
+    int64_t type_length = descr->type_length();
+    const uint8_t blank = 0;
+
+    sf_ll_skip_rows<DType>(reader, skip);
+    while ( nread < nobs && reader->HasNext() ) {
+        levels = reader->ReadBatch(
+            std::min(nobs - nread, batch->size),
+            deflevels,
+            nullptr,
+            values,
+            &nvalues
+        );
+        for (k = v = 0; k < levels; k++) {
+            if ( nvalues < levels && deflevels[k] < maxdef ) {
+                sel[nread + k] &= sf_filter_value(pred, &blank, 0);
+            }
+            else {
+                sel[nread + k] &= sf_filter_value(
+                    pred,
+                    sf_ll_strptr(values[v]),
+                    sf_ll_strlen(values[v], type_length)
+                );
+                v++;
+            }
+        }
+        nread += levels;
+    }
+    for (k = nread; k < nobs; k++)
+        sel[k] = 0;
+}
+
+// Row groups to select from: those in rowgix (0-indexed; every group
+// if readrg is 0) with rows in the in() range [infrom, into] that the
+// filter statistics do not rule out. rowstart gets the first row of
+// each, numbered from *ix, which ends past the groups considered.
+
+void sf_ll_select_rowgroups(
+    std::shared_ptr<parquet::FileMetaData> file_metadata,
+    int64_t readrg,
+    const int64_t *rowgix,
+    int64_t infrom,
+    int64_t into,
+    const int64_t *colix,
+    int64_t usefilter,
+    sf_ll_select *select,
+    std::vector<int64_t> *rowgroups,
+    std::vector<int64_t> *rowstart,
+    int64_t *ix)
+{
+    int64_t r, rg = 0, rgrows, skip;
+
+    for (r = 0; r < file_metadata->num_row_groups(); ++r) {
+        if ( readrg ) {
+            if ( rg < readrg && r == rowgix[rg] ) {
+                rg++;
+            }
+            else {
+                continue;
+            }
+        }
+        if ( *ix > into ) break;
+
+        std::unique_ptr<parquet::RowGroupMetaData> rg_metadata = file_metadata->RowGroup(r);
+        rgrows = rg_metadata->num_rows();
+        skip   = infrom > *ix? infrom - *ix: 0;
+        if ( std::min(into - *ix + 1, rgrows) - skip > 0 ) {
+            if ( !usefilter || sf_filter_rowgroup(rg_metadata.get(), &(select->filter), colix) ) {
+                rowgroups->push_back(r);
+                rowstart->push_back(*ix);
+            }
+        }
+        *ix += rgrows;
+    }
+}
+
+// Parquet columns decoded to select rows: those in the filter. If a
+// column cannot be compared in the plugin the filter is left to Stata
+// and none are.
+
+std::vector<int64_t> sf_ll_select_columns(
+    const parquet::SchemaDescriptor *schema,
+    const int64_t *colix,
+    int64_t usefilter,
+    sf_ll_select *select)
+{
+    size_t k;
+    bool isstr, decimal;
+    const parquet::ColumnDescriptor *descr;
+    std::vector<int64_t> columns;
+
+    if ( !usefilter || !select->filter.exact ) return (columns);
+    for (k = 0; k < select->filter.preds.size(); k++) {
+        const sf_filter_pred &pred = select->filter.preds[k];
+        descr = schema->Column(colix[pred.j]);
+        decimal = sf_convert_type(descr).fmt == SPARQUET_FMT_DECIMAL;
+        isstr = !decimal
+             && (descr->physical_type() == Type::BYTE_ARRAY
+                 || descr->physical_type() == Type::FIXED_LEN_BYTE_ARRAY);
+        if ( isstr != pred.isstr ) {
+            select->filter.exact = false;
+            columns.clear();
+            break;
+        }
+        if ( std::find(columns.begin(), columns.end(), colix[pred.j]) == columns.end() ) {
+            columns.push_back(colix[pred.j]);
+        }
+    }
+    return (columns);
+}
+
+// Select rows [ix, ix + num_rows) of row group r, restricted to the
+// in() range [infrom, into]; r is one of sf_ll_select_rowgroups.
+
+void sf_ll_select_rowgroup(
+    parquet::ParquetFileReader *parquet_reader,
+    int64_t r,
+    int64_t ix,
+    int64_t infrom,
+    int64_t into,
+    const int64_t *colix,
+    int64_t usefilter,
+    sf_ll_batch *batch,
+    sf_ll_select *select)
+{
+    size_t k;
+    int64_t i, rgrows, skip, nobs;
+    bool isstr, decimal;
+    const parquet::ColumnDescriptor *descr;
+    std::shared_ptr<parquet::RowGroupReader> row_group_reader;
+    std::shared_ptr<parquet::ColumnReader> column_reader;
+    std::unique_ptr<parquet::RowGroupMetaData> rg_metadata =
+        parquet_reader->metadata()->RowGroup(r);
+
+    rgrows = rg_metadata->num_rows();
+    skip   = infrom > ix? infrom - ix: 0;
+    nobs   = std::min(into - ix + 1, rgrows) - skip;
+    if ( nobs <= 0 ) return;
+
+    if ( !usefilter || !select->filter.exact ) {
+        sf_ll_select_run(select, ix + skip, nobs);
+        return;
+    }
+
+    // Decode only the filter columns
+    select->sel.assign(nobs, 1);
+    row_group_reader = parquet_reader->RowGroup(r);
+    for (k = 0; k < select->filter.preds.size(); k++) {
+        const sf_filter_pred &pred = select->filter.preds[k];
+        descr = rg_metadata->schema()->Column(colix[pred.j]);
+        decimal = sf_convert_type(descr).fmt == SPARQUET_FMT_DECIMAL;
+        isstr = !decimal
+             && (descr->physical_type() == Type::BYTE_ARRAY
+                 || descr->physical_type() == Type::FIXED_LEN_BYTE_ARRAY);
+
+        // Type mismatches are left for Stata to deal with
+        if ( isstr != pred.isstr ) {
+            select->filter.exact = false;
+            continue;
+        }
+
+        column_reader = row_group_reader->Column(colix[pred.j]);
+        switch (descr->physical_type()) {
+            case Type::BOOLEAN:
+                sf_ll_select_numeric<parquet::BooleanType>(column_reader.get(), descr, pred, skip, nobs, batch, select->sel.data());
+                break;
+            case Type::INT32:
+                sf_ll_select_numeric<parquet::Int32Type>(column_reader.get(), descr, pred, skip, nobs, batch, select->sel.data());
+                break;
+            case Type::INT64:
+                sf_ll_select_numeric<parquet::Int64Type>(column_reader.get(), descr, pred, skip, nobs, batch, select->sel.data());
+                break;
+            case Type::INT96:
+                sf_ll_select_numeric<parquet::Int96Type>(column_reader.get(), descr, pred, skip, nobs, batch, select->sel.data());
+                break;
+            case Type::FLOAT:
+                sf_ll_select_numeric<parquet::FloatType>(column_reader.get(), descr, pred, skip, nobs, batch, select->sel.data());
+                break;
+            case Type::DOUBLE:
+                sf_ll_select_numeric<parquet::DoubleType>(column_reader.get(), descr, pred, skip, nobs, batch, select->sel.data());
+                break;
+            case Type::BYTE_ARRAY:
+                if ( decimal ) {
+                    sf_ll_select_numeric<parquet::ByteArrayType>(column_reader.get(), descr, pred, skip, nobs, batch, select->sel.data());
+                }
+                else {
+                    sf_ll_select_string<parquet::ByteArrayType>(column_reader.get(), descr, pred, skip, nobs, batch, select->sel.data());
+                }
+                break;
+            case Type::FIXED_LEN_BYTE_ARRAY:
+                if ( decimal ) {
+                    sf_ll_select_numeric<parquet::FLBAType>(column_reader.get(), descr, pred, skip, nobs, batch, select->sel.data());
+                }
+                else {
+                    sf_ll_select_string<parquet::FLBAType>(column_reader.get(), descr, pred, skip, nobs, batch, select->sel.data());
+                }
+                break;
+            default:
+                select->filter.exact = false;
+                break;
+        }
+    }
+
+    for (i = 0; i < nobs; i++) {
+        if ( select->sel[i] ) sf_ll_select_run(select, ix + skip + i, 1);
+    }
+}
+
+// Selection file I/O
+
+ST_retcode sf_ll_select_write(const char *fselect, sf_ll_select *select)
+{
+    std::ofstream fstream;
+    fstream.open(fselect, std::ios::out | std::ios::binary);
+    if ( !fstream.is_open() ) {
+        sf_errprintf("Unable to write file '%s'\n", fselect);
+        return (603);
+    }
+    fstream.write(
+        reinterpret_cast<const char*>(select->runs.data()),
+        select->runs.size() * sizeof(int64_t)
+    );
+    fstream.close();
+    return (0);
+}
+
+ST_retcode sf_ll_select_read(const char *fselect, std::vector<int64_t> &runs)
+{
+    int64_t nbytes;
+    std::ifstream fstream;
+    fstream.open(fselect, std::ios::in | std::ios::binary | std::ios::ate);
+    if ( !fstream.is_open() ) {
+        sf_errprintf("Unable to read file '%s'\n", fselect);
+        return (601);
+    }
+    nbytes = fstream.tellg();
+    runs.resize(nbytes / sizeof(int64_t));
+    fstream.seekg(0, std::ios::beg);
+    fstream.read(reinterpret_cast<char*>(runs.data()), nbytes);
+    fstream.close();
+    return (0);
+}
+
+// Save the selection and let Stata know how many rows to allocate and
+// whether it still needs to apply the if condition.
+
+ST_retcode sf_ll_select_save(
+    const char *fselect,
+    sf_ll_select *select,
+    int64_t usefilter,
+    int64_t verbose)
+{
+    ST_retcode rc = 0;
+    SPARQUET_CHAR(vscalar, 32);
+
+    if ( usefilter ) {
+        sf_printf("(note: if condition pruned %ld of %ld row groups)\n",
+                  select->filter.npruned, select->filter.nchecked);
+        sf_printf_debug(verbose, "\tSelected %ld rows (%s)\n", select->nselect,
+                        select->filter.exact? "exact": "Stata will apply the if condition");
+    }
+
+    if ( (rc = sf_ll_select_write(fselect, select)) ) return (rc);
+
+    memcpy(vscalar, "__sparquet_nselect", 18);
+    if ( (rc = SF_scal_save(vscalar, (ST_double) select->nselect)) ) return (rc);
+
+    memset(vscalar, '\0', 32);
+    memcpy(vscalar, "__sparquet_exact", 16);
+    if ( (rc = SF_scal_save(vscalar, (ST_double) (usefilter && select->filter.exact))) ) return (rc);
+
+    return (rc);
+}
+
+// Stata function: Low-level row selection
+//
+// matrices
+//     __sparquet_colix
+//     __sparquet_rowgix
+// scalars
+//     __sparquet_ncol
+//     __sparquet_into
+//     __sparquet_infrom
+//     __sparquet_readrg
+//     __sparquet_filter
+//     __sparquet_nselect
+//     __sparquet_exact
+//     __sparquet_mmap
+//     __sparquet_coalesce
+//     __sparquet_holesize
+//     __sparquet_rangesize
+
+ST_retcode sf_ll_select_varlist(
+    const char *fname,
+    const char *ffilter,
+    const char *fselect,
+    const int verbose,
+    const int debug)
+{
+    ST_retcode rc = 0, any_rc = 0;
+    int64_t j, ix, readrg, _readrg;
+    int64_t ncol = 1, infrom = 0, into = 0, usefilter = 0;
+    size_t k;
+    std::vector<int64_t> rowgroups, rowstart, columns;
+    sf_ll_batch batch;
+    sf_ll_select select;
+    sf_io io;
+
+    select.nselect = 0;
+    try {
+        if ( (rc = sf_scalar_int("__sparquet_ncol",     15, &ncol))     ) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_infrom",   17, &infrom))   ) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_into",     15, &into))     ) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_readrg",   17, &readrg))   ) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_filter",   17, &usefilter))) any_rc = rc;
+        if ( (rc = sf_io_init(&io)) ) any_rc = rc;
+        --infrom; --into;
+
+        _readrg = readrg? readrg: 1;
+        int64_t colix[ncol];
+        int64_t rowgix[_readrg];
+
+        if ( (rc = sf_matrix_int("__sparquet_rowgix", 17, _readrg, rowgix)) ) any_rc = rc;
+        for (j = 0; j < _readrg; j++)
+            --rowgix[j];
+
+        if ( (rc = sf_matrix_int("__sparquet_colix", 16, ncol, colix)) ) any_rc = rc;
+        for (j = 0; j < ncol; j++)
+            --colix[j];
+
+        if ( any_rc ) {
+            rc = any_rc;
+            goto exit;
+        }
+
+        if ( usefilter ) {
+            if ( (rc = sf_filter_parse(ffilter, ncol, &(select.filter), debug)) ) goto exit;
+        }
+        sf_ll_batch_init(&batch, SPARQUET_BATCH, 1);
+
+        std::shared_ptr<arrow::io::RandomAccessFile> source = sf_io_open(fname, &io);
+        std::unique_ptr<parquet::ParquetFileReader> parquet_reader =
+            sf_session_reader(fname, source);
+
+        sf_clock timer = sf_clock_now();
+        ix = 0;
+        sf_ll_select_rowgroups(parquet_reader->metadata(), readrg, rowgix, infrom, into,
+                               colix, usefilter, &select, &rowgroups, &rowstart, &ix);
+        columns = sf_ll_select_columns(parquet_reader->metadata()->schema(), colix, usefilter, &select);
+        if ( !columns.empty() ) {
+            sf_io_select(source, &io, parquet_reader->metadata(), rowgroups,
+                         columns.data(), columns.size(), verbose);
+        }
+        for (k = 0; k < rowgroups.size(); k++) {
+            sf_ll_select_rowgroup(parquet_reader.get(), rowgroups[k], rowstart[k], infrom, into,
+                                  colix, usefilter, &batch, &select);
+        }
+        sf_running_timer (&timer, "Selected rows to read");
+
+        if ( (rc = sf_ll_select_save(fselect, &select, usefilter, verbose)) ) goto exit;
+
+    } catch (const std::exception& e) {
+        sf_errprintf("Parquet read error: %s\n", e.what());
+        return(-1);
+    }
+
+exit:
+    return(rc);
+}
+
+ST_retcode sf_ll_select_varlist_multi(
+    const char *flist,
+    const char *ffilter,
+    const char *fselect,
+    const int verbose,
+    const int debug)
+{
+    ST_retcode rc = 0, any_rc = 0;
+    int64_t j, ix;
+    int64_t ncol = 1, infrom = 0, into = 0, usefilter = 0;
+    size_t k;
+    std::vector<int64_t> rowgroups, rowstart, columns;
+    sf_ll_batch batch;
+    sf_ll_select select;
+    sf_io io;
+
+    select.nselect = 0;
+    try {
+        if ( (rc = sf_scalar_int("__sparquet_ncol",     15, &ncol))     ) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_infrom",   17, &infrom))   ) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_into",     15, &into))     ) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_filter",   17, &usefilter))) any_rc = rc;
+        if ( (rc = sf_io_init(&io)) ) any_rc = rc;
+        --infrom; --into;
+
+        int64_t colix[ncol];
+        if ( (rc = sf_matrix_int("__sparquet_colix", 16, ncol, colix)) ) any_rc = rc;
+        for (j = 0; j < ncol; j++)
+            --colix[j];
+
+        if ( any_rc ) {
+            rc = any_rc;
+            goto exit;
+        }
+
+        if ( usefilter ) {
+            if ( (rc = sf_filter_parse(ffilter, ncol, &(select.filter), debug)) ) goto exit;
+        }
+        sf_ll_batch_init(&batch, SPARQUET_BATCH, 1);
+
+        std::shared_ptr<arrow::io::RandomAccessFile> source;
+        std::unique_ptr<parquet::ParquetFileReader> parquet_reader;
+        std::string fname;
+        std::ifstream fstream;
+        fstream.open(flist);
+
+        sf_clock timer = sf_clock_now();
+        ix = 0;
+        if ( fstream.is_open() ) {
+            while ( std::getline(fstream, fname) ) {
+                if ( ix > into ) break;
+                source         = sf_io_open(fname, &io);
+                parquet_reader = sf_session_reader(fname, source);
+                if ( ix + parquet_reader->metadata()->num_rows() <= infrom ) {
+                    ix += parquet_reader->metadata()->num_rows();
+                    continue;
+                }
+                rowgroups.clear();
+                rowstart.clear();
+                sf_ll_select_rowgroups(parquet_reader->metadata(), 0, nullptr, infrom, into,
+                                       colix, usefilter, &select, &rowgroups, &rowstart, &ix);
+                columns = sf_ll_select_columns(parquet_reader->metadata()->schema(), colix, usefilter, &select);
+                if ( !columns.empty() ) {
+                    sf_io_select(source, &io, parquet_reader->metadata(), rowgroups,
+                                 columns.data(), columns.size(), 0);
+                }
+                for (k = 0; k < rowgroups.size(); k++) {
+                    sf_ll_select_rowgroup(parquet_reader.get(), rowgroups[k], rowstart[k], infrom, into,
+                                          colix, usefilter, &batch, &select);
+                }
+            }
+            fstream.close();
+        }
+        sf_running_timer (&timer, "Selected rows to read");
+
+        if ( (rc = sf_ll_select_save(fselect, &select, usefilter, verbose)) ) goto exit;
+
+    } catch (const std::exception& e) {
+        sf_errprintf("Parquet read error: %s\n", e.what());
+        return(-1);
+    }
+
+exit:
+    return(rc);
+}
@@ -0,0 +1,481 @@
+// Low-level multi-threaded decoding
+// ---------------------------------
+//
+// With threads(#) the low-level reader splits the read into one task
+// per column chunk (row group by column). Worker threads, each with its
+// own file reader, decode tasks into staging buffers: ST_double for
+// numbers and NUL-terminated strings back to back for strings. The
+// calling thread is the only one that talks to Stata; it waits for the
+// tasks in order and copies each staging buffer into the dataset with
+// SF_vstore/SF_sstore.
+//
+// Workers reading the same file share its input source (see
+// parquet-io.cpp), so coalesced ranges are read once for all of them.
+//
+// Staging memory is bounded: workers never run more than 2 * threads
+// tasks ahead of the calling thread, so at most that many column chunks
+// (restricted to the rows being read) are staged at any one time.
+//
+// The same pipeline gives read-ahead without threads(): with prefetch(#)
+// a single worker fetches and decodes row group r + 1 (or the first one
+// of the next file) while the calling thread stores row group r. In
+// either mode prefetch(#) also caps the staged data at about # MiB; a
+// task is always allowed to start when nothing else is staged.
+
+struct sf_ll_task {
+    int64_t f;     // file (index into the file list)
+    int64_t r;     // row group within the file
+    int64_t g;     // row group sequence number across the read
+    int64_t j;     // Stata variable (0-indexed)
+    int64_t jsel;  // parquet column
+    int64_t vtype;
+    int64_t sobs;
+    int64_t nbytes;  // staging size estimate
+    std::vector<int64_t> runs;
+};
+
+struct sf_ll_stage {
+    ST_retcode rc;
+    std::string errmsg;
+    bool isstr;
+    int64_t nread;
+    std::vector<ST_double> vdouble;
+    std::vector<char>      vstr;
+    std::vector<int64_t>   voffset;  // -1 for nulls
+    std::vector<int64_t>   vlength;  // bytes, as strings can hold NULs
+};
+
+// Queue one task per column for the rows of chunk->runs in row group r
+// of file f; returns the number of rows that will be read.
+
+int64_t sf_ll_tasks_add(
+    std::vector<sf_ll_task> &tasks,
+    int64_t f,
+    int64_t r,
+    int64_t g,
+    sf_ll_chunk *chunk,
+    int64_t ncol,
+    const int64_t *colix,
+    const int64_t *vtypes,
+    const parquet::RowGroupMetaData *rg_metadata)
+{
+    int64_t j, u, nobs = 0, rgrows = rg_metadata->num_rows();
+    sf_ll_task task;
+    std::unique_ptr<parquet::ColumnChunkMetaData> cc_metadata;
+
+    for (u = 1; u < (int64_t) chunk->runs.size(); u += 2)
+        nobs += chunk->runs[u];
+
+    task.f    = f;
+    task.r    = r;
+    task.g    = g;
+    task.sobs = chunk->sobs;
+    task.runs = chunk->runs;
+    for (j = 0; j < ncol; j++) {
+        task.j     = j;
+        task.jsel  = colix[j];
+        task.vtype = vtypes[j];
+
+        // Numbers are staged as doubles; strings take their share of the
+        // uncompressed chunk plus an offset per row.
+        cc_metadata = rg_metadata->ColumnChunk(colix[j]);
+        if ( cc_metadata->type() == Type::BYTE_ARRAY || cc_metadata->type() == Type::FIXED_LEN_BYTE_ARRAY ) {
+            task.nbytes = sizeof(int64_t) * nobs
+                        + (rgrows? cc_metadata->total_uncompressed_size() * nobs / rgrows: 0);
+        }
+        else {
+            task.nbytes = sizeof(ST_double) * nobs;
+        }
+        tasks.push_back(task);
+    }
+
+    return (nobs);
+}
+
+// Worker side: decode a column chunk into the staging buffers
+
+template <typename DType>
+void sf_ll_stage_numeric(
+    parquet::ColumnReader *column_reader,
+    const parquet::ColumnDescriptor *descr,
+    sf_ll_batch *batch,
+    sf_ll_task *task,
+    sf_ll_stage *stage)
+{
+    typedef typename DType::c_type T;
+    parquet::TypedColumnReader<DType> *reader =
+        static_cast<parquet::TypedColumnReader<DType>*>(column_reader);
+
+    T *values = reinterpret_cast<T*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    int16_t maxdef = descr->max_definition_level();
+    int64_t u, k, v, levels, nvalues, nwant, pos = 0;
+    int64_t type_length = descr->type_length();
+    ST_double *vdouble;
+    sf_convert convert = sf_convert_type(descr);
+
+    for (u = 0; u + 1 < (int64_t) task->runs.size(); u += 2) {
+        sf_ll_skip_rows<DType>(reader, task->runs[u] - pos);
+        pos   = task->runs[u];
+        nwant = stage->nread + task->runs[u + 1];
+        while ( stage->nread < nwant && reader->HasNext() ) {
+            levels = reader->ReadBatch(
+                std::min(nwant - stage->nread, batch->size),
+                deflevels,
+                nullptr,
+                values,
+                &nvalues
+            );
+
+            vdouble = stage->vdouble.data() + stage->nread;
+            if ( nvalues == levels ) {
+                for (k = 0; k < levels; k++)
+                    vdouble[k] = sf_convert_raw(values[k], type_length);
+            }
+            else {
+                for (k = v = 0; k < levels; k++)
+                    vdouble[k] = deflevels[k] < maxdef? SV_missval: sf_convert_raw(values[v++], type_length);
+            }
+            sf_convert_apply(convert, vdouble, levels);
+
+            pos += levels;
+            stage->nread += levels;
+        }
+    }
+}
+
+template <typename DType>
+void sf_ll_stage_string(
+    parquet::ColumnReader *column_reader,
+    const parquet::ColumnDescriptor *descr,
+    sf_ll_batch *batch,
+    sf_ll_task *task,
+    sf_ll_stage *stage)
+{
+    typedef typename DType::c_type T;
+    parquet::TypedColumnReader<DType> *reader =
+        static_cast<parquet::TypedColumnReader<DType>*>(column_reader);
+
+    T *values = reinterpret_cast<T*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    int16_t maxdef = descr->max_definition_level();
+    int64_t u, k, v, vlen, levels, nvalues, nwant, pos = 0;
+    int64_t type_length = descr->type_length();
+    const uint8_t *vptr;
+    char errbuf[256];
+
+    for (u = 0; u + 1 < (int64_t) task->runs.size(); u += 2) {
+        sf_ll_skip_rows<DType>(reader, task->runs[u] - pos);
+        pos   = task->runs[u];
+        nwant = stage->nread + task->runs[u + 1];
+        while ( stage->nread < nwant && reader->HasNext() ) {
+            levels = reader->ReadBatch(
+                std::min(nwant - stage->nread, batch->size),
+                deflevels,
+                nullptr,
+                values,
+                &nvalues
+            );
+
+            for (k = v = 0; k < levels; k++) {
+                if ( nvalues < levels && deflevels[k] < maxdef ) {
+                    stage->voffset[stage->nread + k] = -1;
+                    continue;
+                }
+                vptr = sf_ll_strptr(values[v]);
+                vlen = sf_ll_strlen(values[v++], type_length);
+
+                // Encoded columns (vtype < 0) have no width limit
+                if ( task->vtype > 0 && vlen > task->vtype ) {
+                    snprintf(errbuf, 256,
+                             "Buffer (%ld) too small; re-run with larger buffer or -strscan(.)-\n"
+                             "Group %ld, row %ld, col %ld had a string of length %ld.\n",
+                             task->vtype, task->r, pos + k, task->j, vlen);
+                    stage->errmsg = errbuf;
+                    stage->rc = 17103;
+                    return;
+                }
+                stage->voffset[stage->nread + k] = stage->vstr.size();
+                stage->vlength[stage->nread + k] = vlen;
+                stage->vstr.insert(stage->vstr.end(), vptr, vptr + vlen);
+                stage->vstr.push_back('\0');
+            }
+
+            pos += levels;
+            stage->nread += levels;
+        }
+    }
+}
+
+void sf_ll_stage_chunk(
+    std::shared_ptr<parquet::RowGroupReader> row_group_reader,
+    const parquet::ColumnDescriptor *descr,
+    sf_ll_batch *batch,
+    sf_ll_task *task,
+    sf_ll_stage *stage)
+{
+    int64_t u, nobs = 0;
+    bool decimal = sf_convert_type(descr).fmt == SPARQUET_FMT_DECIMAL;
+    std::shared_ptr<parquet::ColumnReader> column_reader;
+
+    for (u = 1; u < (int64_t) task->runs.size(); u += 2)
+        nobs += task->runs[u];
+
+    stage->rc    = 0;
+    stage->nread = 0;
+    stage->errmsg.clear();
+    stage->vstr.clear();
+    stage->isstr = !decimal
+                && (descr->physical_type() == Type::BYTE_ARRAY
+                    || descr->physical_type() == Type::FIXED_LEN_BYTE_ARRAY);
+    if ( stage->isstr ) {
+        stage->voffset.resize(nobs);
+        stage->vlength.resize(nobs);
+    }
+    else {
+        stage->vdouble.resize(nobs);
+    }
+
+    column_reader = row_group_reader->Column(task->jsel);
+    switch (descr->physical_type()) {
+        case Type::BOOLEAN:
+            sf_ll_stage_numeric<parquet::BooleanType>(column_reader.get(), descr, batch, task, stage);
+            break;
+        case Type::INT32:
+            sf_ll_stage_numeric<parquet::Int32Type>(column_reader.get(), descr, batch, task, stage);
+            break;
+        case Type::INT64:
+            sf_ll_stage_numeric<parquet::Int64Type>(column_reader.get(), descr, batch, task, stage);
+            break;
+        case Type::INT96:
+            sf_ll_stage_numeric<parquet::Int96Type>(column_reader.get(), descr, batch, task, stage);
+            break;
+        case Type::FLOAT:
+            sf_ll_stage_numeric<parquet::FloatType>(column_reader.get(), descr, batch, task, stage);
+            break;
+        case Type::DOUBLE:
+            sf_ll_stage_numeric<parquet::DoubleType>(column_reader.get(), descr, batch, task, stage);
+            break;
+        case Type::BYTE_ARRAY:
+            if ( decimal ) {
+                sf_ll_stage_numeric<parquet::ByteArrayType>(column_reader.get(), descr, batch, task, stage);
+            }
+            else {
+                sf_ll_stage_string<parquet::ByteArrayType>(column_reader.get(), descr, batch, task, stage);
+            }
+            break;
+        case Type::FIXED_LEN_BYTE_ARRAY:
+            if ( decimal ) {
+                sf_ll_stage_numeric<parquet::FLBAType>(column_reader.get(), descr, batch, task, stage);
+            }
+            else {
+                sf_ll_stage_string<parquet::FLBAType>(column_reader.get(), descr, batch, task, stage);
+            }
+            break;
+        default:
+            stage->errmsg = "Unknown parquet type.\n";
+            stage->rc = 17100;
+            break;
+    }
+}
+
+// Calling thread: copy a staged column chunk into Stata
+
+ST_retcode sf_ll_stage_store(
+    sf_ll_task *task,
+    sf_ll_stage *stage,
+    sf_ll_encoder *encoder,
+    sf_ll_chunk *chunk)
+{
+    ST_retcode rc = 0;
+    int64_t i, k, n, sobs, vlen, prevoff = -1, prevlen = 0;
+    ST_double code = SV_missval;
+    const char *vstr;
+
+    chunk->r     = task->r;
+    chunk->j     = task->j;
+    chunk->sobs  = task->sobs;
+    chunk->nread = 0;
+    sobs = task->sobs + 1;
+    for (i = 0; i < stage->nread; i += n) {
+        n = std::min(stage->nread - i, (int64_t) SPARQUET_BATCH);
+        if ( !stage->isstr ) {
+            for (k = i; k < i + n; k++) {
+                if ( (rc = SF_vstore(task->j + 1, sobs + k, stage->vdouble[k])) ) return (rc);
+            }
+        }
+        else if ( encoder ) {
+            for (k = i; k < i + n; k++) {
+                if ( stage->voffset[k] < 0 || stage->vlength[k] == 0 ) {
+                    if ( (rc = SF_vstore(task->j + 1, sobs + k, SV_missval)) ) return (rc);
+                    continue;
+                }
+                vstr = stage->vstr.data() + stage->voffset[k];
+                vlen = stage->vlength[k];
+                if ( prevoff < 0 || vlen != prevlen || memcmp(vstr, stage->vstr.data() + prevoff, vlen) != 0 ) {
+                    code = (ST_double) sf_ll_encoder_code(encoder, vstr, vlen);
+                    if ( code == 0 ) return (sf_ll_encoder_full(task->j));
+                    prevoff = stage->voffset[k];
+                    prevlen = vlen;
+                }
+                if ( (rc = SF_vstore(task->j + 1, sobs + k, code)) ) return (rc);
+            }
+        }
+        else {
+            for (k = i; k < i + n; k++) {
+                if ( stage->voffset[k] < 0 ) {
+                    chunk->warn_strings++;
+                    continue;
+                }
+                vstr = stage->vstr.data() + stage->voffset[k];
+                if ( (rc = SF_sstore(task->j + 1, sobs + k, (char *) vstr)) ) return (rc);
+            }
+        }
+        chunk->nread += n;
+        sf_ll_chunk_progress(chunk, n);
+    }
+
+    return (rc);
+}
+
+// Run the tasks on nthreads workers, at most nahead tasks and (if
+// maxbytes > 0) about maxbytes of staged data ahead of the calling
+// thread; returns the number of rows read (the most rows read from any
+// column of each row group) in *nread.
+
+ST_retcode sf_ll_read_threaded(
+    const std::vector<std::string> &fnames,
+    sf_io *io,
+    const int64_t *colix,
+    int64_t ncol,
+    std::vector<sf_ll_task> &tasks,
+    int64_t nthreads,
+    int64_t nahead,
+    int64_t maxbytes,
+    std::vector<sf_ll_encoder> &encoders,
+    sf_ll_chunk *chunk,
+    int64_t *nread)
+{
+    ST_retcode rc = 0;
+    int64_t t, w, g, ntasks = tasks.size(), nslots = nahead;
+    int64_t next = 0, consumed = 0, staged = 0;
+    bool abort = false;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<char> ready(ntasks, 0);
+    std::vector<sf_ll_stage> stages(nslots);
+    std::vector<std::thread> workers;
+    std::vector<int64_t> rgread;
+    std::vector<std::shared_ptr<arrow::io::RandomAccessFile>> sources(fnames.size());
+    std::vector<std::vector<int64_t>> rowgroups(fnames.size());
+    sf_ll_stage *stage;
+    sf_ll_encoder *encoder;
+
+    // Row groups read from each file, for coalesced reads
+    for (t = 0; t < ntasks; t++) {
+        if ( tasks[t].g >= (int64_t) rgread.size() ) rgread.resize(tasks[t].g + 1, 0);
+        if ( rowgroups[tasks[t].f].empty() || rowgroups[tasks[t].f].back() != tasks[t].r ) {
+            rowgroups[tasks[t].f].push_back(tasks[t].r);
+        }
+    }
+
+    auto worker = [&]() {
+        int64_t wt, f = -1;
+        bool opened;
+        sf_ll_batch batch;
+        std::unique_ptr<parquet::ParquetFileReader> parquet_reader;
+        std::shared_ptr<parquet::RowGroupReader> row_group_reader;
+        const parquet::ColumnDescriptor *descr;
+
+        sf_ll_batch_init(&batch, SPARQUET_BATCH, 1);
+        while ( true ) {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [&]{
+                    return abort || next >= ntasks || (next < consumed + nslots
+                        && (maxbytes <= 0 || next == consumed || staged + tasks[next].nbytes <= maxbytes));
+                });
+                if ( abort || next >= ntasks ) return;
+                staged += tasks[next].nbytes;
+                wt = next++;
+            }
+
+            sf_ll_task  *wtask  = &tasks[wt];
+            sf_ll_stage *wstage = &stages[wt % nslots];
+            try {
+                if ( wtask->f != f ) {
+
+                    // The first worker on a file opens it and sets its
+                    // coalesced reads before any chunk in it is read
+                    {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        opened = sources[wtask->f] == nullptr;
+                        if ( opened ) {
+                            sources[wtask->f] = sf_io_open(fnames[wtask->f], io);
+                            parquet_reader = sf_session_reader(fnames[wtask->f], sources[wtask->f]);
+                            sf_io_select(sources[wtask->f], io, parquet_reader->metadata(),
+                                         rowgroups[wtask->f], colix, ncol, 0);
+                        }
+                    }
+                    if ( !opened ) parquet_reader = sf_session_reader(fnames[wtask->f], sources[wtask->f]);
+                    f = wtask->f;
+                }
+                row_group_reader = parquet_reader->RowGroup(wtask->r);
+                descr = parquet_reader->metadata()->schema()->Column(wtask->jsel);
+                sf_ll_stage_chunk(row_group_reader, descr, &batch, wtask, wstage);
+            } catch (const std::exception& e) {
+                wstage->errmsg = std::string("Parquet read error: ") + e.what() + "\n";
+                wstage->rc = -1;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                ready[wt] = 1;
+            }
+            cv.notify_all();
+        }
+    };
+
+    for (w = 0; w < std::min(nthreads, ntasks); w++)
+        workers.push_back(std::thread(worker));
+
+    for (t = 0; t < ntasks; t++) {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&]{ return ready[t] != 0; });
+        }
+
+        stage = &stages[t % nslots];
+        if ( stage->rc ) {
+            sf_errprintf("%s", stage->errmsg.c_str());
+            rc = stage->rc;
+            break;
+        }
+
+        encoder = (stage->isstr && tasks[t].vtype < 0)? &encoders[tasks[t].j]: nullptr;
+        if ( (rc = sf_ll_stage_store(&tasks[t], stage, encoder, chunk)) ) break;
+        g = tasks[t].g;
+        rgread[g] = stage->nread > rgread[g]? stage->nread: rgread[g];
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            staged -= tasks[t].nbytes;
+            consumed++;
+        }
+        cv.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        abort = true;
+    }
+    cv.notify_all();
+    for (w = 0; w < (int64_t) workers.size(); w++)
+        workers[w].join();
+
+    *nread = 0;
+    for (g = 0; g < (int64_t) rgread.size(); g++)
+        *nread += rgread[g];
+
+    return (rc);
+}
@@ -11,10 +11,19 @@
 //     __sparquet_nread
 //     __sparquet_readrg
 //     __sparquet_progress
-//     __sparquet_check
+//     __sparquet_filter
+//     __sparquet_nselect
+//     __sparquet_threads
+//     __sparquet_prefetch
+//     __sparquet_mmap
+//     __sparquet_coalesce
+//     __sparquet_holesize
+//     __sparquet_rangesize
 
 ST_retcode sf_ll_read_varlist(
     const char *fname,
+    const char *fselect,
+    const char *flabels,
     const int verbose,
     const int debug,
     const uint64_t strbuffer)
@@ -22,43 +31,24 @@ ST_retcode sf_ll_read_varlist(
     ST_retcode rc = 0, any_rc = 0;
     SPARQUET_CHAR(vscalar, 32);
 
-    bool is_null;
     ST_double progress;
-    int64_t nrow_groups, maxstrlen, tobs, ttot, tevery, tread;
-    int64_t rg, r, i, j, jsel, ix, ig, readrg, _readrg;
-    int64_t warn_strings = 0, ncol = 1, infrom = 0, into = 0;
-    int64_t cread = 0, rgread = 0, nread = 0;
-
-    // Declare all the value types
-    // ---------------------------
-
-    bool vbool;
-    int32_t vint32;
-    int64_t vint64;
-    float vfloat;
-    double vdouble;
-    parquet::ByteArray vbytearray;
-    parquet::FixedLenByteArray vfixedlen;
+    int64_t nrow_groups, maxstrlen, tobs, ttot, tread, rgrows;
+    int64_t rg, r, j, jsel, ix, u, readrg, _readrg;
+    int64_t ncol = 1, infrom = 0, into = 0, usefilter = 0, nthreads = 1;
+    int64_t prefetch = 0, nahead;
+    int64_t rgread = 0, rgskip = 0, nread = 0, ngroups = 0;
 
     // Declare all the readers
     // -----------------------
 
-    // std::shared_ptr<parquet::ColumnReader> column_reader;
     std::shared_ptr<parquet::RowGroupReader> row_group_reader;
-
-    std::shared_ptr<parquet::BoolScanner>  bool_scanner;
-    std::shared_ptr<parquet::Int32Scanner> int32_scanner;
-    std::shared_ptr<parquet::Int64Scanner> int64_scanner;
-    std::shared_ptr<parquet::FloatScanner> float_scanner;
-    std::shared_ptr<parquet::DoubleScanner> double_scanner;
-    std::shared_ptr<parquet::ByteArrayScanner> ba_scanner;
-    std::shared_ptr<parquet::FixedLenByteArrayScanner> flba_scanner;
-
-    // Not implemented in Stata
-    // ------------------------
-
-    // parquet::Int96 vint96;
-    // parquet::Int96Reader* int96_reader;
+    sf_ll_batch batch;
+    std::vector<sf_ll_encoder> encoders;
+    sf_ll_chunk chunk;
+    std::vector<int64_t> runs;
+    std::vector<sf_ll_task> tasks;
+    std::vector<std::string> fnames(1, fname);
+    sf_io io;
 
     // File reader
     // -----------
@@ -66,24 +56,16 @@ ST_retcode sf_ll_read_varlist(
     const parquet::ColumnDescriptor* descr;
     try {
 
-        // File metadata
-        std::unique_ptr<parquet::ParquetFileReader> parquet_reader =
-            parquet::ParquetFileReader::OpenFile(fname, false);
-
-        std::shared_ptr<parquet::FileMetaData> file_metadata =
-            parquet_reader->metadata();
-
-        // ncol = file_metadata->num_columns();
-        nrow_groups = file_metadata->num_row_groups();
-        ix = ig = 0;
-
         // Read selected columns; read in range
         if ( (rc = sf_scalar_int("__sparquet_ncol",     15, &ncol))     ) any_rc = rc;
         if ( (rc = sf_scalar_int("__sparquet_infrom",   17, &infrom))   ) any_rc = rc;
         if ( (rc = sf_scalar_int("__sparquet_into",     15, &into))     ) any_rc = rc;
         if ( (rc = sf_scalar_int("__sparquet_readrg",   17, &readrg))   ) any_rc = rc;
         if ( (rc = sf_scalar_dbl("__sparquet_progress", 19, &progress)) ) any_rc = rc;
-        if ( (rc = sf_scalar_int("__sparquet_check",    16, &tevery))   ) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_filter",   17, &usefilter))) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_threads",  18, &nthreads)) ) any_rc = rc;
+        if ( (rc = sf_scalar_int("__sparquet_prefetch", 19, &prefetch)) ) any_rc = rc;
+        if ( (rc = sf_io_init(&io)) ) any_rc = rc;
 
         _readrg = readrg? readrg: 1;
         maxstrlen = 1;
@@ -106,19 +88,51 @@ ST_retcode sf_ll_read_varlist(
         for (j = 0; j < ncol; j++)
             if ( vtypes[j] > maxstrlen ) maxstrlen = vtypes[j];
 
-        SPARQUET_CHAR(vstr, maxstrlen);
+        sf_ll_batch_init(&batch, SPARQUET_BATCH, maxstrlen);
+        encoders.resize(ncol);
         if ( any_rc ) {
             rc = any_rc;
             goto exit;
         }
 
-        // Read into; adjust in range selection to be 0-indexed
+        // File metadata; pages come from a memory map or coalesced
+        // reads of the selected columns if requested
+        std::shared_ptr<arrow::io::RandomAccessFile> source = sf_io_open(fname, &io);
+        std::unique_ptr<parquet::ParquetFileReader> parquet_reader =
+            sf_session_reader(fname, source);
+
+        std::shared_ptr<parquet::FileMetaData> file_metadata =
+            parquet_reader->metadata();
+
+        // ncol = file_metadata->num_columns();
+        nrow_groups = file_metadata->num_row_groups();
+        ix = 0;
+
+        // Rows to read; with an if condition they were selected by
+        // sf_ll_select_varlist, otherwise it is the in() range.
+        if ( usefilter ) {
+            if ( (rc = sf_ll_select_read(fselect, runs)) ) goto exit;
+        }
+        else {
+            runs.push_back(infrom - 1);
+            runs.push_back(into - infrom + 1);
+        }
+
+        // Coalesced reads cover the groups read below (the worker pool
+        // has its own sources)
+        if ( nthreads <= 1 && prefetch <= 0 ) {
+            sf_io_select(source, &io, file_metadata,
+                         sf_io_rowgroups(file_metadata, readrg, rowgix, runs, 0, 0),
+                         colix, ncol, verbose);
+        }
+
         sf_printf_debug(verbose, "\tFile:    %s\n",  fname);
         sf_printf_debug(verbose, "\tGroups:  %ld\n", nrow_groups);
         sf_printf_debug(verbose, "\tColumns: %ld\n", ncol);
-        sf_printf_debug(verbose, "\tRows:    %ld\n", --into - --infrom + 1);
+        for (tobs = 0, u = 1; u < (int64_t) runs.size(); u += 2)
+            tobs += runs[u];
+        sf_printf_debug(verbose, "\tRows:    %ld\n", tobs);
 
-        tobs   = into - infrom + 1;
         ttot   = ncol * tobs;
         tread  = 0;
 
@@ -140,9 +154,20 @@ ST_retcode sf_ll_read_varlist(
         // For each group, loop through each column
         // For each column, loop through each row
 
-        rg = 0;
-        clock_t timer  = clock();
-        clock_t stimer = clock();
+        rg = u = 0;
+        sf_clock timer  = sf_clock_now();
+        sf_clock stimer = sf_clock_now();
+
+        chunk.warn_strings = 0;
+        chunk.timer        = &timer;
+        chunk.stimer       = &stimer;
+        chunk.progress     = progress;
+        chunk.tread        = &tread;
+        chunk.ttot         = ttot;
+        chunk.tobs         = tobs;
+        chunk.nrow_groups  = nrow_groups;
+        chunk.ncol         = ncol;
+
         for (r = 0; r < nrow_groups; ++r) {
             if ( readrg ) {
                 if ( r == rowgix[rg] ) {
@@ -152,238 +177,60 @@ ST_retcode sf_ll_read_varlist(
                     continue;
                 }
             }
+            if ( u >= (int64_t) runs.size() ) break;
+
+            // Jump over groups with no selected rows using only the
+            // footer metadata; no column chunk is touched.
+            rgrows = file_metadata->RowGroup(r)->num_rows();
+            if ( !sf_ll_chunk_runs(&chunk, runs, &u, ix, rgrows) ) {
+                ix += rgrows;
+                rgskip++;
+                continue;
+            }
+
+            // With threads(#) or prefetch(#) only queue the column chunks;
+            // they are decoded by the worker pool once all groups are known.
+            chunk.sobs = nread;
+            if ( nthreads > 1 || prefetch > 0 ) {
+                nread += sf_ll_tasks_add(tasks, 0, r, ngroups++, &chunk, ncol, colix, vtypes,
+                                         file_metadata->RowGroup(r).get());
+                ix += rgrows;
+                continue;
+            }
+
             rgread = 0;
-            ix += ig;
-            ig = 0;
-            if ( ix > into ) break;
             row_group_reader = parquet_reader->RowGroup(r);
+
+            chunk.r    = r;
             for (j = 0; j < ncol; j++) {
-                cread = 0;
-                i = 0;
                 jsel = colix[j];
-                // column_reader = row_group_reader->Column(jsel);
                 descr = file_metadata->schema()->Column(jsel);
-                switch (descr->physical_type()) {
-                    case Type::BOOLEAN:    // byte
-                        bool_scanner = std::make_shared<parquet::BoolScanner>(row_group_reader->Column(jsel));
-                        while ( bool_scanner->HasNext() && i++ < (infrom - ix) ) {
-                            bool_scanner->NextValue(&vbool, &is_null);
-                        }
-                        i--;
-                        while ( bool_scanner->HasNext() && i++ <= (into - ix) ) {
-                            if ( (i - infrom) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, nrow_groups,
-                                    j + 1, ncol,
-                                    i + ix - infrom, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            bool_scanner->NextValue(&vbool, &is_null);
-                            // sf_printf_debug(2, "\t(bool, %ld, %ld): %9.4f\n", j, i + ix, (ST_double) vbool);
-                            if ( (rc = SF_vstore(j + 1, i + ix - infrom, is_null? SV_missval: (ST_double) vbool)) ) goto exit;
-                            cread++;
-                        }
-                        break;
-                    case Type::INT32:      // long
-                        int32_scanner = std::make_shared<parquet::Int32Scanner>(row_group_reader->Column(jsel));
-                        while ( int32_scanner->HasNext() && i++ < (infrom - ix) ) {
-                            int32_scanner->NextValue(&vint32, &is_null);
-                        }
-                        i--;
-                        while ( int32_scanner->HasNext() && i++ <= (into - ix) ) {
-                            if ( (i - infrom) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, nrow_groups,
-                                    j + 1, ncol,
-                                    i + ix - infrom, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            int32_scanner->NextValue(&vint32, &is_null);
-                            // sf_printf_debug(2, "\t(int32, %ld, %ld): %9.4f\n", j, i + ix, (ST_double) vint32);
-                            if ( (rc = SF_vstore(j + 1, i + ix - infrom, is_null? SV_missval: (ST_double) vint32)) ) goto exit;
-                            cread++;
-                        }
-                        break;
-                    case Type::INT64:      // double
-                        int64_scanner = std::make_shared<parquet::Int64Scanner>(row_group_reader->Column(jsel));
-                        while ( int64_scanner->HasNext() && i++ < (infrom - ix) ) {
-                            int64_scanner->NextValue(&vint64, &is_null);
-                        }
-                        i--;
-                        while ( int64_scanner->HasNext() && i++ <= (into - ix) ) {
-                            if ( (i - infrom) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, nrow_groups,
-                                    j + 1, ncol,
-                                    i + ix - infrom, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            int64_scanner->NextValue(&vint64, &is_null);
-                            // sf_printf_debug(2, "\t(int64, %ld, %ld): %9.4f\n", j, i + ix, (ST_double) vint64);
-                            if ( (rc = SF_vstore(j + 1, i + ix - infrom, is_null? SV_missval: (ST_double) vint64)) ) goto exit;
-                            cread++;
-                        }
-                        break;
-                    case Type::INT96:
-                        sf_errprintf("96-bit integers not implemented.\n");
-                        rc = 17101;
-                        goto exit;
-                    case Type::FLOAT:      // float
-                        float_scanner = std::make_shared<parquet::FloatScanner>(row_group_reader->Column(jsel));
-                        while ( float_scanner->HasNext() && i++ < (infrom - ix) ) {
-                            float_scanner->NextValue(&vfloat, &is_null);
-                        }
-                        i--;
-                        while ( float_scanner->HasNext() && i++ <= (into - ix) ) {
-                            if ( (i - infrom) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, nrow_groups,
-                                    j + 1, ncol,
-                                    i + ix - infrom, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            float_scanner->NextValue(&vfloat, &is_null);
-                            // sf_printf_debug(2, "\t(float, %ld, %ld): %9.4f\n", j, i + ix, (ST_double) vfloat);
-                            if ( (rc = SF_vstore(j + 1, i + ix - infrom, is_null? SV_missval: (ST_double) vfloat)) ) goto exit;
-                            cread++;
-                        }
-                        break;
-                    case Type::DOUBLE:     // double
-                        double_scanner = std::make_shared<parquet::DoubleScanner>(row_group_reader->Column(jsel));
-                        while ( double_scanner->HasNext() && i++ < (infrom - ix) ) {
-                            double_scanner->NextValue(&vdouble, &is_null);
-                        }
-                        i--;
-                        while ( double_scanner->HasNext() && i++ <= (into - ix) ) {
-                            if ( (i - infrom) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, nrow_groups,
-                                    j + 1, ncol,
-                                    i + ix - infrom, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            double_scanner->NextValue(&vdouble, &is_null);
-                            // sf_printf_debug(debug, "\t(double, %ld, %ld): %9.4f\n", j, i + ix, (ST_double) vdouble);
-                            if ( (rc = SF_vstore(j + 1, i + ix - infrom, is_null? SV_missval: vdouble)) ) goto exit;
-                            cread++;
-                        }
-                        break;
-                    case Type::BYTE_ARRAY: // str#, strL
-                        ba_scanner = std::make_shared<parquet::ByteArrayScanner>(row_group_reader->Column(jsel));
-                        while ( ba_scanner->HasNext() && i++ < (infrom - ix) ) {
-                            ba_scanner->NextValue(&vbytearray, &is_null);
-                        }
-                        i--;
-                        while ( ba_scanner->HasNext() && i++ <= (into - ix) ) {
-                            if ( (i - infrom) % tevery == 0 ) {
-                                tread += tevery;
-                                sf_running_progress_read(
-                                    &timer,
-                                    &stimer,
-                                    progress,
-                                    r + 1, nrow_groups,
-                                    j + 1, ncol,
-                                    i + ix - infrom, tobs,
-                                    100 * tread / ttot
-                                );
-                            }
-                            ba_scanner->NextValue(&vbytearray, &is_null);
-                            if ( is_null ) {
-                                warn_strings++;
-                            }
-                            else if ( vbytearray.len > vtypes[j] ) {
-                                sf_errprintf("Buffer (%d) too small; re-run with larger buffer or -strscan(.)-\n", vtypes[j]);
-                                sf_errprintf("Group %d, row %d, col %d had a string of length %d.\n", r, i + ix, j, vbytearray.len);
-                                rc = 17103;
-                                goto exit;
-                            }
-                            else {
-                                memcpy(vstr, vbytearray.ptr, vbytearray.len);
-                                // sf_printf_debug(debug, "\t(BA, %ld, %ld): %s\n", j, i + ix, vstr);
-                                if ( (rc = SF_sstore(j + 1, i + ix - infrom, vstr)) ) goto exit;
-                                memset(vstr, '\0', maxstrlen);
-                                cread++;
-                            }
-                        }
-                        break;
-                    case Type::FIXED_LEN_BYTE_ARRAY:
-                        if ( descr->type_length() > vtypes[j] ) {
-                            sf_errprintf("Buffer (%d) too small; error parsing FixedLenByteArray.\n", vtypes[j]);
-                            sf_errprintf("Group %d, row %d, col %d had a string of length %d.\n", r, i + ix, j, descr->type_length());
-                            rc = 17103;
-                            goto exit;
-                        }
-                        else {
-                            flba_scanner = std::make_shared<parquet::FixedLenByteArrayScanner>(row_group_reader->Column(jsel));
-                            while ( flba_scanner->HasNext() && i++ < (infrom - ix) ) {
-                                flba_scanner->NextValue(&vfixedlen, &is_null);
-                            }
-                            i--;
-                            while ( flba_scanner->HasNext() && i++ <= (into - ix) ) {
-                                if ( (i - infrom) % tevery == 0 ) {
-                                    tread += tevery;
-                                    sf_running_progress_read(
-                                        &timer,
-                                        &stimer,
-                                        progress,
-                                        r + 1, nrow_groups,
-                                        j + 1, ncol,
-                                        i + ix - infrom, tobs,
-                                        100 * tread / ttot
-                                    );
-                                }
-                                flba_scanner->NextValue(&vfixedlen, &is_null);
-                                if ( is_null ) {
-                                    warn_strings++;
-                                }
-                                else {
-                                    memcpy(vstr, vfixedlen.ptr, descr->type_length());
-                                    // sf_printf_debug(debug, "\t(FLBA, %ld, %ld): %s\n", j, i + ix, vstr);
-                                    if ( (rc = SF_sstore(j + 1, i + ix - infrom, vstr)) ) goto exit;
-                                    memset(vstr, '\0', maxstrlen);
-                                    cread++;
-                                }
-                            }
-                        }
-                        break;
-                    default:
-                        sf_errprintf("Unknown parquet type.\n");
-                        rc = 17100;
-                        goto exit;
-                }
-                ig = i > ig? i: ig;
-                rgread = cread > rgread? cread: rgread;
+                chunk.j     = j;
+                chunk.vtype = vtypes[j];
+                chunk.encoder = vtypes[j] < 0 && descr->physical_type() == Type::BYTE_ARRAY? &encoders[j]: nullptr;
+                if ( (rc = sf_ll_read_chunk(row_group_reader, descr, jsel, &batch, &chunk)) ) goto exit;
+                rgread = chunk.nread > rgread? chunk.nread: rgread;
             }
             nread += rgread;
+            ix += rgrows;
         }
 
-        if ( warn_strings > 0 ) {
-            sf_printf("Warning: %ld NaN values in string variables coerced to blanks ('').\n", warn_strings);
+        if ( nthreads > 1 || prefetch > 0 ) {
+            nahead   = nthreads > 1? 2 * nthreads: 2 * ncol;
+            prefetch = prefetch * 1024 * 1024;
+            sf_printf_debug(verbose, "\tDecoding %ld column chunks on %ld threads (%ld chunks, %ld MiB ahead)\n",
+                            (int64_t) tasks.size(), nthreads, nahead, prefetch / 1024 / 1024);
+            if ( (rc = sf_ll_read_threaded(fnames, &io, colix, ncol, tasks, nthreads, nahead, prefetch, encoders, &chunk, &nread)) ) goto exit;
+        }
+
+        if ( rgskip > 0 ) {
+            sf_printf_debug(verbose, "\tSkipped %ld row groups with no rows to read\n", rgskip);
+        }
+        if ( chunk.warn_strings > 0 ) {
+            sf_printf("Warning: %ld NaN values in string variables coerced to blanks ('').\n", chunk.warn_strings);
+        }
+        if ( flabels[0] != '\0' ) {
+            if ( (rc = sf_ll_encoder_write(flabels, encoders)) ) goto exit;
         }
         sf_running_timer (&timer, "Read data from disk");
 
@@ -392,9 +239,9 @@ ST_retcode sf_ll_read_varlist(
         return(-1);
     }
 
-    if ( (into - infrom + 1) != nread ) {
+    if ( tobs != nread ) {
         sf_errprintf("Warning: Expected %ld obs but found %ld\n",
-                     (into - infrom + 1), nread);
+                     tobs, nread);
     }
 
     memcpy(vscalar, "__sparquet_nread", 16);
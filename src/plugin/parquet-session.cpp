@@ -0,0 +1,91 @@
+// Read session
+// ------------
+//
+// One parquet use calls the plugin several times (shape, colnames,
+// coltypes, select, read). The plugin stays loaded between calls, so the
+// first call opens a session and keeps the parsed footer of every file
+// it touches; later calls that pass the handle back in __sparquet_session
+// reuse that metadata instead of reading and parsing the footer again.
+// parquet use closes the session when it exits. Calls without a handle,
+// or with a stale one, do not use or fill the session.
+//
+// Worker threads open files too, so the table is behind a mutex.
+
+struct sf_session {
+    int64_t id;
+    int64_t next;
+    bool active;
+    std::mutex mtx;
+    std::unordered_map<std::string, std::shared_ptr<parquet::FileMetaData>> metadata;
+};
+
+sf_session sf_session_state = {0, 1, false};
+
+// Start a new session, dropping the previous one, and return its handle
+
+int64_t sf_session_open()
+{
+    std::lock_guard<std::mutex> lock(sf_session_state.mtx);
+    sf_session_state.metadata.clear();
+    sf_session_state.id = sf_session_state.next++;
+    sf_session_state.active = true;
+    return (sf_session_state.id);
+}
+
+void sf_session_close()
+{
+    std::lock_guard<std::mutex> lock(sf_session_state.mtx);
+    sf_session_state.metadata.clear();
+    sf_session_state.id = 0;
+    sf_session_state.active = false;
+}
+
+// Use the session if id is its handle; called once per plugin call
+
+void sf_session_use(int64_t id)
+{
+    std::lock_guard<std::mutex> lock(sf_session_state.mtx);
+    sf_session_state.active = id > 0 && id == sf_session_state.id;
+}
+
+// Parsed footer of fname, or nullptr if it has not been read in this
+// session (or there is no session).
+
+std::shared_ptr<parquet::FileMetaData> sf_session_metadata(const std::string &fname)
+{
+    std::lock_guard<std::mutex> lock(sf_session_state.mtx);
+    if ( !sf_session_state.active ) return (nullptr);
+    auto it = sf_session_state.metadata.find(fname);
+    return (it == sf_session_state.metadata.end()? nullptr: it->second);
+}
+
+void sf_session_add(const std::string &fname, std::shared_ptr<parquet::FileMetaData> file_metadata)
+{
+    std::lock_guard<std::mutex> lock(sf_session_state.mtx);
+    if ( sf_session_state.active ) sf_session_state.metadata[fname] = file_metadata;
+}
+
+// Drop-in for ParquetFileReader::Open/OpenFile that uses and fills the
+// session's metadata.
+
+std::unique_ptr<parquet::ParquetFileReader> sf_session_reader(
+    const std::string &fname,
+    std::shared_ptr<arrow::io::RandomAccessFile> source)
+{
+    std::shared_ptr<parquet::FileMetaData> file_metadata = sf_session_metadata(fname);
+    std::unique_ptr<parquet::ParquetFileReader> parquet_reader =
+        parquet::ParquetFileReader::Open(source, parquet::default_reader_properties(), file_metadata);
+    if ( file_metadata == nullptr ) sf_session_add(fname, parquet_reader->metadata());
+    return (parquet_reader);
+}
+
+std::unique_ptr<parquet::ParquetFileReader> sf_session_file(
+    const std::string &fname,
+    bool usemmap)
+{
+    std::shared_ptr<parquet::FileMetaData> file_metadata = sf_session_metadata(fname);
+    std::unique_ptr<parquet::ParquetFileReader> parquet_reader =
+        parquet::ParquetFileReader::OpenFile(fname, usemmap, parquet::default_reader_properties(), file_metadata);
+    if ( file_metadata == nullptr ) sf_session_add(fname, parquet_reader->metadata());
+    return (parquet_reader);
+}
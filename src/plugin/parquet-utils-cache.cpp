@@ -0,0 +1,231 @@
+// Column type cache
+// -----------------
+//
+// With the cache option, the types inferred for a file are saved and
+// reused by later reads so the string scan is skipped. An entry is a
+// small text file, next to the parquet file (fname.stcache) or in a
+// cache directory (named after a hash of the canonical path), with
+//
+//     sparquet-coltypes 1
+//     canonical path
+//     size mtime footer-hash ncol
+//     rawtype coltype                 (one line per column)
+//
+// The entry is only used if the path, file size, modification time and
+// a hash of the footer all match. String widths come from a scan of
+// every row in the file, so they hold for any in() or rg() subset;
+// columns not scanned yet have coltype 0 and are added to the entry the
+// first time they are read.
+
+struct sf_cache_entry {
+    std::string path;
+    int64_t size;
+    int64_t mtime;
+    uint64_t hash;
+    std::vector<int64_t> rawtypes;
+    std::vector<int64_t> coltypes;
+};
+
+// FNV-1a; only used to tell files apart, not for security
+
+uint64_t sf_cache_fnv(const char *data, int64_t n, uint64_t hash = 14695981039346656037ULL)
+{
+    int64_t k;
+    for (k = 0; k < n; k++) {
+        hash ^= (uint8_t) data[k];
+        hash *= 1099511628211ULL;
+    }
+    return (hash);
+}
+
+// Canonical path of fname, so a relative name used from different
+// working directories is told apart; fname if it can't be resolved.
+
+std::string sf_cache_realpath(const std::string &fname)
+{
+#ifdef _WIN32
+    char *resolved = _fullpath(NULL, fname.c_str(), 0);
+#else
+    char *resolved = realpath(fname.c_str(), NULL);
+#endif
+    if ( resolved == NULL ) return (fname);
+    std::string path(resolved);
+    free(resolved);
+    return (path);
+}
+
+// Key of fname: size, mtime and a hash of the footer (the metadata and
+// its length at the end of the file). False if the file can't be read.
+
+bool sf_cache_key(const std::string &fname, sf_cache_entry *entry)
+{
+    struct stat finfo;
+    uint32_t flen;
+    std::vector<char> footer;
+    std::ifstream fstream;
+
+    if ( stat(fname.c_str(), &finfo) ) return (false);
+    entry->path  = sf_cache_realpath(fname);
+    entry->size  = finfo.st_size;
+    entry->mtime = finfo.st_mtime;
+    if ( entry->size < 12 ) return (false);
+
+    fstream.open(fname, std::ios::binary);
+    if ( !fstream.is_open() ) return (false);
+    fstream.seekg(entry->size - 8);
+    fstream.read((char *) &flen, 4);
+    if ( !fstream || (int64_t) flen + 8 > entry->size ) return (false);
+
+    footer.resize(flen + 8);
+    fstream.seekg(entry->size - 8 - flen);
+    fstream.read(footer.data(), flen + 8);
+    if ( !fstream ) return (false);
+
+    entry->hash = sf_cache_fnv(footer.data(), flen + 8);
+    return (true);
+}
+
+std::string sf_cache_path(const std::string &fname, const char *fcache)
+{
+    char hex[17];
+    if ( fcache[0] == '\0' ) return (fname + ".stcache");
+    std::string path = sf_cache_realpath(fname);
+    snprintf(hex, 17, "%016llx", (unsigned long long) sf_cache_fnv(path.c_str(), path.size()));
+    return (std::string(fcache) + "/sparquet-" + hex + ".stcache");
+}
+
+// Read the entry at cpath into entry if it matches the key in entry;
+// ncol columns are expected. Anything else is a miss.
+
+bool sf_cache_read(const std::string &cpath, int64_t ncol, sf_cache_entry *entry)
+{
+    int64_t j, version, size, mtime, _ncol;
+    uint64_t hash;
+    std::string header, path;
+    std::ifstream fstream(cpath);
+
+    entry->rawtypes.assign(ncol, 0);
+    entry->coltypes.assign(ncol, 0);
+    if ( !fstream.is_open() ) return (false);
+
+    fstream >> header >> version;
+    fstream.ignore(1);
+    std::getline(fstream, path);
+    fstream >> size >> mtime >> hash >> _ncol;
+    if ( !fstream || header != "sparquet-coltypes" || version != 1 ) return (false);
+    if ( path != entry->path || size != entry->size || mtime != entry->mtime ) return (false);
+    if ( hash != entry->hash || _ncol != ncol ) return (false);
+
+    for (j = 0; j < ncol; j++) {
+        fstream >> entry->rawtypes[j] >> entry->coltypes[j];
+    }
+    if ( !fstream ) {
+        entry->rawtypes.assign(ncol, 0);
+        entry->coltypes.assign(ncol, 0);
+        return (false);
+    }
+
+    return (true);
+}
+
+// Write the entry; a cache that can't be written is not an error
+
+bool sf_cache_write(const std::string &cpath, const sf_cache_entry &entry)
+{
+    int64_t j;
+    std::string tmp = cpath + ".tmp";
+    std::ofstream fstream(tmp);
+
+    if ( !fstream.is_open() ) return (false);
+    fstream << "sparquet-coltypes 1\n" << entry.path << "\n";
+    fstream << entry.size << " " << entry.mtime << " " << entry.hash << " "
+            << entry.rawtypes.size() << "\n";
+    for (j = 0; j < (int64_t) entry.rawtypes.size(); j++) {
+        fstream << entry.rawtypes[j] << " " << entry.coltypes[j] << "\n";
+    }
+    fstream.close();
+    if ( !fstream ) {
+        remove(tmp.c_str());
+        return (false);
+    }
+
+    // Replace the old entry in one step so concurrent reads never see
+    // a partial file
+    remove(cpath.c_str());
+    return (rename(tmp.c_str(), cpath.c_str()) == 0);
+}
+
+// Look up the widths of the BYTE_ARRAY columns being scanned (scan[j])
+// in the entry for file f. Hits go into strlen[j]; misses are queued
+// as tasks over every row of the file, to be run by the caller and
+// recorded with sf_cache_store. Returns the number of hits.
+
+int64_t sf_cache_lookup(
+    sf_cache_entry *entry,
+    const std::string &cpath,
+    std::shared_ptr<parquet::FileMetaData> file_metadata,
+    int64_t f,
+    const int64_t *colix,
+    const bool *scan,
+    int64_t *strlen,
+    int64_t ncol,
+    std::vector<sf_strscan_task> &tasks)
+{
+    int64_t j, ix = 0, nhit = 0;
+    bool miss[ncol];
+
+    sf_cache_read(cpath, file_metadata->num_columns(), entry);
+    for (j = 0; j < ncol; j++) {
+        miss[j] = scan[j] && entry->coltypes[colix[j]] <= 0;
+        if ( scan[j] && !miss[j] ) {
+            strlen[j] = std::max(strlen[j], entry->coltypes[colix[j]]);
+            nhit++;
+        }
+    }
+
+    sf_strscan_tasks_add(tasks, file_metadata, f, colix, miss, ncol,
+                         0, NULL, 0, file_metadata->num_rows(), 0, &ix);
+
+    return (nhit);
+}
+
+// Record the types of file f, with the widths scanned by its tasks,
+// and write the entry out
+
+bool sf_cache_store(
+    sf_cache_entry *entry,
+    const std::string &cpath,
+    std::shared_ptr<parquet::FileMetaData> file_metadata,
+    int64_t f,
+    const std::vector<sf_strscan_task> &tasks)
+{
+    int64_t j, t;
+    bool changed = false;
+    const parquet::ColumnDescriptor* descr;
+
+    // Raw types follow the physical type order (1 bool, ..., 8 flba);
+    // column types are the Stata types sf_ll_coltypes assigns, after
+    // date, time and decimal conversion.
+    const int64_t numtypes[] = {-1, -3, -5, -5, -4, -5};
+    for (j = 0; j < file_metadata->num_columns(); j++) {
+        descr = file_metadata->schema()->Column(j);
+        entry->rawtypes[j] = descr->physical_type() + 1;
+        if ( descr->physical_type() == Type::FIXED_LEN_BYTE_ARRAY ) {
+            entry->coltypes[j] = descr->type_length();
+        }
+        else if ( descr->physical_type() != Type::BYTE_ARRAY ) {
+            entry->coltypes[j] = numtypes[descr->physical_type()];
+        }
+        entry->coltypes[j] = sf_convert_vtype(sf_convert_type(descr), entry->coltypes[j]);
+    }
+
+    // Stored widths are at least 1 so 0 can mean not scanned
+    for (t = 0; t < (int64_t) tasks.size(); t++) {
+        if ( tasks[t].f != f ) continue;
+        j = tasks[t].jsel;
+        entry->coltypes[j] = std::max(entry->coltypes[j], std::max(tasks[t].strlen, (int64_t) 1));
+        changed = true;
+    }
+
+    return (changed? sf_cache_write(cpath, *entry): true);
+}
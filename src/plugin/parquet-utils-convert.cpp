@@ -0,0 +1,203 @@
+// Dates and times
+// ---------------
+//
+// DATE, TIMESTAMP and TIME columns hold counts from the Unix epoch (or
+// from midnight) in days or in milli-, micro- or nanoseconds. They are
+// converted while decoding into Stata dates, days since 01jan1960
+// (%td), or datetimes, milliseconds since 01jan1960 (%tc); times of day
+// are datetimes on 01jan1960. The Stata value is raw * mul / div +
+// offset (integer factors, so whole units convert exactly).
+// fmt tells parquet.ado which display format to give the variable.
+//
+// The conversion is increasing, so it can be applied to min/max
+// statistics and to the values an if condition is checked against.
+//
+// Two physical layouts need decoding before that. INT96 timestamps
+// (older Spark and Impala files) are nanoseconds within a Julian day;
+// they are decoded to milliseconds from the Unix epoch. DECIMAL(p, s)
+// columns hold the unscaled integer, either as INT32/INT64 or as a
+// big-endian two's complement byte array; the conversion divides by
+// 10^s. Decimals are read as doubles, so more than 15 or so
+// significant digits are rounded.
+
+#define SPARQUET_FMT_NONE    0  // no format
+#define SPARQUET_FMT_TD      1  // %td
+#define SPARQUET_FMT_TC      2  // %tc
+#define SPARQUET_FMT_TIME    3  // %tcHH:MM:SS.sss
+#define SPARQUET_FMT_DECIMAL 4  // decimal; Stata's default format
+
+// Days and milliseconds from 01jan1960 to 01jan1970
+#define SPARQUET_EPOCH_TD 3653
+#define SPARQUET_EPOCH_TC 315619200000.0
+
+// Julian day of 01jan1970
+#define SPARQUET_JULIAN_UNIX 2440588
+
+struct sf_convert {
+    int64_t fmt;
+    ST_double mul;
+    ST_double div;
+    ST_double offset;
+};
+
+sf_convert sf_convert_type(const parquet::ColumnDescriptor *descr)
+{
+    sf_convert convert = {SPARQUET_FMT_NONE, 1, 1, 0};
+    parquet::LogicalType::TimeUnit::unit unit;
+    const std::shared_ptr<const parquet::LogicalType> &ltype = descr->logical_type();
+
+    if ( descr->physical_type() == Type::INT96 ) {
+        convert.fmt    = SPARQUET_FMT_TC;
+        convert.offset = SPARQUET_EPOCH_TC;
+        return (convert);
+    }
+
+    if ( ltype == nullptr ) return (convert);
+    if ( ltype->is_decimal() ) {
+        convert.fmt = SPARQUET_FMT_DECIMAL;
+        convert.div = std::pow(10.0, static_cast<const parquet::DecimalLogicalType&>(*ltype).scale());
+        return (convert);
+    }
+    else if ( ltype->is_date() ) {
+        convert.fmt    = SPARQUET_FMT_TD;
+        convert.offset = SPARQUET_EPOCH_TD;
+        return (convert);
+    }
+    else if ( ltype->is_timestamp() ) {
+        unit = static_cast<const parquet::TimestampLogicalType&>(*ltype).time_unit();
+        convert.fmt    = SPARQUET_FMT_TC;
+        convert.offset = SPARQUET_EPOCH_TC;
+    }
+    else if ( ltype->is_time() ) {
+        unit = static_cast<const parquet::TimeLogicalType&>(*ltype).time_unit();
+        convert.fmt    = SPARQUET_FMT_TIME;
+    }
+    else {
+        return (convert);
+    }
+
+    switch (unit) {
+        case parquet::LogicalType::TimeUnit::MILLIS: convert.div = 1;       break;
+        case parquet::LogicalType::TimeUnit::MICROS: convert.div = 1000;    break;
+        case parquet::LogicalType::TimeUnit::NANOS:  convert.div = 1000000; break;
+        default:
+            convert.fmt = SPARQUET_FMT_NONE;
+            convert.offset = 0;
+            break;
+    }
+    return (convert);
+}
+
+// The same for the types the high-level reader gets from Arrow
+
+sf_convert sf_convert_arrow(const std::shared_ptr<arrow::DataType> &type)
+{
+    sf_convert convert = {SPARQUET_FMT_NONE, 1, 1, 0};
+    arrow::TimeUnit::type unit;
+
+    switch (type->id()) {
+        case arrow::Type::DATE32:
+            convert.fmt    = SPARQUET_FMT_TD;
+            convert.offset = SPARQUET_EPOCH_TD;
+            return (convert);
+        case arrow::Type::DATE64:
+            convert.fmt    = SPARQUET_FMT_TD;
+            convert.div    = 86400000;
+            convert.offset = SPARQUET_EPOCH_TD;
+            return (convert);
+        case arrow::Type::TIMESTAMP:
+            unit = static_cast<const arrow::TimestampType&>(*type).unit();
+            convert.fmt    = SPARQUET_FMT_TC;
+            convert.offset = SPARQUET_EPOCH_TC;
+            break;
+        case arrow::Type::TIME32:
+        case arrow::Type::TIME64:
+            unit = static_cast<const arrow::TimeType&>(*type).unit();
+            convert.fmt    = SPARQUET_FMT_TIME;
+            break;
+        default:
+            return (convert);
+    }
+
+    switch (unit) {
+        case arrow::TimeUnit::SECOND: convert.mul = 1000;    break;
+        case arrow::TimeUnit::MILLI:  convert.div = 1;       break;
+        case arrow::TimeUnit::MICRO:  convert.div = 1000;    break;
+        case arrow::TimeUnit::NANO:   convert.div = 1000000; break;
+    }
+    return (convert);
+}
+
+// Stata type for a converted column: dates fit in a long, datetimes
+// and decimals need a double
+
+int64_t sf_convert_vtype(const sf_convert &convert, int64_t vtype)
+{
+    switch (convert.fmt) {
+        case SPARQUET_FMT_TD:      return (-3);
+        case SPARQUET_FMT_TC:      return (-5);
+        case SPARQUET_FMT_TIME:    return (-5);
+        case SPARQUET_FMT_DECIMAL: return (-5);
+        default:                   return (vtype);
+    }
+}
+
+// Raw value of a decoded parquet value as a double: a cast for the
+// numeric physical types; INT96 and decimal byte arrays are decoded.
+// len is the width of FIXED_LEN_BYTE_ARRAY values.
+
+template <typename T>
+inline ST_double sf_convert_raw(const T &value, int64_t)
+{
+    return ((ST_double) value);
+}
+
+inline ST_double sf_convert_raw(const parquet::Int96 &value, int64_t)
+{
+    uint64_t nanos = ((uint64_t) value.value[1] << 32) | value.value[0];
+    return (((ST_double) value.value[2] - SPARQUET_JULIAN_UNIX) * 86400000 + (ST_double) nanos / 1000000);
+}
+
+// Big-endian two's complement; the first 8 bytes are exact, any
+// further ones (precision over 18) are folded in as a double.
+
+inline ST_double sf_convert_bytes(const uint8_t *ptr, int64_t len)
+{
+    int64_t k, head = std::min(len, (int64_t) 8);
+    uint64_t bits = 0;
+    ST_double z;
+
+    if ( len == 0 ) return (0);
+    for (k = 0; k < head; k++)
+        bits = (bits << 8) | ptr[k];
+    z = head < 8? (ST_double) ((int64_t) (bits << (64 - 8 * head)) >> (64 - 8 * head)): (ST_double) (int64_t) bits;
+    for (; k < len; k++)
+        z = z * 256 + ptr[k];
+    return (z);
+}
+
+inline ST_double sf_convert_raw(const parquet::ByteArray &value, int64_t)
+{
+    return (sf_convert_bytes(value.ptr, value.len));
+}
+
+inline ST_double sf_convert_raw(const parquet::FixedLenByteArray &value, int64_t len)
+{
+    return (sf_convert_bytes(value.ptr, len));
+}
+
+inline ST_double sf_convert_value(const sf_convert &convert, ST_double z)
+{
+    return (z * convert.mul / convert.div + convert.offset);
+}
+
+// Convert n decoded values in place; missing values are left alone
+
+void sf_convert_apply(const sf_convert &convert, ST_double *vdouble, int64_t n)
+{
+    int64_t k;
+    if ( convert.fmt == SPARQUET_FMT_NONE ) return;
+    for (k = 0; k < n; k++) {
+        if ( vdouble[k] < SV_missval ) vdouble[k] = sf_convert_value(convert, vdouble[k]);
+    }
+}
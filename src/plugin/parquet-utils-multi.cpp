@@ -23,7 +23,7 @@ ST_retcode sf_ll_shape_multi(const char *flist, const int debug)
 
         if ( fstream.is_open() ) {
             while ( std::getline(fstream, fname) ) {
-                parquet_reader = parquet::ParquetFileReader::OpenFile(fname, false);
+                parquet_reader = sf_session_file(fname, false);
                 file_metadata  = parquet_reader->metadata();
                 fnrow = file_metadata->num_rows();
                 fncol = file_metadata->num_columns();
@@ -74,17 +74,19 @@ exit:
 // Stata function: Low-level column names
 //
 // flist is the file with the list of parquet files
-// fcols is the temporary text file where to write column names
+//
+// locals
+//     sparquet_colnames (names separated by char(31))
 
 ST_retcode sf_ll_colnames_multi(
     const char *flist,
-    const char *fcols,
     const int debug)
 {
     ST_retcode rc = 0;
     int64_t ncol = 0, nfiles = 0, fncol, j;
     rc = sf_scalar_int("__sparquet_ncol", 15, &ncol);
     std::string vnames[ncol];
+    std::string vlist;
     if ( rc ) goto exit;
 
     try {
@@ -93,12 +95,11 @@ ST_retcode sf_ll_colnames_multi(
 
         std::string fname;
         std::ifstream fstream;
-        std::ofstream fcolstream;
         fstream.open(flist);
 
         if ( fstream.is_open() ) {
             while ( std::getline(fstream, fname) ) {
-                parquet_reader = parquet::ParquetFileReader::OpenFile(fname, false);
+                parquet_reader = sf_session_file(fname, false);
                 file_metadata  = parquet_reader->metadata();
                 fncol = file_metadata->num_columns();
                 if ( nfiles++ > 1 ) {
@@ -121,21 +122,22 @@ ST_retcode sf_ll_colnames_multi(
                 else {
                     ncol = fncol;
 
-                    // Write column names to file; one per line
-                    fcolstream.open(fcols);
                     for (j = 0; j < ncol; j++) {
                         const parquet::ColumnDescriptor* descr =
                             file_metadata->schema()->Column(j);
 
                         vnames[j] = descr->name();
-                        fcolstream << descr->name() << "\n";
+                        if ( j ) vlist += SPARQUET_COLSEP;
+                        vlist += descr->name();
                     }
-                    fcolstream.close();
                 }
             }
             fstream.close();
         }
 
+        // Column names go straight into a local macro
+        if ( (rc = sf_macro_save("_sparquet_colnames", vlist)) ) goto exit;
+
     } catch (const std::exception& e) {
         sf_errprintf("Parquet read error: %s\n", e.what());
         return(-1);
@@ -148,62 +150,85 @@ exit:
 // Stata function: Low-level column types
 //
 // flist is the parquet file with the lsit of names
+// fcache is the type cache directory (empty for files next to each file)
 // strbuffer is the string length fallback
 //
 // matrices
 //     __sparquet_coltypes
 //     __sparquet_rawtypes
+//     __sparquet_colfmts
 //     __sparquet_colix
 // scalars
 //     __sparquet_strscan
 //     __sparquet_ncol
 //     __sparquet_into
 //     __sparquet_infrom
+//     __sparquet_encode
+//     __sparquet_threads
+//     __sparquet_mmap
+//     __sparquet_cache
+//     __sparquet_compress
+//     __sparquet_strsampled
 
 ST_retcode sf_ll_coltypes_multi(
     const char *flist,
+    const char *fcache,
     const uint64_t strbuffer,
     const int debug)
 {
     ST_retcode rc = 0, any_rc = 0;
-    bool is_null;
-    clock_t timer = clock();
-    int64_t vtype, strlen, nrow_groups;
-    int64_t strscan = 0, ncol = 1, infrom = 0, into = 0, nfiles = 0;
-    int64_t r, *i, j, jsel;
+    sf_clock timer = sf_clock_now();
+    int64_t vtype, quota, ix, t, nscan = 0, ndict = 0, sampled = 0;
+    int64_t strscan = 0, ncol = 1, infrom = 0, into = 0, nfiles = 0, encode = 0, usemmap = 0, nthreads = 1;
+    int64_t cache = 0, nhit = 0, nwrite = 0, compress = 0;
+    int64_t f, j, jsel;
+    sf_convert convert;
+    std::vector<std::string> fnames, cpaths;
+    std::vector<std::shared_ptr<parquet::FileMetaData>> fmetadata;
+    std::vector<sf_strscan_task> tasks;
+    std::vector<sf_cache_entry> entries;
+    std::vector<bool> usecache;
+    std::string errmsg;
 
     if ( (rc = sf_scalar_int("__sparquet_strscan", 18, &strscan)) ) any_rc = rc;
     if ( (rc = sf_scalar_int("__sparquet_ncol",    15, &ncol))    ) any_rc = rc;
     if ( (rc = sf_scalar_int("__sparquet_infrom",  17, &infrom))  ) any_rc = rc;
     if ( (rc = sf_scalar_int("__sparquet_into",    15, &into))    ) any_rc = rc;
-    --infrom; --into;
+    if ( (rc = sf_scalar_int("__sparquet_encode",  17, &encode))  ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_mmap",    15, &usemmap)) ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_threads", 18, &nthreads)) ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_cache",   16, &cache))   ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_compress", 19, &compress)) ) any_rc = rc;
+    --infrom;
 
     int64_t vtypes[ncol];
+    int64_t enc[ncol];
     int64_t rtypes[ncol];
+    int64_t fmts[ncol];
     int64_t colix[ncol];
-    int64_t obs[ncol];
+    int64_t strlen[ncol];
+    bool scan[ncol];
+    bool full[ncol];
     if ( (rc = sf_matrix_int("__sparquet_colix", 16, ncol, colix)) ) any_rc = rc;
     for (j = 0; j < ncol; j++)
         --colix[j];
 
-    for (j = 0; j < ncol; j++)
-        obs[j] = vtypes[j] = rtypes[j] = 0;
+    for (j = 0; j < ncol; j++) {
+        strlen[j] = vtypes[j] = rtypes[j] = fmts[j] = 0;
+        enc[j]  = encode;
+        scan[j] = false;
+        full[j] = true;
+    }
 
     if ( any_rc ) {
         rc = any_rc;
         goto exit;
     }
 
-    strscan += infrom;
-    if ( strscan < into ) into = strscan;
-
     try {
         std::shared_ptr<parquet::FileMetaData> file_metadata;
         std::unique_ptr<parquet::ParquetFileReader> parquet_reader;
-
-        std::shared_ptr<parquet::RowGroupReader> row_group_reader;
-        std::shared_ptr<parquet::ByteArrayScanner> ba_scanner;
-        parquet::ByteArray vbytearray;
+        std::vector<std::unordered_set<std::string>> distinct(ncol);
 
         std::string fname;
         std::ifstream fstream;
@@ -211,14 +236,27 @@ ST_retcode sf_ll_coltypes_multi(
 
         if ( fstream.is_open() ) {
             while ( std::getline(fstream, fname) ) {
-                parquet_reader = parquet::ParquetFileReader::OpenFile(fname, false);
+                parquet_reader = sf_session_file(fname, usemmap);
                 file_metadata  = parquet_reader->metadata();
-                nrow_groups    = file_metadata->num_row_groups();
+                fnames.push_back(fname);
+                fmetadata.push_back(file_metadata);
                 for (j = 0; j < ncol; j++) {
                     jsel = colix[j];
                     const parquet::ColumnDescriptor* descr =
                         file_metadata->schema()->Column(jsel);
 
+                    // Dates, times and decimals are read as Stata
+                    // dates, datetimes and doubles in every file
+                    convert = sf_convert_type(descr);
+                    if ( nfiles == 0 ) {
+                        fmts[j] = convert.fmt;
+                    }
+                    else if ( fmts[j] != convert.fmt ) {
+                        sf_errprintf("Inconsistent type for column %ld.\n", j);
+                        rc = 17201;
+                        goto exit;
+                    }
+
                     switch (descr->physical_type()) {
                         case Type::BOOLEAN:    // byte
                             rtypes[j] = 1;
@@ -234,9 +272,9 @@ ST_retcode sf_ll_coltypes_multi(
                         case Type::INT32:      // long
                             rtypes[j] = 2;
                             if ( nfiles == 0 ) {
-                                vtypes[j] = -3;
+                                vtypes[j] = sf_convert_vtype(convert, -3);
                             }
-                            else if ( vtypes[j] != -3 ) {
+                            else if ( vtypes[j] != sf_convert_vtype(convert, -3) ) {
                                 sf_errprintf("Inconsistent type for column %ld.\n", j);
                                 rc = 17201;
                                 goto exit;
@@ -244,6 +282,17 @@ ST_retcode sf_ll_coltypes_multi(
                             break;
                         case Type::INT64:      // double
                             rtypes[j] = 3;
+                            if ( nfiles == 0 ) {
+                                vtypes[j] = sf_convert_vtype(convert, -5);
+                            }
+                            else if ( vtypes[j] != sf_convert_vtype(convert, -5) ) {
+                                sf_errprintf("Inconsistent type for column %ld.\n", j);
+                                rc = 17201;
+                                goto exit;
+                            }
+                            break;
+                        case Type::INT96:      // double (%tc)
+                            rtypes[j] = 4;
                             if ( nfiles == 0 ) {
                                 vtypes[j] = -5;
                             }
@@ -253,11 +302,6 @@ ST_retcode sf_ll_coltypes_multi(
                                 goto exit;
                             }
                             break;
-                        case Type::INT96:
-                            rtypes[j] = 4;
-                            sf_errprintf("96-bit integers not implemented.\n");
-                            rc = 17101;
-                            goto exit;
                         case Type::FLOAT:      // float
                             rtypes[j] = 5;
                             if ( nfiles == 0 ) {
@@ -280,29 +324,23 @@ ST_retcode sf_ll_coltypes_multi(
                                 goto exit;
                             }
                             break;
-                        case Type::BYTE_ARRAY: // str#, strL
+                        case Type::BYTE_ARRAY: // str#, strL; long with encode; double if decimal
                             rtypes[j] = 7;
-                            // vtypes[j] = SV_missval;
-                            // Scan longest string length
-                            if ( strscan > infrom ) {
-                                i = obs + j;
-                                strlen = 0;
-                                for (r = 0; r < nrow_groups; ++r) {
-                                    row_group_reader = parquet_reader->RowGroup(r);
-                                    ba_scanner = std::make_shared<parquet::ByteArrayScanner>(row_group_reader->Column(jsel));
-                                    while ( ba_scanner->HasNext() && (*i)++ < infrom ) {
-                                        ba_scanner->NextValue(&vbytearray, &is_null);
-                                    }
-                                    (*i)--;
-                                    while ( ba_scanner->HasNext() && (*i)++ <= into ) {
-                                        ba_scanner->NextValue(&vbytearray, &is_null);
-                                        if (vbytearray.len > strlen) strlen = vbytearray.len;
-                                    }
-                                    if ( (*i) >= into ) break;
-                                }
-                                // vtype = strlen > 0? strlen: ((*i) >= into? 1: strbuffer);
-                                vtype = strlen > 0? strlen: 1;
-                                if ( vtype > vtypes[j] ) vtypes[j] = vtype;
+                            if ( convert.fmt == SPARQUET_FMT_DECIMAL ) {
+                                enc[j] = false;
+                                vtypes[j] = -5;
+                                break;
+                            }
+                            enc[j] = enc[j] && sf_ll_dictionary(file_metadata, jsel, 0, NULL);
+                            if ( enc[j] && !sf_ll_dictionary_fits(parquet_reader.get(), jsel, 0, NULL, distinct[j]) ) {
+                                sf_printf("(note: %s has over %d distinct values; read as a string)\n",
+                                          descr->name().c_str(), SPARQUET_LABELMAX);
+                                distinct[j].clear();
+                                enc[j] = false;
+                            }
+                            // Longest string is scanned below, with all files
+                            if ( strscan > 0 ) {
+                                scan[j] = true;
                             }
                             else {
                                 if ( nfiles == 0 ) {
@@ -315,12 +353,12 @@ ST_retcode sf_ll_coltypes_multi(
                                 }
                             }
                             break;
-                        case Type::FIXED_LEN_BYTE_ARRAY: // str#, strL
+                        case Type::FIXED_LEN_BYTE_ARRAY: // str#, strL; double if decimal
                             rtypes[j] = 8;
                             if ( nfiles == 0 ) {
-                                vtypes[j] = descr->type_length();
+                                vtypes[j] = sf_convert_vtype(convert, descr->type_length());
                             }
-                            else if ( vtypes[j] != descr->type_length() ) {
+                            else if ( vtypes[j] != sf_convert_vtype(convert, descr->type_length()) ) {
                                 sf_errprintf("Inconsistent type for column %ld.\n", j);
                                 rc = 17201;
                                 goto exit;
@@ -337,17 +375,115 @@ ST_retcode sf_ll_coltypes_multi(
             fstream.close();
         }
 
-        SPARQUET_CHAR(vmatrix, 32);
-        memcpy(vmatrix, "__sparquet_coltypes", 19);
+        // Integer columns take the widest type any file needs
+        if ( compress ) {
+            for (j = 0; j < ncol; j++) {
+                if ( rtypes[j] != 2 && rtypes[j] != 3 ) continue;
+                vtype = -1;
+                for (f = 0; f < nfiles; f++) {
+                    vtype = std::min(vtype, sf_compress_type(fmetadata[f], colix[j], 0, NULL, vtypes[j]));
+                }
+                sf_printf_debug(debug && vtype != vtypes[j], "\tColumn %ld compress: type %ld -> %ld\n", j, vtypes[j], vtype);
+                vtypes[j] = vtype;
+            }
+        }
+
+        // Scan longest string lengths
+        // ---------------------------
+
+        // Rows are counted across files, in order, so in() and the
+        // sample refer to the stacked data.
+
+        // Encoded columns are read as codes and need no width
         for (j = 0; j < ncol; j++) {
-            if ( (rc = SF_mat_store(vmatrix, 1, j + 1, vtypes[j])) ) goto exit;
+            if ( rtypes[j] == 7 && enc[j] ) scan[j] = false;
+        }
+        for (j = 0; j < ncol; j++) {
+            if ( scan[j] ) break;
+        }
+
+        // With the cache, each file has its own entry; widths missing
+        // from it are scanned over the whole file and the per-file
+        // widths are combined below like any other task.
+
+        if ( j < ncol && cache ) {
+            entries.resize(nfiles);
+            cpaths.resize(nfiles);
+            usecache.resize(nfiles);
+            for (t = 0; t < nfiles; t++) {
+                usecache[t] = sf_cache_key(fnames[t], &entries[t]);
+                if ( usecache[t] ) {
+                    cpaths[t] = sf_cache_path(fnames[t], fcache);
+                    nhit += sf_cache_lookup(&entries[t], cpaths[t], fmetadata[t], t, colix, scan, strlen, ncol, tasks);
+                }
+                else {
+                    ix = 0;
+                    sf_strscan_tasks_add(tasks, fmetadata[t], t, colix, scan, ncol,
+                                         0, NULL, 0, fmetadata[t]->num_rows(), 0, &ix);
+                }
+            }
+        }
+        else if ( j < ncol ) {
+            ix = quota = 0;
+            for (t = 0; t < nfiles; t++)
+                quota += sf_strscan_ngroups(fmetadata[t], 0, NULL, infrom, into, &ix);
+            quota = sf_strscan_quota(strscan, into - infrom, quota);
+            ix = 0;
+            for (t = 0; t < nfiles; t++) {
+                sf_strscan_tasks_add(tasks, fmetadata[t], t, colix, scan, ncol,
+                                     0, NULL, infrom, into, quota, &ix);
+            }
+        }
+
+        if ( j < ncol ) {
+            if ( sf_strscan_run(fnames, usemmap, tasks, nthreads, errmsg) ) {
+                sf_errprintf("Parquet read error: %s\n", errmsg.c_str());
+                return(-1);
+            }
+            for (t = 0; t < (int64_t) usecache.size(); t++) {
+                if ( usecache[t] && !sf_cache_store(&entries[t], cpaths[t], fmetadata[t], t, tasks) ) {
+                    nwrite++;
+                }
+            }
+            if ( cache ) {
+                sf_printf_debug(debug, "\tType cache: %ld (file, column) widths found\n", nhit);
+            }
+            if ( nwrite > 0 ) {
+                sf_printf("(note: unable to write type cache for %ld files)\n", nwrite);
+            }
+
+            for (t = 0; t < (int64_t) tasks.size(); t++) {
+                j = tasks[t].j;
+                if ( tasks[t].strlen > strlen[j] ) strlen[j] = tasks[t].strlen;
+                full[j] = full[j] && tasks[t].full;
+                nscan  += tasks[t].nscan;
+                ndict  += tasks[t].dict;
+            }
+
+            for (j = 0; j < ncol; j++) {
+                if ( !scan[j] ) continue;
+                vtype = strlen[j] > 0? strlen[j]: (full[j]? 1: strbuffer);
+                vtypes[j] = vtype;
+                sampled = sampled || !full[j];
+            }
+
+            sf_printf_debug(debug, "\tScanned %ld column chunks in %ld files (%ld from the dictionary), %ld values\n",
+                            (int64_t) tasks.size(), nfiles, ndict, nscan);
         }
 
-        memcpy(vmatrix, "__sparquet_rawtypes", 19);
+        // Encoded only if dictionary-encoded in every file
         for (j = 0; j < ncol; j++) {
-            if ( (rc = SF_mat_store(vmatrix, 1, j + 1, rtypes[j])) ) goto exit;
+            if ( rtypes[j] == 7 && enc[j] ) vtypes[j] = -3;
         }
 
+        if ( (rc = sf_matrix_save("__sparquet_coltypes", 19, ncol, vtypes)) ) goto exit;
+        if ( (rc = sf_matrix_save("__sparquet_rawtypes", 19, ncol, rtypes)) ) goto exit;
+        if ( (rc = sf_matrix_save("__sparquet_colfmts",  18, ncol, fmts))   ) goto exit;
+
+        SPARQUET_CHAR(vmatrix, 32);
+        memcpy(vmatrix, "__sparquet_strsampled", 21);
+        if ( (rc = SF_scal_save(vmatrix, (ST_double) sampled)) ) goto exit;
+
     } catch (const std::exception& e) {
         sf_errprintf("Parquet read error: %s\n", e.what());
         return(-1);
@@ -0,0 +1,265 @@
+// String width inference
+// ----------------------
+//
+// The longest string in each BYTE_ARRAY column is found without
+// materializing any value: plain chunks are read with ReadBatch, which
+// only hands back pointers into the page, and only the lengths are
+// looked at. Dictionary chunks are answered from the dictionary page
+// alone, as long as the column chunk metadata lists no PLAIN encoding:
+// a writer can fall back to plain data pages once the dictionary gets
+// too large, and those chunks are scanned like plain ones. Writers that
+// list PLAIN for the dictionary page itself (parquet-cpp does) cannot
+// be told apart from that, so their chunks are scanned too.
+//
+// Each (file, column, row group) chunk is a task, and tasks run on a
+// pool of threads with their own file readers. Workers never call into
+// Stata; the caller combines the widths on the main thread.
+//
+// With strscan(#) smaller than the rows being read, the # rows are
+// spread over the row groups instead of being the first # rows. Columns
+// where some rows were not looked at are flagged so the caller can fall
+// back to a full scan if a longer string shows up while reading.
+
+struct sf_strscan_task {
+    int64_t f;        // file
+    int64_t r;        // row group
+    int64_t j;        // column (position in the selection)
+    int64_t jsel;     // column (position in the file)
+    int64_t skip;     // rows of the group to skip
+    int64_t nrows;    // rows of the group to scan
+    int64_t full;     // whether nrows is all the rows in the window
+    int64_t strlen;   // longest string
+    int64_t nscan;    // rows scanned
+    int64_t dict;     // answered from the dictionary page
+};
+
+// Longest entry of a PLAIN-encoded dictionary page (4-byte length
+// followed by the bytes of each value).
+
+int64_t sf_strscan_plain(const uint8_t *data, int64_t size, int64_t nvalues)
+{
+    int64_t k, pos = 0, strlen = 0;
+    uint32_t vlen;
+    for (k = 0; k < nvalues && pos + 4 <= size; k++) {
+        memcpy(&vlen, data + pos, 4);
+        if ( (int64_t) vlen > strlen ) strlen = vlen;
+        pos += 4 + vlen;
+    }
+    return (strlen);
+}
+
+// Whether every data page of a chunk is dictionary-encoded, going by
+// the encodings in the column chunk metadata (no page is read)
+
+bool sf_strscan_dictonly(const parquet::ColumnChunkMetaData *cc_metadata)
+{
+    size_t k;
+    bool has_dict = false;
+    const std::vector<parquet::Encoding::type> &encodings = cc_metadata->encodings();
+    for (k = 0; k < encodings.size(); k++) {
+        if ( encodings[k] == parquet::Encoding::PLAIN ) return (false);
+        if ( encodings[k] == parquet::Encoding::PLAIN_DICTIONARY
+                || encodings[k] == parquet::Encoding::RLE_DICTIONARY ) has_dict = true;
+    }
+    return (has_dict && cc_metadata->has_dictionary_page());
+}
+
+// Longest string in a dictionary-encoded chunk; only the first page,
+// the dictionary, is read. False if that page is not a dictionary.
+
+bool sf_strscan_dictionary(
+    std::shared_ptr<parquet::RowGroupReader> row_group_reader,
+    int64_t jsel,
+    int64_t *strlen)
+{
+    std::shared_ptr<parquet::Page> page;
+    std::unique_ptr<parquet::PageReader> page_reader =
+        row_group_reader->GetColumnPageReader(jsel);
+
+    *strlen = 0;
+    page = page_reader->NextPage();
+    if ( page == nullptr || page->type() != parquet::PageType::DICTIONARY_PAGE ) {
+        return (false);
+    }
+    const parquet::DictionaryPage *dict_page =
+        static_cast<const parquet::DictionaryPage*>(page.get());
+    *strlen = sf_strscan_plain(dict_page->data(), dict_page->size(), dict_page->num_values());
+    return (true);
+}
+
+// Longest string in rows [skip, skip + nrows) of a chunk; values are
+// not copied, only their lengths are read.
+
+void sf_strscan_chunk(
+    std::shared_ptr<parquet::RowGroupReader> row_group_reader,
+    sf_strscan_task *task,
+    std::vector<parquet::ByteArray> &values,
+    std::vector<int16_t> &deflevels)
+{
+    int64_t k, nlevels, nvalues, nleft, strlen;
+    std::shared_ptr<parquet::ColumnReader> column_reader;
+    parquet::ByteArrayReader *ba_reader;
+
+    task->dict = 0;
+    task->nscan = 0;
+    if ( sf_strscan_dictonly(row_group_reader->metadata()->ColumnChunk(task->jsel).get()) ) {
+        if ( sf_strscan_dictionary(row_group_reader, task->jsel, &strlen) ) {
+            task->strlen = strlen;
+            task->nscan  = task->nrows;
+            task->full   = 1;
+            task->dict   = 1;
+            return;
+        }
+    }
+
+    column_reader = row_group_reader->Column(task->jsel);
+    ba_reader = static_cast<parquet::ByteArrayReader*>(column_reader.get());
+    if ( task->skip > 0 ) ba_reader->Skip(task->skip);
+
+    strlen = 0;
+    nleft  = task->nrows;
+    while ( nleft > 0 && ba_reader->HasNext() ) {
+        nlevels = ba_reader->ReadBatch(
+            std::min(nleft, (int64_t) values.size()),
+            deflevels.data(),
+            nullptr,
+            values.data(),
+            &nvalues
+        );
+        if ( nlevels <= 0 ) break;
+        for (k = 0; k < nvalues; k++) {
+            if ( (int64_t) values[k].len > strlen ) strlen = values[k].len;
+        }
+        nleft -= nlevels;
+        task->nscan += nlevels;
+    }
+    task->strlen = strlen;
+}
+
+// Run the tasks on up to nthreads threads; on error errmsg is set and
+// the return code is -1, to be reported by the caller.
+
+ST_retcode sf_strscan_run(
+    const std::vector<std::string> &fnames,
+    int64_t usemmap,
+    std::vector<sf_strscan_task> &tasks,
+    int64_t nthreads,
+    std::string &errmsg)
+{
+    int64_t t, next = 0, ntasks = tasks.size();
+    bool failed = false;
+    std::mutex mtx;
+    std::vector<std::thread> workers;
+
+    auto worker = [&]() {
+        int64_t k, f = -1;
+        std::unique_ptr<parquet::ParquetFileReader> parquet_reader;
+        std::vector<parquet::ByteArray> values(SPARQUET_BATCH);
+        std::vector<int16_t> deflevels(SPARQUET_BATCH);
+        try {
+            while ( true ) {
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    if ( failed || next >= ntasks ) return;
+                    k = next++;
+                }
+                if ( tasks[k].f != f ) {
+                    f = tasks[k].f;
+                    parquet_reader = sf_session_file(fnames[f], usemmap);
+                }
+                sf_strscan_chunk(parquet_reader->RowGroup(tasks[k].r), &tasks[k], values, deflevels);
+            }
+        } catch (const std::exception& e) {
+            std::lock_guard<std::mutex> lock(mtx);
+            if ( !failed ) errmsg = e.what();
+            failed = true;
+        }
+    };
+
+    if ( nthreads > ntasks ) nthreads = ntasks;
+    if ( nthreads <= 1 ) {
+        worker();
+    }
+    else {
+        for (t = 0; t < nthreads; t++)
+            workers.emplace_back(worker);
+        for (t = 0; t < nthreads; t++)
+            workers[t].join();
+    }
+
+    return (failed? -1: 0);
+}
+
+// Queue the BYTE_ARRAY columns of one file. Rows are counted from
+// *ix over the row groups being read (all of them, or rowgix) and
+// rows [infrom, into) are scanned; with strscan smaller than that,
+// each group scans an equal share of strscan rows from its start.
+
+void sf_strscan_tasks_add(
+    std::vector<sf_strscan_task> &tasks,
+    std::shared_ptr<parquet::FileMetaData> file_metadata,
+    int64_t f,
+    const int64_t *colix,
+    const bool *scan,
+    int64_t ncol,
+    int64_t readrg,
+    const int64_t *rowgix,
+    int64_t infrom,
+    int64_t into,
+    int64_t quota,
+    int64_t *ix)
+{
+    int64_t r, ig, j, rgrows, from, to;
+    sf_strscan_task task;
+
+    task.f = f;
+    task.strlen = task.nscan = task.dict = 0;
+    for (r = 0; r < (readrg? readrg: file_metadata->num_row_groups()); r++) {
+        ig = readrg? rowgix[r]: r;
+        rgrows = file_metadata->RowGroup(ig)->num_rows();
+        from = std::max(infrom - *ix, (int64_t) 0);
+        to   = std::min(into - *ix, rgrows);
+        *ix += rgrows;
+        if ( from >= to ) continue;
+
+        task.r     = ig;
+        task.skip  = from;
+        task.nrows = quota > 0? std::min(to - from, quota): to - from;
+        task.full  = task.nrows == to - from;
+        for (j = 0; j < ncol; j++) {
+            if ( !scan[j] ) continue;
+            task.j    = j;
+            task.jsel = colix[j];
+            tasks.push_back(task);
+        }
+    }
+}
+
+// Number of row groups with rows in [infrom, into); rows are counted
+// from *ix as in sf_strscan_tasks_add.
+
+int64_t sf_strscan_ngroups(
+    std::shared_ptr<parquet::FileMetaData> file_metadata,
+    int64_t readrg,
+    const int64_t *rowgix,
+    int64_t infrom,
+    int64_t into,
+    int64_t *ix)
+{
+    int64_t r, rgrows, ngroups = 0;
+    for (r = 0; r < (readrg? readrg: file_metadata->num_row_groups()); r++) {
+        rgrows = file_metadata->RowGroup(readrg? rowgix[r]: r)->num_rows();
+        if ( *ix + rgrows > infrom && *ix < into ) ngroups++;
+        *ix += rgrows;
+    }
+    return (ngroups);
+}
+
+// Rows per row group in a sample of strscan rows; 0 (every row) if
+// strscan covers the nobs rows being read.
+
+int64_t sf_strscan_quota(int64_t strscan, int64_t nobs, int64_t ngroups)
+{
+    if ( strscan >= nobs || ngroups == 0 ) return (0);
+    return ((strscan + ngroups - 1) / ngroups);
+}
@@ -18,11 +18,72 @@ ST_retcode sf_scalar_int(char const *scalar, int64_t vlen, int64_t *s)
     return (rc);
 }
 
+// Vectors with one entry per column (colix, coltypes, rawtypes) can
+// be longer than matsize with wide files, and going through SF_mat_el
+// one element at a time is slow. If the calling program has a local
+// with the name of the matrix minus the leading underscores (e.g.
+// sparquet_colix for __sparquet_colix), the vector is instead passed
+// as a file of mcol doubles at that path, read and written in one go
+// on both sides.
+
+bool sf_vector_path(char const *matrix, std::string &path)
+{
+    std::vector<char> vpath(4096, '\0');
+    SPARQUET_CHAR(vmacro, 32);
+    vmacro[0] = '_';
+    memcpy(vmacro + 1, matrix + 2, strlen(matrix) - 2);
+    if ( SF_macro_use(vmacro, vpath.data(), vpath.size()) ) return (false);
+    path = vpath.data();
+    return (path.size() > 0);
+}
+
+ST_retcode sf_vector_read(std::string const &path, int64_t mcol, int64_t *m)
+{
+    int64_t j;
+    std::vector<ST_double> z(mcol);
+    std::ifstream fstream(path, std::ios::binary);
+
+    fstream.read((char *) z.data(), mcol * sizeof(ST_double));
+    if ( !fstream ) {
+        sf_errprintf("Unable to read %ld values from %s\n", mcol, path.c_str());
+        return (198);
+    }
+
+    for (j = 0; j < mcol; j++) {
+        m[j] = (int64_t) z[j];
+    }
+
+    return (0);
+}
+
+ST_retcode sf_vector_write(std::string const &path, int64_t mcol, const int64_t *m)
+{
+    int64_t j;
+    std::vector<ST_double> z(mcol);
+    std::ofstream fstream(path, std::ios::binary | std::ios::trunc);
+
+    for (j = 0; j < mcol; j++) {
+        z[j] = (ST_double) m[j];
+    }
+
+    fstream.write((const char *) z.data(), mcol * sizeof(ST_double));
+    fstream.close();
+    if ( !fstream ) {
+        sf_errprintf("Unable to write %ld values to %s\n", mcol, path.c_str());
+        return (198);
+    }
+
+    return (0);
+}
+
 ST_retcode sf_matrix_int(char const *matrix, int64_t mlen, int64_t mcol, int64_t *m)
 {
     ST_retcode rc = 0;
     ST_double z;
     int64_t j;
+    std::string path;
+
+    if ( sf_vector_path(matrix, path) ) return (sf_vector_read(path, mcol, m));
 
     SPARQUET_CHAR(vmatrix, 32);
     memcpy(vmatrix, matrix, mlen);
@@ -35,6 +96,33 @@ ST_retcode sf_matrix_int(char const *matrix, int64_t mlen, int64_t mcol, int64_t
     return (rc);
 }
 
+ST_retcode sf_matrix_save(char const *matrix, int64_t mlen, int64_t mcol, const int64_t *m)
+{
+    ST_retcode rc = 0;
+    int64_t j;
+    std::string path;
+
+    if ( sf_vector_path(matrix, path) ) return (sf_vector_write(path, mcol, m));
+
+    SPARQUET_CHAR(vmatrix, 32);
+    memcpy(vmatrix, matrix, mlen);
+
+    for (j = 0; j < mcol; j++) {
+        if ( (rc = SF_mat_store(vmatrix, 1, j + 1, (ST_double) m[j])) ) return (rc);
+    }
+
+    return (rc);
+}
+
+ST_retcode sf_macro_save(char const *macro, const std::string &value)
+{
+    SPARQUET_CHAR(vmacro, 32);
+    std::vector<char> vvalue(value.begin(), value.end());
+    vvalue.push_back('\0');
+    memcpy(vmacro, macro, strlen(macro));
+    return (SF_macro_save(vmacro, vvalue.data()));
+}
+
 // Stata function: Low-level nrow and ncol
 //
 // parameters
@@ -56,7 +144,7 @@ ST_retcode sf_ll_shape(const char *fname, const int debug)
 
     try {
         std::unique_ptr<parquet::ParquetFileReader> parquet_reader =
-            parquet::ParquetFileReader::OpenFile(fname, false);
+            sf_session_file(fname, false);
 
         std::shared_ptr<parquet::FileMetaData> file_metadata =
             parquet_reader->metadata();
@@ -143,35 +231,36 @@ exit:
 // Stata function: Low-level column names
 //
 // fname is the parquet file name
-// fcols is the temporary text file where to write column names
+//
+// locals
+//     sparquet_colnames (names separated by char(31))
 
 ST_retcode sf_ll_colnames(
     const char *fname,
-    const char *fcols,
     const int debug)
 {
     ST_retcode rc = 0;
     int64_t ncol, j;
+    std::string vnames;
 
     try {
         std::unique_ptr<parquet::ParquetFileReader> parquet_reader =
-            parquet::ParquetFileReader::OpenFile(fname, false);
+            sf_session_file(fname, false);
 
         std::shared_ptr<parquet::FileMetaData> file_metadata =
             parquet_reader->metadata();
 
         ncol = file_metadata->num_columns();
 
-        // Write column names to file; one per line
-        std::ofstream fstream;
-        fstream.open(fcols);
+        // Column names go straight into a local macro
         for (j = 0; j < ncol; j++) {
             const parquet::ColumnDescriptor* descr =
                 file_metadata->schema()->Column(j);
-            fstream << descr->name() << "\n";
+            if ( j ) vnames += SPARQUET_COLSEP;
+            vnames += descr->name();
             sf_printf_debug(debug, "\tColumn %ld: %s\n", j, descr->name().c_str());
         }
-        fstream.close();
+        rc = sf_macro_save("_sparquet_colnames", vnames);
 
     } catch (const std::exception& e) {
         sf_errprintf("Parquet read error: %s\n", e.what());
@@ -181,14 +270,175 @@ ST_retcode sf_ll_colnames(
     return (rc);
 }
 
+// Whether column jsel is dictionary-encoded in every row group to be
+// read (encode option); rowgix holds the readrg groups, if any.
+
+bool sf_ll_dictionary(
+    std::shared_ptr<parquet::FileMetaData> file_metadata,
+    int64_t jsel,
+    int64_t readrg,
+    const int64_t *rowgix)
+{
+    int64_t r, nrg = readrg? readrg: file_metadata->num_row_groups();
+    for (r = 0; r < nrg; r++) {
+        if ( !file_metadata->RowGroup(readrg? rowgix[r]: r)->ColumnChunk(jsel)->has_dictionary_page() ) {
+            return (false);
+        }
+    }
+    return (nrg > 0);
+}
+
+// Whether the dictionaries of column jsel, over the row groups to be
+// read, add up to at most SPARQUET_LABELMAX distinct strings, the most
+// a value label holds (encode option). distinct carries the count
+// across files; only dictionary pages are read, and the count stops
+// once it is over the limit.
+
+#define SPARQUET_LABELMAX 65536
+
+bool sf_ll_dictionary_fits(
+    parquet::ParquetFileReader *parquet_reader,
+    int64_t jsel,
+    int64_t readrg,
+    const int64_t *rowgix,
+    std::unordered_set<std::string> &distinct)
+{
+    int64_t r, k, pos, nrg = readrg? readrg: parquet_reader->metadata()->num_row_groups();
+    uint32_t vlen;
+    std::shared_ptr<parquet::Page> page;
+    std::unique_ptr<parquet::PageReader> page_reader;
+
+    for (r = 0; r < nrg; r++) {
+        page_reader = parquet_reader->RowGroup(readrg? rowgix[r]: r)->GetColumnPageReader(jsel);
+        page = page_reader->NextPage();
+        if ( page == nullptr || page->type() != parquet::PageType::DICTIONARY_PAGE ) {
+            return (false);
+        }
+        const parquet::DictionaryPage *dict_page =
+            static_cast<const parquet::DictionaryPage*>(page.get());
+        if ( dict_page->num_values() > SPARQUET_LABELMAX ) return (false);
+
+        const uint8_t *data = dict_page->data();
+        for (k = pos = 0; k < dict_page->num_values() && pos + 4 <= dict_page->size(); k++) {
+            memcpy(&vlen, data + pos, 4);
+            distinct.insert(std::string(reinterpret_cast<const char*>(data + pos + 4), vlen));
+            pos += 4 + vlen;
+        }
+        if ( (int64_t) distinct.size() > SPARQUET_LABELMAX ) return (false);
+    }
+    return (true);
+}
+
+// Smallest Stata type that holds every integer in [lo, hi] exactly
+// (compress option). The largest values of each type are missing
+// codes; past the range of long only double is exact.
+
+int64_t sf_compress_range(ST_double lo, ST_double hi)
+{
+    if ( lo >= -127 && hi <= 100 ) return (-1);
+    if ( lo >= -32767 && hi <= 32740 ) return (-2);
+    if ( lo >= -2147483647.0 && hi <= 2147483620.0 ) return (-3);
+    return (-5);
+}
+
+// Widen [lo, hi] to the chunk's min and max; false if they are not
+// known. An all-null chunk has no values to hold.
+
+template <typename DType>
+bool sf_compress_minmax(
+    const std::shared_ptr<parquet::Statistics> &stats,
+    ST_double *lo,
+    ST_double *hi)
+{
+    std::shared_ptr<parquet::TypedStatistics<DType>> typed =
+        std::static_pointer_cast<parquet::TypedStatistics<DType>>(stats);
+
+    if ( stats->HasMinMax() ) {
+        *lo = std::min(*lo, (ST_double) typed->min());
+        *hi = std::max(*hi, (ST_double) typed->max());
+        return (true);
+    }
+    return (stats->num_values() == 0);
+}
+
+// Stata type for integer column jsel from the INT_8/INT_16/UINT_8/
+// UINT_16 annotations and the min/max statistics of the row groups to
+// be read, without reading any data. vtype is kept if neither says
+// anything, or for other columns.
+
+int64_t sf_compress_type(
+    std::shared_ptr<parquet::FileMetaData> file_metadata,
+    int64_t jsel,
+    int64_t readrg,
+    const int64_t *rowgix,
+    int64_t vtype)
+{
+    int64_t r, nrg = readrg? readrg: file_metadata->num_row_groups();
+    bool known = true, usestats = true;
+    ST_double inf = std::numeric_limits<ST_double>::infinity();
+    ST_double lo = -inf, hi = inf, slo = inf, shi = -inf;
+    std::unique_ptr<parquet::ColumnChunkMetaData> cc_metadata;
+    const parquet::ColumnDescriptor *descr = file_metadata->schema()->Column(jsel);
+
+    if ( descr->physical_type() != Type::INT32 && descr->physical_type() != Type::INT64 ) {
+        return (vtype);
+    }
+
+    // Statistics of dates and times are not in Stata units
+    if ( sf_convert_type(descr).fmt != SPARQUET_FMT_NONE ) {
+        return (vtype);
+    }
+
+    // Unsigned chunks are ordered differently from how they are read,
+    // so only the annotation is used for them
+    switch (descr->converted_type()) {
+        case ConvertedType::INT_8:   lo = -128;   hi = 127;   break;
+        case ConvertedType::INT_16:  lo = -32768; hi = 32767; break;
+        case ConvertedType::UINT_8:  lo = 0; hi = 255;   usestats = false; break;
+        case ConvertedType::UINT_16: lo = 0; hi = 65535; usestats = false; break;
+        case ConvertedType::UINT_32:
+        case ConvertedType::UINT_64:
+        case ConvertedType::DECIMAL:
+            return (vtype);
+        default:
+            known = false;
+            break;
+    }
+
+    for (r = 0; r < nrg && usestats; r++) {
+        cc_metadata = file_metadata->RowGroup(readrg? rowgix[r]: r)->ColumnChunk(jsel);
+        if ( !cc_metadata->is_stats_set() ) {
+            usestats = false;
+        }
+        else if ( descr->physical_type() == Type::INT32 ) {
+            usestats = sf_compress_minmax<parquet::Int32Type>(cc_metadata->statistics(), &slo, &shi);
+        }
+        else {
+            usestats = sf_compress_minmax<parquet::Int64Type>(cc_metadata->statistics(), &slo, &shi);
+        }
+    }
+
+    if ( usestats ) {
+        lo = std::max(lo, slo);
+        hi = std::min(hi, shi);
+    }
+    else if ( !known ) {
+        return (vtype);
+    }
+
+    return (sf_compress_range(lo, hi));
+}
+
 // Stata function: Low-level column types
 //
 // fname is the parquet file name
+// fcache is the type cache directory (empty for a file next to fname)
 // strbuffer is the string length fallback
 //
 // matrices
 //     __sparquet_coltypes
 //     __sparquet_rawtypes
+//     __sparquet_colfmts
 //     __sparquet_colix
 //     __sparquet_rowgix
 // scalars
@@ -197,18 +447,29 @@ ST_retcode sf_ll_colnames(
 //     __sparquet_into
 //     __sparquet_infrom
 //     __sparquet_readrg
+//     __sparquet_encode
+//     __sparquet_threads
+//     __sparquet_mmap
+//     __sparquet_cache
+//     __sparquet_compress
+//     __sparquet_strsampled
 
 ST_retcode sf_ll_coltypes(
     const char *fname,
+    const char *fcache,
     const uint64_t strbuffer,
     const int debug)
 {
     ST_retcode rc = 0, any_rc = 0;
-    bool is_null;
-    clock_t timer = clock();
-    int64_t strlen, nrow_groups, readrg, _readrg;
-    int64_t strscan = 0, ncol = 1, infrom = 0, into = 0;
-    int64_t rg, r, i, j, jsel;
+    sf_clock timer = sf_clock_now();
+    int64_t nrow_groups, readrg, _readrg, quota, ix, t, nscan = 0, ndict = 0, sampled = 0;
+    int64_t strscan = 0, ncol = 1, infrom = 0, into = 0, encode = 0, usemmap = 0, nthreads = 1;
+    int64_t cache = 0, usecache = 0, nhit = 0, compress = 0, vtype;
+    int64_t r, j, jsel;
+    sf_convert convert;
+    std::vector<sf_strscan_task> tasks;
+    std::string errmsg, cpath;
+    sf_cache_entry entry;
 
     // First get all the shape scalars
     // -------------------------------
@@ -218,15 +479,24 @@ ST_retcode sf_ll_coltypes(
     if ( (rc = sf_scalar_int("__sparquet_infrom",  17, &infrom))  ) any_rc = rc;
     if ( (rc = sf_scalar_int("__sparquet_into",    15, &into))    ) any_rc = rc;
     if ( (rc = sf_scalar_int("__sparquet_readrg",  17, &readrg))  ) any_rc = rc;
-    --infrom; --into; _readrg = readrg? readrg: 1;
+    if ( (rc = sf_scalar_int("__sparquet_encode",  17, &encode))  ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_mmap",    15, &usemmap)) ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_threads", 18, &nthreads)) ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_cache",   16, &cache))   ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_compress", 19, &compress)) ) any_rc = rc;
+    --infrom; _readrg = readrg? readrg: 1;
 
     // Parse column and row group indexes
     // ----------------------------------
 
     int64_t vtypes[ncol];
     int64_t rtypes[ncol];
+    int64_t fmts[ncol];
     int64_t colix[ncol];
     int64_t rowgix[_readrg];
+    int64_t strlen[ncol];
+    bool scan[ncol];
+    bool full[ncol];
 
     if ( (rc = sf_matrix_int("__sparquet_rowgix", 17, _readrg, rowgix)) ) any_rc = rc;
     for (r = 0; r < _readrg; r++)
@@ -244,20 +514,13 @@ ST_retcode sf_ll_coltypes(
     // Scan file!
     // ----------
 
-    strscan += infrom;
-    if ( strscan < into ) into = strscan;
-
     try {
         std::unique_ptr<parquet::ParquetFileReader> parquet_reader =
-            parquet::ParquetFileReader::OpenFile(fname, false);
+            sf_session_file(fname, usemmap);
 
         std::shared_ptr<parquet::FileMetaData> file_metadata =
             parquet_reader->metadata();
 
-        std::shared_ptr<parquet::RowGroupReader> row_group_reader;
-        std::shared_ptr<parquet::ByteArrayScanner> ba_scanner;
-        parquet::ByteArray vbytearray;
-
         nrow_groups = file_metadata->num_row_groups();
 
         // Check row groups make sense
@@ -278,12 +541,18 @@ ST_retcode sf_ll_coltypes(
         // --------------------
 
         for (j = 0; j < ncol; j++) {
-            rg = 0;
+            scan[j] = false;
             jsel = colix[j];
             const parquet::ColumnDescriptor* descr =
                 file_metadata->schema()->Column(jsel);
 
             sf_printf_debug(debug, "\tColumn %ld: %s\n", jsel, descr->name().c_str());
+
+            // Dates, times and decimals are read as Stata dates,
+            // datetimes and doubles
+            convert = sf_convert_type(descr);
+            fmts[j] = convert.fmt;
+
             switch (descr->physical_type()) {
                 case Type::BOOLEAN:    // byte
                     rtypes[j] = 1;
@@ -297,11 +566,10 @@ ST_retcode sf_ll_coltypes(
                     rtypes[j] = 3;
                     vtypes[j] = -5;
                     break;
-                case Type::INT96:
+                case Type::INT96:      // double (%tc)
                     rtypes[j] = 4;
-                    sf_errprintf("96-bit integers not implemented.\n");
-                    rc = 17101;
-                    goto exit;
+                    vtypes[j] = -5;
+                    break;
                 case Type::FLOAT:      // float
                     rtypes[j] = 5;
                     vtypes[j] = -4;
@@ -310,41 +578,26 @@ ST_retcode sf_ll_coltypes(
                     rtypes[j] = 6;
                     vtypes[j] = -5;
                     break;
-                case Type::BYTE_ARRAY: // str#, strL
+                case Type::BYTE_ARRAY: // str#, strL; long with encode; double if decimal
                     rtypes[j] = 7;
-                    // vtypes[j] = SV_missval;
-                    // Scan longest string length
-                    if ( strscan > infrom ) {
-                        i = 0;
-                        strlen = 0;
-                        for (r = 0; r < nrow_groups; ++r) {
-                            if ( readrg ) {
-                                if ( r == rowgix[rg] ) {
-                                    rg++;
-                                }
-                                else {
-                                    continue;
-                                }
-                            }
-                            row_group_reader = parquet_reader->RowGroup(r);
-                            ba_scanner = std::make_shared<parquet::ByteArrayScanner>(row_group_reader->Column(jsel));
-                            while ( ba_scanner->HasNext() && i++ < infrom ) {
-                                ba_scanner->NextValue(&vbytearray, &is_null);
-                            }
-                            i--;
-                            while ( ba_scanner->HasNext() && i++ <= into ) {
-                                ba_scanner->NextValue(&vbytearray, &is_null);
-                                if (vbytearray.len > strlen) strlen = vbytearray.len;
-                            }
-                            if ( i >= into ) break;
-                        }
-                        vtypes[j] = strlen > 0? strlen: (i >= into? 1: strbuffer);
+                    if ( convert.fmt == SPARQUET_FMT_DECIMAL ) {
+                        vtypes[j] = -5;
+                        break;
                     }
-                    else {
-                        vtypes[j] = strbuffer;
+                    if ( encode && sf_ll_dictionary(file_metadata, jsel, readrg, rowgix) ) {
+                        std::unordered_set<std::string> distinct;
+                        if ( sf_ll_dictionary_fits(parquet_reader.get(), jsel, readrg, rowgix, distinct) ) {
+                            vtypes[j] = -3;
+                            break;
+                        }
+                        sf_printf("(note: %s has over %d distinct values; read as a string)\n",
+                                  descr->name().c_str(), SPARQUET_LABELMAX);
                     }
+                    // Longest string is scanned below, with all columns
+                    scan[j] = strscan > 0;
+                    vtypes[j] = strbuffer;
                     break;
-                case Type::FIXED_LEN_BYTE_ARRAY: // str#, strL
+                case Type::FIXED_LEN_BYTE_ARRAY: // str#, strL; double if decimal
                     rtypes[j] = 8;
                     vtypes[j] = descr->type_length();
                     break;
@@ -353,19 +606,83 @@ ST_retcode sf_ll_coltypes(
                     rc = 17100;
                     goto exit;
             }
+            vtypes[j] = sf_convert_vtype(convert, vtypes[j]);
+
+            if ( compress ) {
+                vtype = sf_compress_type(file_metadata, jsel, readrg, rowgix, vtypes[j]);
+                sf_printf_debug(debug && vtype != vtypes[j], "\t\tcompress: type %ld -> %ld\n", vtypes[j], vtype);
+                vtypes[j] = vtype;
+            }
         }
 
-        SPARQUET_CHAR(vmatrix, 32);
-        memcpy(vmatrix, "__sparquet_coltypes", 19);
+        // Scan longest string lengths
+        // ---------------------------
+
         for (j = 0; j < ncol; j++) {
-            if ( (rc = SF_mat_store(vmatrix, 1, j + 1, vtypes[j])) ) goto exit;
+            if ( scan[j] ) break;
         }
 
-        memcpy(vmatrix, "__sparquet_rawtypes", 19);
-        for (j = 0; j < ncol; j++) {
-            if ( (rc = SF_mat_store(vmatrix, 1, j + 1, rtypes[j])) ) goto exit;
+        if ( j < ncol ) {
+            for (j = 0; j < ncol; j++) {
+                strlen[j] = 0;
+                full[j] = true;
+            }
+
+            // With the cache, widths are looked up and any column not
+            // in it is scanned in full so the entry holds for any read.
+            usecache = cache && sf_cache_key(fname, &entry);
+            if ( usecache ) {
+                cpath = sf_cache_path(fname, fcache);
+                nhit  = sf_cache_lookup(&entry, cpath, file_metadata, 0, colix, scan, strlen, ncol, tasks);
+            }
+            else {
+                ix = 0;
+                quota = sf_strscan_ngroups(file_metadata, readrg, rowgix, infrom, into, &ix);
+                quota = sf_strscan_quota(strscan, into - infrom, quota);
+                ix = 0;
+                sf_strscan_tasks_add(tasks, file_metadata, 0, colix, scan, ncol,
+                                     readrg, rowgix, infrom, into, quota, &ix);
+            }
+            if ( sf_strscan_run(std::vector<std::string>(1, fname), usemmap, tasks, nthreads, errmsg) ) {
+                sf_errprintf("Parquet read error: %s\n", errmsg.c_str());
+                return(-1);
+            }
+            if ( usecache ) {
+                sf_printf_debug(debug, "\tType cache: %ld of %ld string columns from %s\n",
+                                nhit, (int64_t) std::count(scan, scan + ncol, true), cpath.c_str());
+                if ( !sf_cache_store(&entry, cpath, file_metadata, 0, tasks) ) {
+                    sf_printf("(note: unable to write type cache %s)\n", cpath.c_str());
+                }
+            }
+
+            for (t = 0; t < (int64_t) tasks.size(); t++) {
+                j = tasks[t].j;
+                if ( tasks[t].strlen > strlen[j] ) strlen[j] = tasks[t].strlen;
+                full[j] = full[j] && tasks[t].full;
+                nscan  += tasks[t].nscan;
+                ndict  += tasks[t].dict;
+            }
+
+            // If some rows were not scanned, a column with no strings
+            // seen falls back to strbuffer
+            for (j = 0; j < ncol; j++) {
+                if ( !scan[j] ) continue;
+                vtypes[j] = strlen[j] > 0? strlen[j]: (full[j]? 1: strbuffer);
+                sampled = sampled || !full[j];
+            }
+
+            sf_printf_debug(debug, "\tScanned %ld column chunks (%ld from the dictionary), %ld values\n",
+                            (int64_t) tasks.size(), ndict, nscan);
         }
 
+        if ( (rc = sf_matrix_save("__sparquet_coltypes", 19, ncol, vtypes)) ) goto exit;
+        if ( (rc = sf_matrix_save("__sparquet_rawtypes", 19, ncol, rtypes)) ) goto exit;
+        if ( (rc = sf_matrix_save("__sparquet_colfmts",  18, ncol, fmts))   ) goto exit;
+
+        SPARQUET_CHAR(vmatrix, 32);
+        memcpy(vmatrix, "__sparquet_strsampled", 21);
+        if ( (rc = SF_scal_save(vmatrix, (ST_double) sampled)) ) goto exit;
+
     } catch (const std::exception& e) {
         sf_errprintf("Parquet read error: %s\n", e.what());
         return(-1);
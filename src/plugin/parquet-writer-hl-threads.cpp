@@ -0,0 +1,286 @@
+// High-level multi-threaded writing
+// ---------------------------------
+//
+// With threads(#) the high-level writer pipelines the write over
+// buffered row groups, where every column has its own writer. The
+// calling thread is the only one that talks to Stata: it copies each
+// column chunk (row group by column) into a staging buffer, ST_double
+// for numbers and NUL-terminated strings back to back for strings.
+// Worker threads turn staged chunks into values and definition levels
+// and hand them to the chunk's column writer, which encodes and
+// compresses its pages in memory, so the columns of a row group are
+// encoded in parallel while the next ones are being copied. Once every
+// column of a row group is done the calling thread starts the next
+// one, which writes the finished column chunks to the file in order.
+//
+// Staging memory is bounded as in the reader: at most 2 * threads
+// column chunks are staged at any one time. The encoded row group is
+// held in memory until it is written, so chunkbytes() bounds it too.
+
+struct sf_hl_stage {
+    parquet::ColumnWriter *column_writer;
+    const std::unordered_map<ST_double, std::string> *text;  // value labels (encode)
+    int64_t vtype;
+    int64_t nrows;
+    std::vector<ST_double> vnum;
+    std::vector<char> vstr;
+};
+
+// Copy rows [from, to) of variable j + 1 into a staging buffer
+
+ST_retcode sf_hl_stage_chunk(
+    const sf_write_rows &rows,
+    int64_t j,
+    int64_t from,
+    int64_t to,
+    sf_hl_stage *stage,
+    int64_t *warn_extended,
+    sf_write_progress *progress)
+{
+    ST_retcode rc = 0;
+    ST_double z;
+    int64_t i;
+    char *vstr;
+
+    stage->nrows = to - from;
+    if ( stage->vtype < 0 ) {
+        stage->vnum.resize(stage->nrows);
+        for (i = from; i < to; i++) {
+            if ( (rc = SF_vdata(j + 1, sf_write_obs(rows, i), &z)) ) return (rc);
+            if ( z > SV_missval ) ++(*warn_extended);
+            stage->vnum[i - from] = z;
+            sf_write_progress_check(progress, j, i);
+        }
+    }
+    else {
+        stage->vstr.resize(stage->nrows * (stage->vtype + 1));
+        vstr = stage->vstr.data();
+        for (i = from; i < to; i++) {
+            if ( (rc = SF_sdata(j + 1, sf_write_obs(rows, i), vstr)) ) return (rc);
+            vstr += strlen(vstr) + 1;
+            sf_write_progress_check(progress, j, i);
+        }
+    }
+
+    return (rc);
+}
+
+// Encode a staged chunk (worker threads); missing values are nulls
+
+template <typename DType>
+void sf_hl_encode_numeric(sf_hl_stage *stage, sf_ll_write_batch *batch)
+{
+    typedef typename DType::c_type T;
+    parquet::TypedColumnWriter<DType> *writer =
+        static_cast<parquet::TypedColumnWriter<DType>*>(stage->column_writer);
+
+    T *values = reinterpret_cast<T*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    int64_t i, k, v, n;
+    ST_double z;
+
+    for (i = 0; i < stage->nrows; i += n) {
+        n = std::min(stage->nrows - i, (int64_t) SPARQUET_BATCH);
+        for (k = v = 0; k < n; k++) {
+            z = stage->vnum[i + k];
+            if ( z < SV_missval ) {
+                deflevels[k] = 1;
+                values[v++]  = (T) z;
+            }
+            else {
+                deflevels[k] = 0;
+            }
+        }
+        writer->WriteBatch(n, deflevels, nullptr, values);
+    }
+}
+
+void sf_hl_encode_string(sf_hl_stage *stage, sf_ll_write_batch *batch)
+{
+    parquet::TypedColumnWriter<parquet::ByteArrayType> *writer =
+        static_cast<parquet::TypedColumnWriter<parquet::ByteArrayType>*>(stage->column_writer);
+
+    parquet::ByteArray *values = reinterpret_cast<parquet::ByteArray*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    const char *vstr = stage->vstr.data();
+    int64_t i, k, n;
+
+    for (i = 0; i < stage->nrows; i += n) {
+        n = std::min(stage->nrows - i, (int64_t) SPARQUET_BATCH);
+        for (k = 0; k < n; k++) {
+            values[k].ptr = reinterpret_cast<const uint8_t*>(vstr);
+            values[k].len = strlen(vstr);
+            deflevels[k]  = 1;
+            vstr += values[k].len + 1;
+        }
+        writer->WriteBatch(n, deflevels, nullptr, values);
+    }
+}
+
+void sf_hl_encode_labeled(sf_hl_stage *stage, sf_ll_write_batch *batch)
+{
+    parquet::TypedColumnWriter<parquet::ByteArrayType> *writer =
+        static_cast<parquet::TypedColumnWriter<parquet::ByteArrayType>*>(stage->column_writer);
+
+    parquet::ByteArray *values = reinterpret_cast<parquet::ByteArray*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    int64_t i, k, v, n, len, slot = batch->strbuffer + 1;
+    const char *ptr;
+
+    for (i = 0; i < stage->nrows; i += n) {
+        n = std::min(stage->nrows - i, (int64_t) SPARQUET_BATCH);
+        for (k = v = 0; k < n; k++) {
+            if ( sf_write_label(*stage->text, stage->vnum[i + k], batch->vstr.data() + k * slot, &ptr, &len) ) {
+                deflevels[k]    = 1;
+                values[v].ptr   = reinterpret_cast<const uint8_t*>(ptr);
+                values[v++].len = len;
+            }
+            else {
+                deflevels[k] = 0;
+            }
+        }
+        writer->WriteBatch(n, deflevels, nullptr, values);
+    }
+}
+
+void sf_hl_encode_chunk(sf_hl_stage *stage, sf_ll_write_batch *batch)
+{
+    if ( stage->text != nullptr ) {
+        sf_hl_encode_labeled(stage, batch);
+        return;
+    }
+    switch (stage->vtype) {
+        case -1: sf_hl_encode_numeric<parquet::BooleanType>(stage, batch); break;
+        case -2:
+        case -3: sf_hl_encode_numeric<parquet::Int32Type>(stage, batch);   break;
+        case -4: sf_hl_encode_numeric<parquet::FloatType>(stage, batch);   break;
+        case -5: sf_hl_encode_numeric<parquet::DoubleType>(stage, batch);  break;
+        default: sf_hl_encode_string(stage, batch);                        break;
+    }
+}
+
+// Write the rows in row groups of rgrows rows, encoding on nthreads
+// workers
+
+ST_retcode sf_hl_write_threaded(
+    std::shared_ptr<arrow::io::FileOutputStream> outfile,
+    const std::shared_ptr<arrow::Schema> &schema,
+    const std::shared_ptr<parquet::WriterProperties> &props,
+    const sf_write_rows &rows,
+    const sf_write_labels &labels,
+    const int64_t *vtypes,
+    int64_t ncol,
+    int64_t rgrows,
+    int64_t nthreads,
+    int64_t *warn_extended,
+    sf_write_progress *progress)
+{
+    ST_retcode rc = 0, wrc = 0;
+    int64_t t, w, r, j, from, ngroup, ntasks, nslots = 2 * nthreads;
+    int64_t next = 0, staged = 0, nready = 0;
+    bool abort = false;
+    std::string errmsg;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::thread> workers;
+    std::shared_ptr<parquet::SchemaDescriptor> descr;
+    std::shared_ptr<parquet::ParquetFileWriter> file_writer;
+    parquet::RowGroupWriter *rg_writer = nullptr;
+    sf_hl_stage *stage;
+
+    ngroup = (rows.nrows + rgrows - 1) / rgrows;
+    ntasks = ngroup * ncol;
+    std::vector<char> ready(ntasks, 0);
+    std::vector<sf_hl_stage> stages(nslots);
+
+    PARQUET_THROW_NOT_OK(parquet::arrow::ToParquetSchema(schema.get(), *props, &descr));
+    file_writer = parquet::ParquetFileWriter::Open(
+        outfile,
+        std::static_pointer_cast<GroupNode>(descr->schema_root()),
+        props
+    );
+
+    auto worker = [&]() {
+        int64_t wt;
+        sf_ll_write_batch batch;
+
+        sf_ll_write_batch_init(&batch, SPARQUET_NUMTEXT);
+        while ( true ) {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [&]{ return abort || next < staged; });
+                if ( abort ) return;
+                wt = next++;
+            }
+
+            try {
+                sf_hl_encode_chunk(&stages[wt % nslots], &batch);
+            } catch (const std::exception& e) {
+                std::lock_guard<std::mutex> lock(mtx);
+                if ( wrc == 0 ) {
+                    errmsg = std::string("Parquet write error: ") + e.what() + "\n";
+                    wrc = -1;
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                ready[wt] = 1;
+                nready++;
+            }
+            cv.notify_all();
+        }
+    };
+
+    for (w = 0; w < std::min(nthreads, ncol); w++)
+        workers.push_back(std::thread(worker));
+
+    for (t = 0; t < ntasks; t++) {
+        r = t / ncol;
+        j = t % ncol;
+
+        // Start a row group once the previous one is encoded (this
+        // writes it out); then wait for a free staging slot
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&]{
+                return wrc || ((j > 0 || nready == t) && (t < nslots || ready[t - nslots]));
+            });
+            if ( wrc ) break;
+        }
+        if ( j == 0 ) rg_writer = file_writer->AppendBufferedRowGroup();
+
+        stage = &stages[t % nslots];
+        stage->column_writer = rg_writer->column(j);
+        stage->vtype = vtypes[j];
+        stage->text  = labels.encode[j]? &labels.text[j]: nullptr;
+        from = r * rgrows;
+        rc = sf_hl_stage_chunk(rows, j, from, std::min(from + rgrows, rows.nrows),
+                               stage, warn_extended, progress);
+        if ( rc ) break;
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            staged++;
+        }
+        cv.notify_all();
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]{ return nready == staged; });
+        abort = true;
+    }
+    cv.notify_all();
+    for (w = 0; w < (int64_t) workers.size(); w++)
+        workers[w].join();
+
+    if ( wrc ) {
+        sf_errprintf("%s", errmsg.c_str());
+        return (wrc);
+    }
+    if ( rc ) return (rc);
+
+    file_writer->Close();
+    return (rc);
+}
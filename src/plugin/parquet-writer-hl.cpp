@@ -1,434 +1,268 @@
-// Stata function: High-level write full varlist
+// High-level writer
+// -----------------
 //
-// matrix
-//     __sparquet_coltypes
-// scalars
-//     __sparquet_ncol
-//     __sparquet_rg_size
-//     __sparquet_chunkbytes
-//     __sparquet_progress
-//     __sparquet_check
-ST_retcode sf_hl_write_varlist(
-    const char *fname,
-    const char *fcols,
-    const int verbose,
-    const int debug,
-    const int strbuffer)
+// The rows being written are copied from Stata one row group at a
+// time. Each column of the row group is built into an Arrow array,
+// handed to parquet::arrow::FileWriter as that column's chunk and freed
+// before the next one is copied, so memory use is bounded by a column
+// chunk (plus the encoder's buffers) however many observations there
+// are, instead of the whole dataset being copied into one arrow::Table.
+//
+// A row group has at most __sparquet_rg_size rows and about
+// __sparquet_chunkbytes bytes of data (strings count at their declared
+// width). With encode, labeled numeric variables are written as strings
+// of their value labels (see parquet-writer-props.cpp). With
+// __sparquet_threads > 1 the column chunks are encoded on
+// worker threads instead (see parquet-writer-hl-threads.cpp).
+
+// Numeric types: bool (as bytes), int32, float, double
+//
+// The chunk is gathered into a typed buffer and a byte validity vector
+// (0 for missing values) and handed to the builder, reserved up front,
+// in one AppendValues call.
+
+template <typename BuilderType, typename T>
+ST_retcode sf_hl_write_numeric(
+    const sf_write_rows &rows,
+    int64_t j,
+    int64_t from,
+    int64_t to,
+    int64_t *warn_extended,
+    sf_write_progress *progress,
+    std::shared_ptr<arrow::Array> *array)
 {
+    ST_retcode rc = 0;
+    ST_double z;
+    int64_t i, k, n = to - from;
+    BuilderType builder;
+    std::vector<T> values(n);
+    std::vector<uint8_t> valid(n);
+
+    for (i = from, k = 0; i < to; i++, k++) {
+        if ( (rc = SF_vdata(j + 1, sf_write_obs(rows, i), &z)) ) return (rc);
+        if ( z < SV_missval ) {
+            values[k] = (T) z;
+            valid[k]  = 1;
+        }
+        else {
+            values[k] = 0;
+            valid[k]  = 0;
+            if ( z > SV_missval ) {
+                ++(*warn_extended);
+            }
+        }
+        sf_write_progress_check(progress, j, i);
+    }
 
-    ST_double z, progress;
-    ST_retcode rc = 0, any_rc = 0;
-    SPARQUET_CHAR(vstr, strbuffer);
-
-    int64_t in1 = SF_in1();
-    int64_t in2 = SF_in2();
-    int64_t N = in2 - in1 + 1;
-    int64_t vtype, i, j, ttot, tread, tevery, ncol = 1, rg_size = 16;
-    int64_t arraybytes = 0;
-    int64_t chunkbytes = 1073741824;
-    int64_t warn_extended = 0;
-    clock_t timer = clock();
-    clock_t stimer = clock();
-
-    std::string line;
-    std::ifstream fstream;
-
-    // Get column and type info from Stata
-    // -----------------------------------
-
-    if ( (rc = sf_scalar_int("__sparquet_chunkbytes", 21, &chunkbytes)) ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_rg_size",    18, &rg_size))    ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_ncol",       15, &ncol))       ) any_rc = rc;
-    if ( (rc = sf_scalar_dbl("__sparquet_progress",   19, &progress))   ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_check",      16, &tevery))     ) any_rc = rc;
-
-    sf_printf_debug(debug, "# columns: %ld\n", ncol);
-
-    tread = 0;
-    ttot = ncol * N;
-    int64_t vtypes[ncol];
-    std::string vnames[ncol];
-
-    std::vector<std::shared_ptr<arrow::Field>> vfields(ncol);
-    std::vector<std::shared_ptr<arrow::Array>> varrays(ncol);
-    std::vector<std::shared_ptr<arrow::Column>> vcols(ncol);
-
-    if ( (rc = sf_matrix_int("__sparquet_coltypes", 19, ncol, vtypes)) ) any_rc = rc;
+    PARQUET_THROW_NOT_OK(builder.Reserve(n));
+    PARQUET_THROW_NOT_OK(builder.AppendValues(values.data(), n, valid.data()));
+    PARQUET_THROW_NOT_OK(builder.Finish(array));
 
-    // Get variable names
-    // ------------------
+    return (rc);
+}
 
-    if ( any_rc ) {
-        rc = any_rc;
-        goto exit;
-    }
+// Strings
 
-    if ( N == 0 ) {
-        sf_errprintf("No observations\n");
-        rc = 2000;
-        goto exit;
+ST_retcode sf_hl_write_string(
+    const sf_write_rows &rows,
+    int64_t j,
+    int64_t from,
+    int64_t to,
+    char *vstr,
+    sf_write_progress *progress,
+    std::shared_ptr<arrow::Array> *array)
+{
+    ST_retcode rc = 0;
+    int64_t i;
+    arrow::StringBuilder builder;
+
+    PARQUET_THROW_NOT_OK(builder.Reserve(to - from));
+    for (i = from; i < to; i++) {
+        if ( (rc = SF_sdata(j + 1, sf_write_obs(rows, i), vstr)) ) return (rc);
+        PARQUET_THROW_NOT_OK(builder.Append(vstr));
+        sf_write_progress_check(progress, j, i);
     }
+    PARQUET_THROW_NOT_OK(builder.Finish(array));
 
-    j = 0;
-    fstream.open(fcols);
-    if ( fstream.is_open() ) {
-        while ( std::getline(fstream, line) ) {
-            vnames[j++] = line;
-        }
-        fstream.close();
-    }
-    else {
-        sf_errprintf("Unable to read file '%s'\n", fcols);
-        return(601);
-    }
+    return (rc);
+}
 
-    // Write columns to file
-    // ---------------------
+// Labeled numeric variables (encode): the label text of each value
 
-    try {
-        timer = clock();
-        for (j = 0; j < ncol; j++) {
-            vtype = vtypes[j];
-            arraybytes = 0;
-            std::vector<std::shared_ptr<arrow::Array>> chunks;
-            // sf_printf_debug(2, "col %ld: %ld (%s)\n", j, vtype, vnames[j].c_str());
-            if ( vtype == -1 ) {
-                // TODO: Boolean is only 0/1; keep? Or always int32?
-                arrow::BooleanBuilder boolbuilder;
-                for (i = 0; i < N; i++) {
-                    if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                    if ( z < SV_missval ) {
-                        PARQUET_THROW_NOT_OK(boolbuilder.Append((bool) z));
-                    }
-                    else {
-                        PARQUET_THROW_NOT_OK(boolbuilder.AppendNull());
-                        if ( z > SV_missval ) {
-                            ++warn_extended;
-                        }
-                    }
-                    arraybytes += sizeof(bool);
-                    if ( arraybytes > chunkbytes ) {
-                        PARQUET_THROW_NOT_OK(boolbuilder.Finish(&varrays[j]));
-                        chunks.push_back(std::move(varrays[j]));
-                        boolbuilder.Reset();
-                        arraybytes = 0;
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(boolbuilder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::boolean());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
-            }
-            else if ( vtype == -2 ) {
-                arrow::Int32Builder i32builder;
-                for (i = 0; i < N; i++) {
-                    if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                    if ( z < SV_missval ) {
-                        PARQUET_THROW_NOT_OK(i32builder.Append((int32_t) z));
-                    }
-                    else {
-                        PARQUET_THROW_NOT_OK(i32builder.AppendNull());
-                        if ( z > SV_missval ) {
-                            ++warn_extended;
-                        }
-                    }
-                    arraybytes += sizeof(int32_t);
-                    if ( arraybytes > chunkbytes ) {
-                        PARQUET_THROW_NOT_OK(i32builder.Finish(&varrays[j]));
-                        chunks.push_back(std::move(varrays[j]));
-                        i32builder.Reset();
-                        arraybytes = 0;
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(i32builder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::int32());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
-            }
-            else if ( vtype == -3 ) {
-                arrow::Int32Builder i32builder;
-                for (i = 0; i < N; i++) {
-                    if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                    if ( z < SV_missval ) {
-                        PARQUET_THROW_NOT_OK(i32builder.Append((int32_t) z));
-                    }
-                    else {
-                        PARQUET_THROW_NOT_OK(i32builder.AppendNull());
-                        if ( z > SV_missval ) {
-                            ++warn_extended;
-                        }
-                    }
-                    arraybytes += sizeof(int32_t);
-                    if ( arraybytes > chunkbytes ) {
-                        PARQUET_THROW_NOT_OK(i32builder.Finish(&varrays[j]));
-                        chunks.push_back(std::move(varrays[j]));
-                        i32builder.Reset();
-                        arraybytes = 0;
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(i32builder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::int32());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
-            }
-            else if ( vtype == -4 ) {
-                arrow::FloatBuilder f32builder;
-                for (i = 0; i < N; i++) {
-                    if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                    if ( z < SV_missval ) {
-                        PARQUET_THROW_NOT_OK(f32builder.Append((float) z));
-                    }
-                    else {
-                        PARQUET_THROW_NOT_OK(f32builder.AppendNull());
-                        if ( z > SV_missval ) {
-                            ++warn_extended;
-                        }
-                    }
-                    arraybytes += sizeof(float);
-                    if ( arraybytes > chunkbytes ) {
-                        PARQUET_THROW_NOT_OK(f32builder.Finish(&varrays[j]));
-                        chunks.push_back(std::move(varrays[j]));
-                        f32builder.Reset();
-                        arraybytes = 0;
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(f32builder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::float32());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
-            }
-            else if ( vtype == -5 ) {
-                arrow::DoubleBuilder f64builder;
-                for (i = 0; i < N; i++) {
-                    if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                    if ( z < SV_missval ) {
-                        PARQUET_THROW_NOT_OK(f64builder.Append((double) z));
-                    }
-                    else {
-                        PARQUET_THROW_NOT_OK(f64builder.AppendNull());
-                        if ( z > SV_missval ) {
-                            ++warn_extended;
-                        }
-                    }
-                    arraybytes += sizeof(double);
-                    if ( arraybytes > chunkbytes ) {
-                        PARQUET_THROW_NOT_OK(f64builder.Finish(&varrays[j]));
-                        chunks.push_back(std::move(varrays[j]));
-                        f64builder.Reset();
-                        arraybytes = 0;
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(f64builder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::float64());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
-            }
-            else if ( vtype > 0 ) {
-                arrow::StringBuilder strbuilder;
-                for (i = 0; i < N; i++) {
-                    if ( (rc = SF_sdata(j + 1, i + in1, vstr)) ) goto exit;
-                    PARQUET_THROW_NOT_OK(strbuilder.Append(vstr));
-                    arraybytes += std::strlen(vstr) * sizeof(vstr);
-                    memset(vstr, '\0', strbuffer);
-                    if ( arraybytes > chunkbytes ) {
-                        PARQUET_THROW_NOT_OK(strbuilder.Finish(&varrays[j]));
-                        chunks.push_back(std::move(varrays[j]));
-                        strbuilder.Reset();
-                        arraybytes = 0;
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(strbuilder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::utf8());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
-            }
-            else {
-                sf_errprintf("Unsupported type.\n");
-                rc = 17100;
-                goto exit;
-            }
+ST_retcode sf_hl_write_labeled(
+    const sf_write_rows &rows,
+    int64_t j,
+    int64_t from,
+    int64_t to,
+    const std::unordered_map<ST_double, std::string> &text,
+    sf_write_progress *progress,
+    std::shared_ptr<arrow::Array> *array)
+{
+    ST_retcode rc = 0;
+    ST_double z;
+    int64_t i, len;
+    const char *ptr;
+    char buf[SPARQUET_NUMTEXT];
+    arrow::StringBuilder builder;
+
+    PARQUET_THROW_NOT_OK(builder.Reserve(to - from));
+    for (i = from; i < to; i++) {
+        if ( (rc = SF_vdata(j + 1, sf_write_obs(rows, i), &z)) ) return (rc);
+        if ( sf_write_label(text, z, buf, &ptr, &len) ) {
+            PARQUET_THROW_NOT_OK(builder.Append(ptr, len));
         }
-        sf_running_timer (&timer, "Copied data into Arrow table");
-
-        std::shared_ptr<arrow::Schema> schema = arrow::schema(vfields);
-        std::shared_ptr<arrow::Table> table = arrow::Table::Make(schema, vcols);
-
-        // rg_size is, according to the source files, supposed to be
-        // really large and controls how the file gets split.
-
-        std::shared_ptr<arrow::io::FileOutputStream> outfile;
-        PARQUET_THROW_NOT_OK(
-                arrow::io::FileOutputStream::Open(fname, &outfile));
-        PARQUET_THROW_NOT_OK(
-                parquet::arrow::WriteTable(*table, arrow::default_memory_pool(), outfile, rg_size));
+        else {
+            PARQUET_THROW_NOT_OK(builder.AppendNull());
+        }
+        sf_write_progress_check(progress, j, i);
+    }
+    PARQUET_THROW_NOT_OK(builder.Finish(array));
 
-        sf_running_timer (&timer, "Wrote table to file");
-        sf_printf_debug(verbose, "\t%s\n",          fname);
-        sf_printf_debug(verbose, "\t%ld columns\n", ncol);
-        sf_printf_debug(verbose, "\t%ld rows\n",    N);
+    return (rc);
+}
 
-        if ( warn_extended > 0 ) {
-            sf_printf("Warning: %ld extended missing values coerced to NULL.\n", warn_extended);
-        }
+// Arrow type for a Stata type; nullptr and 0 bytes per row if the type
+// is not supported.
 
-    } catch (const std::exception& e) {
-        sf_errprintf("Parquet write error: %s\n", e.what());
-        return(-1);
+std::shared_ptr<arrow::DataType> sf_hl_write_type(int64_t vtype, int64_t *rowbytes)
+{
+    switch (vtype) {
+        case -1:
+            // TODO: Boolean is only 0/1; keep? Or always int32?
+            *rowbytes = sizeof(bool);
+            return (arrow::boolean());
+        case -2:
+        case -3:
+            *rowbytes = sizeof(int32_t);
+            return (arrow::int32());
+        case -4:
+            *rowbytes = sizeof(float);
+            return (arrow::float32());
+        case -5:
+            *rowbytes = sizeof(double);
+            return (arrow::float64());
+        default:
+            if ( vtype <= 0 ) break;
+            *rowbytes = vtype + sizeof(int32_t);
+            return (arrow::utf8());
     }
+    *rowbytes = 0;
+    return (nullptr);
+}
 
-exit:
-    return (rc);
+// Copy rows [from, to) of variable j + 1 into an Arrow array
+
+ST_retcode sf_hl_write_column(
+    const sf_write_rows &rows,
+    const sf_write_labels &labels,
+    int64_t j,
+    int64_t vtype,
+    int64_t from,
+    int64_t to,
+    char *vstr,
+    int64_t *warn_extended,
+    sf_write_progress *progress,
+    std::shared_ptr<arrow::Array> *array)
+{
+    if ( labels.encode[j] ) {
+        return (sf_hl_write_labeled(rows, j, from, to, labels.text[j], progress, array));
+    }
+    switch (vtype) {
+        case -1:
+            return (sf_hl_write_numeric<arrow::BooleanBuilder, uint8_t>(rows, j, from, to, warn_extended, progress, array));
+        case -2:
+        case -3:
+            return (sf_hl_write_numeric<arrow::Int32Builder, int32_t>(rows, j, from, to, warn_extended, progress, array));
+        case -4:
+            return (sf_hl_write_numeric<arrow::FloatBuilder, float>(rows, j, from, to, warn_extended, progress, array));
+        case -5:
+            return (sf_hl_write_numeric<arrow::DoubleBuilder, double>(rows, j, from, to, warn_extended, progress, array));
+        default:
+            return (sf_hl_write_string(rows, j, from, to, vstr, progress, array));
+    }
 }
 
-// Stata function: High-level write full varlist with if condition
+// Stata function: High-level write full varlist (with or without an if
+// condition)
 //
 // matrix
 //     __sparquet_coltypes
+//     __sparquet_colcodecs
 // scalars
 //     __sparquet_ncol
 //     __sparquet_rg_size
 //     __sparquet_chunkbytes
 //     __sparquet_progress
 //     __sparquet_check
-ST_retcode sf_hl_write_varlist_if(
+//     __sparquet_threads
+//     __sparquet_compression
+//     __sparquet_complevel
+//     __sparquet_encode
+//     __sparquet_dictmax
+ST_retcode sf_hl_write(
     const char *fname,
     const char *fcols,
+    const char *flabels,
     const int verbose,
     const int debug,
-    const int strbuffer)
+    const int strbuffer,
+    const bool useif)
 {
-
-    ST_double z, progress;
     ST_retcode rc = 0, any_rc = 0;
-    SPARQUET_CHAR(vstr, strbuffer);
-
-    int64_t in1 = SF_in1();
-    int64_t in2 = SF_in2();
-    int64_t N = in2 - in1 + 1;
-    int64_t vtype, i, j, ttot, tread, tevery, ncol = 1, rg_size = 16;
-    int64_t arraybytes = 0;
-    int64_t chunkbytes = 1073741824;
+    int64_t j, r, ngroup, rgrows, from, to, ncol = 1, rg_size = 16, nthreads = 1;
+    int64_t chunkbytes = 1073741824, rowbytes = 0, colbytes;
     int64_t warn_extended = 0;
-    clock_t timer = clock();
-    clock_t stimer = clock();
+    sf_clock timer = sf_clock_now();
 
     std::string line;
     std::ifstream fstream;
+    std::vector<char> vstr(strbuffer + 1, '\0');
+    sf_write_rows rows;
+    sf_write_labels labels;
+    sf_write_progress progress;
 
     // Get column and type info from Stata
     // -----------------------------------
 
-    if ( (rc = sf_scalar_int("__sparquet_chunkbytes", 21, &chunkbytes)) ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_rg_size",    18, &rg_size))    ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_ncol",       15, &ncol))       ) any_rc = rc;
-    if ( (rc = sf_scalar_dbl("__sparquet_progress",   19, &progress))   ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_check",      16, &tevery))     ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_chunkbytes", 21, &chunkbytes))     ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_rg_size",    18, &rg_size))        ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_ncol",       15, &ncol))           ) any_rc = rc;
+    if ( (rc = sf_scalar_dbl("__sparquet_progress",   19, &progress.every)) ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_check",      16, &progress.check)) ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_threads",    18, &nthreads))       ) any_rc = rc;
 
     sf_printf_debug(debug, "# columns: %ld\n", ncol);
 
-    tread = 0;
-    ttot = ncol * N;
     int64_t vtypes[ncol];
     std::string vnames[ncol];
 
-    std::vector<std::shared_ptr<arrow::Field>> vfields(ncol);
-    std::vector<std::shared_ptr<arrow::Array>> varrays(ncol);
-    std::vector<std::shared_ptr<arrow::Column>> vcols(ncol);
-
     if ( (rc = sf_matrix_int("__sparquet_coltypes", 19, ncol, vtypes)) ) any_rc = rc;
 
-    // Get variable names
-    // ------------------
-
     if ( any_rc ) {
         rc = any_rc;
         goto exit;
     }
 
-    if ( N == 0 ) {
+    // Rows to write
+    // -------------
+
+    sf_write_rows_init(&rows, useif);
+    if ( rows.nrows == 0 ) {
         sf_errprintf("No observations\n");
         rc = 2000;
         goto exit;
     }
 
+    progress.timer  = sf_clock_now();
+    progress.stimer = sf_clock_now();
+    progress.done   = 0;
+    progress.total  = ncol * rows.nrows;
+    progress.ncol   = ncol;
+    progress.nrows  = rows.nrows;
+
+    // Get variable names
+    // ------------------
+
     j = 0;
     fstream.open(fcols);
     if ( fstream.is_open() ) {
@@ -442,280 +276,79 @@ ST_retcode sf_hl_write_varlist_if(
         return(601);
     }
 
+    if ( (rc = sf_write_labels_read(flabels, ncol, &labels)) ) goto exit;
+
     // Write columns to file
     // ---------------------
 
     try {
-        timer = clock();
+        std::vector<std::shared_ptr<arrow::Field>> vfields(ncol);
+        std::shared_ptr<arrow::DataType> vtype;
+        std::shared_ptr<arrow::Array> array;
+        std::shared_ptr<arrow::io::FileOutputStream> outfile;
+        std::unique_ptr<parquet::arrow::FileWriter> writer;
+        parquet::WriterProperties::Builder builder;
+
         for (j = 0; j < ncol; j++) {
-            vtype = vtypes[j];
-            arraybytes = 0;
-            std::vector<std::shared_ptr<arrow::Array>> chunks;
-            // sf_printf_debug(2, "col %ld: %ld (%s)\n", j, vtype, vnames[j].c_str());
-            if ( vtype == -1 ) {
-                // TODO: Boolean is only 0/1; keep? Or always int32?
-                arrow::BooleanBuilder boolbuilder;
-                for (i = 0; i < N; i++) {
-                    if ( SF_ifobs(i + in1) ) {
-                        if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                        if ( z < SV_missval ) {
-                            PARQUET_THROW_NOT_OK(boolbuilder.Append((bool) z));
-                        }
-                        else {
-                            PARQUET_THROW_NOT_OK(boolbuilder.AppendNull());
-                            if ( z > SV_missval ) {
-                                ++warn_extended;
-                            }
-                        }
-                        arraybytes += sizeof(bool);
-                        if ( arraybytes > chunkbytes ) {
-                            PARQUET_THROW_NOT_OK(boolbuilder.Finish(&varrays[j]));
-                            chunks.push_back(std::move(varrays[j]));
-                            boolbuilder.Reset();
-                            arraybytes = 0;
-                        }
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(boolbuilder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::boolean());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
-            }
-            else if ( vtype == -2 ) {
-                arrow::Int32Builder i32builder;
-                for (i = 0; i < N; i++) {
-                    if ( SF_ifobs(i + in1) ) {
-                        if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                        if ( z < SV_missval ) {
-                            PARQUET_THROW_NOT_OK(i32builder.Append((int32_t) z));
-                        }
-                        else {
-                            PARQUET_THROW_NOT_OK(i32builder.AppendNull());
-                            if ( z > SV_missval ) {
-                                ++warn_extended;
-                            }
-                        }
-                        arraybytes += sizeof(int32_t);
-                        if ( arraybytes > chunkbytes ) {
-                            PARQUET_THROW_NOT_OK(i32builder.Finish(&varrays[j]));
-                            chunks.push_back(std::move(varrays[j]));
-                            i32builder.Reset();
-                            arraybytes = 0;
-                        }
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(i32builder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::int32());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
-            }
-            else if ( vtype == -3 ) {
-                arrow::Int32Builder i32builder;
-                for (i = 0; i < N; i++) {
-                    if ( SF_ifobs(i + in1) ) {
-                        if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                        if ( z < SV_missval ) {
-                            PARQUET_THROW_NOT_OK(i32builder.Append((int32_t) z));
-                        }
-                        else {
-                            PARQUET_THROW_NOT_OK(i32builder.AppendNull());
-                            if ( z > SV_missval ) {
-                                ++warn_extended;
-                            }
-                        }
-                        arraybytes += sizeof(int32_t);
-                        if ( arraybytes > chunkbytes ) {
-                            PARQUET_THROW_NOT_OK(i32builder.Finish(&varrays[j]));
-                            chunks.push_back(std::move(varrays[j]));
-                            i32builder.Reset();
-                            arraybytes = 0;
-                        }
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(i32builder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::int32());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
-            }
-            else if ( vtype == -4 ) {
-                arrow::FloatBuilder f32builder;
-                for (i = 0; i < N; i++) {
-                    if ( SF_ifobs(i + in1) ) {
-                        if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                        if ( z < SV_missval ) {
-                            PARQUET_THROW_NOT_OK(f32builder.Append((float) z));
-                        }
-                        else {
-                            PARQUET_THROW_NOT_OK(f32builder.AppendNull());
-                            if ( z > SV_missval ) {
-                                ++warn_extended;
-                            }
-                        }
-                        arraybytes += sizeof(float);
-                        if ( arraybytes > chunkbytes ) {
-                            PARQUET_THROW_NOT_OK(f32builder.Finish(&varrays[j]));
-                            chunks.push_back(std::move(varrays[j]));
-                            f32builder.Reset();
-                            arraybytes = 0;
-                        }
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(f32builder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::float32());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
-            }
-            else if ( vtype == -5 ) {
-                arrow::DoubleBuilder f64builder;
-                for (i = 0; i < N; i++) {
-                    if ( SF_ifobs(i + in1) ) {
-                        if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                        if ( z < SV_missval ) {
-                            PARQUET_THROW_NOT_OK(f64builder.Append((double) z));
-                        }
-                        else {
-                            PARQUET_THROW_NOT_OK(f64builder.AppendNull());
-                            if ( z > SV_missval ) {
-                                ++warn_extended;
-                            }
-                        }
-                        arraybytes += sizeof(double);
-                        if ( arraybytes > chunkbytes ) {
-                            PARQUET_THROW_NOT_OK(f64builder.Finish(&varrays[j]));
-                            chunks.push_back(std::move(varrays[j]));
-                            f64builder.Reset();
-                            arraybytes = 0;
-                        }
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(f64builder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::float64());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
-            }
-            else if ( vtype > 0 ) {
-                arrow::StringBuilder strbuilder;
-                for (i = 0; i < N; i++) {
-                    if ( SF_ifobs(i + in1) ) {
-                        if ( (rc = SF_sdata(j + 1, i + in1, vstr)) ) goto exit;
-                        PARQUET_THROW_NOT_OK(strbuilder.Append(vstr));
-                        arraybytes += std::strlen(vstr) * sizeof(vstr);
-                        memset(vstr, '\0', strbuffer);
-                        if ( arraybytes > chunkbytes ) {
-                            PARQUET_THROW_NOT_OK(strbuilder.Finish(&varrays[j]));
-                            chunks.push_back(std::move(varrays[j]));
-                            strbuilder.Reset();
-                            arraybytes = 0;
-                        }
-                    }
-                    if ( i % tevery == 0 ) {
-                        tread += tevery;
-                        sf_running_progress_write(
-                            &timer,
-                            &stimer,
-                            progress,
-                            j + 1, ncol,
-                            i + 1, N,
-                            100 * tread / ttot
-                        );
-                    }
-                }
-                if ( arraybytes ) {
-                    PARQUET_THROW_NOT_OK(strbuilder.Finish(&varrays[j]));
-                    chunks.push_back(std::move(varrays[j]));
-                }
-                vfields[j] = arrow::field(vnames[j].c_str(), arrow::utf8());
-                vcols[j]   = std::make_shared<arrow::Column>(vfields[j], std::make_shared<arrow::ChunkedArray>(std::move(chunks)));;
+            vtype = sf_hl_write_type(vtypes[j], &colbytes);
+            if ( labels.encode[j] ) {
+                vtype    = arrow::utf8();
+                colbytes = labels.maxlen[j] + sizeof(int32_t);
             }
-            else {
+            if ( vtype == nullptr ) {
                 sf_errprintf("Unsupported type.\n");
                 rc = 17100;
                 goto exit;
             }
+            vfields[j] = arrow::field(vnames[j].c_str(), vtype);
+            rowbytes  += colbytes;
         }
-        sf_running_timer (&timer, "Copied data into Arrow table");
-
         std::shared_ptr<arrow::Schema> schema = arrow::schema(vfields);
-        std::shared_ptr<arrow::Table> table = arrow::Table::Make(schema, vcols);
 
-        // rg_size is, according to the source files, supposed to be
-        // really large and controls how the file gets split.
+        // Rows per row group from the row and byte limits
+        rgrows = rg_size > 0? rg_size: rows.nrows;
+        rgrows = std::min(rgrows, std::max(chunkbytes / rowbytes, (int64_t) 1));
+        ngroup = (rows.nrows + rgrows - 1) / rgrows;
+        sf_printf_debug(verbose, "\t%ld row groups of up to %ld rows\n", ngroup, rgrows);
+
+        if ( (rc = sf_write_compression(builder, vnames, ncol, debug)) ) goto exit;
+        if ( (rc = sf_write_dictionary(builder, vnames, vtypes, labels, rows, ncol, strbuffer, verbose)) ) goto exit;
 
-        std::shared_ptr<arrow::io::FileOutputStream> outfile;
         PARQUET_THROW_NOT_OK(
                 arrow::io::FileOutputStream::Open(fname, &outfile));
-        PARQUET_THROW_NOT_OK(
-                parquet::arrow::WriteTable(*table, arrow::default_memory_pool(), outfile, rg_size));
 
-        sf_running_timer (&timer, "Wrote table to file");
+        if ( nthreads > 1 ) {
+            sf_printf_debug(verbose, "\tEncoding on %ld threads\n", nthreads);
+            rc = sf_hl_write_threaded(outfile, schema, builder.build(), rows, labels, vtypes, ncol,
+                                      rgrows, nthreads, &warn_extended, &progress);
+            if ( rc ) goto exit;
+        }
+        else {
+            PARQUET_THROW_NOT_OK(
+                    parquet::arrow::FileWriter::Open(*schema, arrow::default_memory_pool(), outfile, builder.build(), &writer));
+
+            for (r = 0; r < ngroup; r++) {
+                from = r * rgrows;
+                to   = std::min(from + rgrows, rows.nrows);
+                PARQUET_THROW_NOT_OK(writer->NewRowGroup(to - from));
+                for (j = 0; j < ncol; j++) {
+                    rc = sf_hl_write_column(rows, labels, j, vtypes[j], from, to, vstr.data(),
+                                            &warn_extended, &progress, &array);
+                    if ( rc ) goto exit;
+                    PARQUET_THROW_NOT_OK(writer->WriteColumnChunk(*array));
+                    array.reset();
+                }
+            }
+
+            PARQUET_THROW_NOT_OK(writer->Close());
+        }
+        PARQUET_THROW_NOT_OK(outfile->Close());
+
+        sf_running_timer (&timer, "Wrote data from memory");
         sf_printf_debug(verbose, "\t%s\n",          fname);
         sf_printf_debug(verbose, "\t%ld columns\n", ncol);
-        sf_printf_debug(verbose, "\t%ld rows\n",    N);
+        sf_printf_debug(verbose, "\t%ld rows\n",    rows.nrows);
+        if ( verbose ) sf_write_summary(fname);
 
         if ( warn_extended > 0 ) {
             sf_printf("Warning: %ld extended missing values coerced to NULL.\n", warn_extended);
@@ -729,3 +362,25 @@ ST_retcode sf_hl_write_varlist_if(
 exit:
     return (rc);
 }
+
+ST_retcode sf_hl_write_varlist(
+    const char *fname,
+    const char *fcols,
+    const char *flabels,
+    const int verbose,
+    const int debug,
+    const int strbuffer)
+{
+    return (sf_hl_write(fname, fcols, flabels, verbose, debug, strbuffer, false));
+}
+
+ST_retcode sf_hl_write_varlist_if(
+    const char *fname,
+    const char *fcols,
+    const char *flabels,
+    const int verbose,
+    const int debug,
+    const int strbuffer)
+{
+    return (sf_hl_write(fname, fcols, flabels, verbose, debug, strbuffer, true));
+}
@@ -1,466 +1,309 @@
-// Stata function: Low-level write full varlist
+// Low-level writer
+// ----------------
 //
-// matrix
-//     __sparquet_coltypes
-// scalars
-//     __sparquet_ncol
-//     __sparquet_fixedlen
-//     __sparquet_compression
-ST_retcode sf_ll_write_varlist(
-    const char *fname,
-    const char *fcols,
-    const int verbose,
-    const int debug,
-    const int strbuffer)
+// Each column is gathered SPARQUET_BATCH rows at a time into a typed
+// buffer with definition levels and handed to WriteBatch in one call.
+// Every column except fixed-length strings is OPTIONAL, so Stata
+// missing values (extended missing values included) are written as
+// nulls.
+//
+// The rows being written are split into row groups of at most
+// __sparquet_rg_size rows and, with __sparquet_rg_bytes, of about that
+// many uncompressed bytes (strings count at their declared width).
+//
+// With encode, labeled numeric variables are written as strings of
+// their value labels (see parquet-writer-props.cpp).
+
+struct sf_ll_write_batch {
+    std::vector<int16_t> deflevels;
+    std::vector<int64_t> values;  // 16 bytes per value fits every physical type
+    std::vector<char>    vstr;    // strings of the batch, strbuffer + 1 bytes each
+    int64_t strbuffer;
+    int64_t warn_extended;
+};
+
+void sf_ll_write_batch_init(sf_ll_write_batch *batch, int64_t strbuffer)
 {
+    batch->strbuffer = strbuffer;
+    batch->warn_extended = 0;
+    batch->deflevels.assign(SPARQUET_BATCH, 1);
+    batch->values.assign(2 * SPARQUET_BATCH, 0);
+    batch->vstr.assign(SPARQUET_BATCH * (strbuffer + 1), '\0');
+}
 
-    ST_double z;
-    ST_retcode rc = 0, any_rc = 0;
-    SPARQUET_CHAR(vmatrix, 32);
-    SPARQUET_CHAR(vscalar, 32);
-    SPARQUET_CHAR(vstr, strbuffer);
-
-    int64_t in1 = SF_in1();
-    int64_t in2 = SF_in2();
-    int64_t N = in2 - in1 + 1;
-    int64_t vtype, i, j, compcode = 1, ncol = 1, fixedlen = 0;
-    int64_t warn_extended = 0;
-    int16_t definition_level = 1;
-    parquet::Compression::type compression;
-
-    std::string line;
-    std::ifstream fstream;
-
-    bool vbool;
-    int32_t vint32;
-    float vfloat;
-    double vdouble;
-    parquet::ByteArray vbytearray;
-    parquet::FixedLenByteArray vfixedlen;
-
-    parquet::BoolWriter* bool_writer;
-    parquet::Int32Writer* int32_writer;
-    parquet::FloatWriter* float_writer;
-    parquet::DoubleWriter* double_writer;
-    parquet::ByteArrayWriter* ba_writer;
-    parquet::FixedLenByteArrayWriter* flba_writer;
+// Numeric types: bool, int32, float, double
 
-    // Get column and type info from Stata
-    // -----------------------------------
+template <typename DType>
+ST_retcode sf_ll_write_numeric(
+    parquet::ColumnWriter *column_writer,
+    sf_ll_write_batch *batch,
+    const sf_write_rows &rows,
+    int64_t j,
+    int64_t from,
+    int64_t to)
+{
+    ST_retcode rc = 0;
+    typedef typename DType::c_type T;
+    parquet::TypedColumnWriter<DType> *writer =
+        static_cast<parquet::TypedColumnWriter<DType>*>(column_writer);
+
+    T *values = reinterpret_cast<T*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    int64_t i, k, v, n;
+    ST_double z;
 
-    if ( (rc = sf_scalar_int("__sparquet_fixedlen",    19, &fixedlen))) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_ncol",        15, &ncol))    ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_compression", 22, &compcode))) any_rc = rc;
-
-    switch (compcode) {
-        case 0:
-            compression = parquet::Compression::UNCOMPRESSED;
-        case 1:
-            compression = parquet::Compression::SNAPPY;
-        case 2:
-            compression = parquet::Compression::GZIP;
-        case 3:
-            compression = parquet::Compression::LZO;
-        case 4:
-            compression = parquet::Compression::BROTLI;
-        case 5:
-            compression = parquet::Compression::LZ4;
-        case 6:
-            compression = parquet::Compression::ZSTD;
-        default:
-            compression = parquet::Compression::SNAPPY;
+    for (i = from; i < to; i += n) {
+        n = std::min(to - i, (int64_t) SPARQUET_BATCH);
+        for (k = v = 0; k < n; k++) {
+            if ( (rc = SF_vdata(j + 1, sf_write_obs(rows, i + k), &z)) ) return (rc);
+            if ( z < SV_missval ) {
+                deflevels[k] = 1;
+                values[v++]  = (T) z;
+            }
+            else {
+                deflevels[k] = 0;
+                if ( z > SV_missval ) batch->warn_extended++;
+            }
+        }
+        writer->WriteBatch(n, deflevels, nullptr, values);
     }
 
-    sf_printf_debug(debug, "# columns: %ld\n", ncol);
-
-    int64_t vtypes[ncol];
-    std::string vnames[ncol];
-
-    std::vector<std::shared_ptr<arrow::Field>> vfields(ncol);
-    std::vector<std::shared_ptr<arrow::Array>> varrays(ncol);
-
-    if ( (rc = sf_matrix_int("__sparquet_coltypes", 19, ncol, vtypes)) ) any_rc = rc;
+    return (rc);
+}
 
-    // Get variable names
-    // ------------------
+// String types: ByteArray and FixedLenByteArray (padded with NUL)
+//
+// Each string of the batch is read into its own slot of vstr, so the
+// values can point into it until the batch is written.
 
-    if ( any_rc ) {
-        rc = any_rc;
-        goto exit;
-    }
+inline void sf_ll_write_strvalue(parquet::ByteArray &value, const char *vstr)
+{
+    value.ptr = reinterpret_cast<const uint8_t*>(vstr);
+    value.len = strlen(vstr);
+}
 
-    if ( N == 0 ) {
-        sf_errprintf("No observations\n");
-        rc = 2000;
-        goto exit;
-    }
+inline void sf_ll_write_strvalue(parquet::FixedLenByteArray &value, const char *vstr)
+{
+    value.ptr = reinterpret_cast<const uint8_t*>(vstr);
+}
 
-    j = 0;
-    fstream.open(fcols);
-    if ( fstream.is_open() ) {
-        while ( std::getline(fstream, line) ) {
-            vnames[j++] = line;
+template <typename DType>
+ST_retcode sf_ll_write_string(
+    parquet::ColumnWriter *column_writer,
+    sf_ll_write_batch *batch,
+    const sf_write_rows &rows,
+    int64_t j,
+    int64_t from,
+    int64_t to)
+{
+    ST_retcode rc = 0;
+    typedef typename DType::c_type T;
+    parquet::TypedColumnWriter<DType> *writer =
+        static_cast<parquet::TypedColumnWriter<DType>*>(column_writer);
+
+    T *values = reinterpret_cast<T*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    int64_t i, k, n, slot = batch->strbuffer + 1;
+    char *vstr;
+
+    for (i = from; i < to; i += n) {
+        n = std::min(to - i, (int64_t) SPARQUET_BATCH);
+        for (k = 0; k < n; k++) {
+            vstr = batch->vstr.data() + k * slot;
+            memset(vstr, '\0', slot);
+            if ( (rc = SF_sdata(j + 1, sf_write_obs(rows, i + k), vstr)) ) return (rc);
+            sf_ll_write_strvalue(values[k], vstr);
+            deflevels[k] = 1;
         }
-        fstream.close();
-    }
-    else {
-        sf_errprintf("Unable to read file '%s'\n", fcols);
-        return(601);
+        writer->WriteBatch(n, deflevels, nullptr, values);
     }
 
-    // Write columns to file
-    // ---------------------
-
-    try {
-        using FileClass = ::arrow::io::FileOutputStream;
-        std::shared_ptr<FileClass> out_file;
-        std::shared_ptr<GroupNode> schema;
-        std::shared_ptr<parquet::WriterProperties> props;
-        std::shared_ptr<parquet::ParquetFileWriter> file_writer;
-        parquet::WriterProperties::Builder builder;
-        parquet::schema::NodeVector fields;
+    return (rc);
+}
 
-        // Get fields
-        // ----------
+// Labeled numeric variables (encode): the label text of each value,
+// written as a string. The values point into the labels or, for
+// unlabeled values, into the batch's string slots.
+
+ST_retcode sf_ll_write_labeled(
+    parquet::ColumnWriter *column_writer,
+    sf_ll_write_batch *batch,
+    const sf_write_rows &rows,
+    int64_t j,
+    const std::unordered_map<ST_double, std::string> &text,
+    int64_t from,
+    int64_t to)
+{
+    ST_retcode rc = 0;
+    parquet::TypedColumnWriter<parquet::ByteArrayType> *writer =
+        static_cast<parquet::TypedColumnWriter<parquet::ByteArrayType>*>(column_writer);
+
+    parquet::ByteArray *values = reinterpret_cast<parquet::ByteArray*>(batch->values.data());
+    int16_t *deflevels = batch->deflevels.data();
+    int64_t i, k, v, n, len, slot = batch->strbuffer + 1;
+    const char *ptr;
+    ST_double z;
 
-        // TODO: Logical type is basically format?
-        // TODO: Logical type vs Converted type?
-        for (j = 0; j < ncol; j++) {
-            vtype = vtypes[j];
-            if ( vtype == -1 ) {
-                fields.push_back(
-                    PrimitiveNode::Make(
-                        vnames[j].c_str(),
-                        Repetition::REQUIRED,
-                        Type::BOOLEAN,
-                        ConvertedType::NONE
-                    )
-                );
-            }
-            else if ( vtype == -2 ) {
-                fields.push_back(
-                    PrimitiveNode::Make(
-                        vnames[j].c_str(),
-                        Repetition::REQUIRED,
-                        Type::INT32,
-                        ConvertedType::NONE
-                    )
-                );
-            }
-            else if ( vtype == -3 ) {
-                fields.push_back(
-                    PrimitiveNode::Make(
-                        vnames[j].c_str(),
-                        Repetition::REQUIRED,
-                        Type::INT32,
-                        ConvertedType::NONE
-                    )
-                );
-            }
-            else if ( vtype == -4 ) {
-                fields.push_back(
-                    PrimitiveNode::Make(
-                        vnames[j].c_str(),
-                        Repetition::REQUIRED,
-                        Type::FLOAT,
-                        ConvertedType::NONE
-                    )
-                );
-            }
-            else if ( vtype == -5 ) {
-                fields.push_back(
-                    PrimitiveNode::Make(
-                        vnames[j].c_str(),
-                        Repetition::REQUIRED,
-                        Type::DOUBLE,
-                        ConvertedType::NONE
-                    )
-                );
-            }
-            else if ( vtype > 0 ) {
-                if ( fixedlen ) {
-                    fields.push_back(
-                        PrimitiveNode::Make(
-                            vnames[j].c_str(),
-                            Repetition::REQUIRED,
-                            Type::FIXED_LEN_BYTE_ARRAY,
-                            ConvertedType::NONE,
-                            vtype
-                        )
-                    );
-                }
-                else {
-                    fields.push_back(
-                        PrimitiveNode::Make(
-                            vnames[j].c_str(),
-                            Repetition::OPTIONAL,
-                            Type::BYTE_ARRAY,
-                            ConvertedType::NONE
-                        )
-                    );
-                }
+    for (i = from; i < to; i += n) {
+        n = std::min(to - i, (int64_t) SPARQUET_BATCH);
+        for (k = v = 0; k < n; k++) {
+            if ( (rc = SF_vdata(j + 1, sf_write_obs(rows, i + k), &z)) ) return (rc);
+            if ( sf_write_label(text, z, batch->vstr.data() + k * slot, &ptr, &len) ) {
+                deflevels[k]    = 1;
+                values[v].ptr   = reinterpret_cast<const uint8_t*>(ptr);
+                values[v++].len = len;
             }
             else {
-                sf_errprintf("Unsupported type.\n");
-                rc = 17100;
-                goto exit;
+                deflevels[k] = 0;
             }
         }
+        writer->WriteBatch(n, deflevels, nullptr, values);
+    }
 
-        // Write to file
-        // -------------
-
-        PARQUET_THROW_NOT_OK(FileClass::Open(fname, &out_file));
-        schema = std::static_pointer_cast<GroupNode>(
-            GroupNode::Make("schema", Repetition::REQUIRED, fields)
-        );
-
-        builder.compression(compression);
-        props = builder.build();
+    return (rc);
+}
 
-        file_writer = parquet::ParquetFileWriter::Open(out_file, schema, props);
-        parquet::RowGroupWriter* rg_writer = file_writer->AppendRowGroup(N);
+// Schema node for a Stata type; 0 bytes per row if the type is not
+// supported.
 
-        clock_t timer = clock();
-        for (j = 0; j < ncol; j++) {
-            vtype = vtypes[j];
-            // TODO: Boolean is only 0/1; keep? Or always int32?
-            if ( vtype == -1 ) {
-                bool_writer = static_cast<parquet::BoolWriter*>(rg_writer->NextColumn());
-                for (i = 0; i < N; i++) {
-                    if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                    // sf_printf_debug(2, "\t(bool, %ld, %ld): %9.4f\n", j, i, z);
-                    if ( z < SV_missval ) {
-                        vbool = (bool) z;
-                        bool_writer->WriteBatch(1, nullptr, nullptr, &vbool);
-                    }
-                    else {
-                        sf_errprintf("Low-level writer does not supprot missing values.\n");
-                        rc = 17042;
-                        goto exit;
-                        if ( z > SV_missval ) {
-                            ++warn_extended;
-                        }
-                    }
-                }
-            }
-            else if ( vtype == -2 ) {
-                int32_writer = static_cast<parquet::Int32Writer*>(rg_writer->NextColumn());
-                for (i = 0; i < N; i++) {
-                    if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                    // sf_printf_debug(2, "\t(int, %ld, %ld): %9.4f\n", j, i, z);
-                    if ( z < SV_missval ) {
-                        vint32 = (int32_t) z;
-                        int32_writer->WriteBatch(1, nullptr, nullptr, &vint32);
-                    }
-                    else {
-                        sf_errprintf("Low-level writer does not supprot missing values.\n");
-                        rc = 17042;
-                        goto exit;
-                        if ( z > SV_missval ) {
-                            ++warn_extended;
-                        }
-                    }
-                }
-            }
-            else if ( vtype == -3 ) {
-                int32_writer = static_cast<parquet::Int32Writer*>(rg_writer->NextColumn());
-                for (i = 0; i < N; i++) {
-                    if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                    // sf_printf_debug(2, "\t(long, %ld, %ld): %9.4f\n", j, i, z);
-                    if ( z < SV_missval ) {
-                        vint32 = (int32_t) z;
-                        int32_writer->WriteBatch(1, nullptr, nullptr, &vint32);
-                    }
-                    else {
-                        sf_errprintf("Low-level writer does not supprot missing values.\n");
-                        rc = 17042;
-                        goto exit;
-                        if ( z > SV_missval ) {
-                            ++warn_extended;
-                        }
-                    }
-                }
-            }
-            else if ( vtype == -4 ) {
-                float_writer = static_cast<parquet::FloatWriter*>(rg_writer->NextColumn());
-                for (i = 0; i < N; i++) {
-                    if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                    // sf_printf_debug(2, "\t(float, %ld, %ld): %9.4f\n", j, i, z);
-                    if ( z < SV_missval ) {
-                        vfloat = (float) z;
-                        float_writer->WriteBatch(1, nullptr, nullptr, &vfloat);
-                    }
-                    else {
-                        sf_errprintf("Low-level writer does not supprot missing values.\n");
-                        rc = 17042;
-                        goto exit;
-                        if ( z > SV_missval ) {
-                            ++warn_extended;
-                        }
-                    }
-                }
-            }
-            else if ( vtype == -5 ) {
-                double_writer = static_cast<parquet::DoubleWriter*>(rg_writer->NextColumn());
-                for (i = 0; i < N; i++) {
-                    if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                    // sf_printf_debug(2, "\t(double, %ld, %ld): %9.4f\n", j, i, z);
-                    if ( z < SV_missval ) {
-                        vdouble = (double) z;
-                        double_writer->WriteBatch(1, nullptr, nullptr, &vdouble);
-                    }
-                    else {
-                        sf_errprintf("Low-level writer does not supprot missing values.\n");
-                        rc = 17042;
-                        goto exit;
-                        if ( z > SV_missval ) {
-                            ++warn_extended;
-                        }
-                    }
-                }
-            }
-            else if ( vtype > 0 ) {
-                // TODO: At the moment, fixed-length are padded with " "
-                if ( fixedlen ) {
-                    flba_writer = static_cast<parquet::FixedLenByteArrayWriter*>(rg_writer->NextColumn());
-                    for (i = 0; i < N; i++) {
-                        // memset(vstr, ' ', vtype);
-                        if ( (rc = SF_sdata(j + 1, i + in1, vstr)) ) goto exit;
-                        vfixedlen.ptr = reinterpret_cast<const uint8_t*>(&vstr[0]);
-                        flba_writer->WriteBatch(1, nullptr, nullptr, &vfixedlen);
-                        memset(vstr, '\0', strbuffer);
-                    }
-                }
-                else {
-                    ba_writer = static_cast<parquet::ByteArrayWriter*>(rg_writer->NextColumn());
-                    for (i = 0; i < N; i++) {
-                        if ( (rc = SF_sdata(j + 1, i + in1, vstr)) ) goto exit;
-                        vbytearray.ptr = reinterpret_cast<const uint8_t*>(&vstr[0]);
-                        vbytearray.len = strlen(vstr);
-                        ba_writer->WriteBatch(1, &definition_level, nullptr, &vbytearray);
-                        memset(vstr, '\0', strbuffer);
-                    }
-                }
-            }
-            else {
-                sf_errprintf("Unsupported type.\n");
-                rc = 17100;
-                goto exit;
+parquet::schema::NodePtr sf_ll_write_node(
+    const std::string &vname,
+    int64_t vtype,
+    int64_t fixedlen,
+    int64_t *rowbytes)
+{
+    switch (vtype) {
+        case -1:
+            *rowbytes = 1;
+            return (PrimitiveNode::Make(vname, Repetition::OPTIONAL, Type::BOOLEAN, ConvertedType::NONE));
+        case -2:
+        case -3:
+            *rowbytes = 4;
+            return (PrimitiveNode::Make(vname, Repetition::OPTIONAL, Type::INT32, ConvertedType::NONE));
+        case -4:
+            *rowbytes = 4;
+            return (PrimitiveNode::Make(vname, Repetition::OPTIONAL, Type::FLOAT, ConvertedType::NONE));
+        case -5:
+            *rowbytes = 8;
+            return (PrimitiveNode::Make(vname, Repetition::OPTIONAL, Type::DOUBLE, ConvertedType::NONE));
+        default:
+            if ( vtype <= 0 ) break;
+            if ( fixedlen ) {
+                *rowbytes = vtype;
+                return (PrimitiveNode::Make(vname, Repetition::REQUIRED, Type::FIXED_LEN_BYTE_ARRAY, ConvertedType::NONE, vtype));
             }
-        }
-
-        if ( warn_extended > 0 ) {
-            sf_printf("Warning: %ld extended missing values coerced to NULL.\n", warn_extended);
-        }
-        sf_running_timer (&timer, "Wrote data from memory");
-    } catch (const std::exception& e) {
-        sf_errprintf("Parquet write error: %s\n", e.what());
-        return(-1);
+            *rowbytes = vtype + 4;
+            return (PrimitiveNode::Make(vname, Repetition::OPTIONAL, Type::BYTE_ARRAY, ConvertedType::NONE));
     }
+    *rowbytes = 0;
+    return (nullptr);
+}
 
-exit:
-    return (rc);
+// Write rows [from, to) of variable j + 1 into the next column of the
+// row group
+
+ST_retcode sf_ll_write_column(
+    parquet::RowGroupWriter *rg_writer,
+    sf_ll_write_batch *batch,
+    const sf_write_rows &rows,
+    const sf_write_labels &labels,
+    int64_t j,
+    int64_t vtype,
+    int64_t fixedlen,
+    int64_t from,
+    int64_t to)
+{
+    parquet::ColumnWriter *column_writer = rg_writer->NextColumn();
+    if ( labels.encode[j] ) {
+        return (sf_ll_write_labeled(column_writer, batch, rows, j, labels.text[j], from, to));
+    }
+    switch (vtype) {
+        case -1:
+            return (sf_ll_write_numeric<parquet::BooleanType>(column_writer, batch, rows, j, from, to));
+        case -2:
+        case -3:
+            return (sf_ll_write_numeric<parquet::Int32Type>(column_writer, batch, rows, j, from, to));
+        case -4:
+            return (sf_ll_write_numeric<parquet::FloatType>(column_writer, batch, rows, j, from, to));
+        case -5:
+            return (sf_ll_write_numeric<parquet::DoubleType>(column_writer, batch, rows, j, from, to));
+        default:
+            if ( fixedlen ) {
+                return (sf_ll_write_string<parquet::FLBAType>(column_writer, batch, rows, j, from, to));
+            }
+            return (sf_ll_write_string<parquet::ByteArrayType>(column_writer, batch, rows, j, from, to));
+    }
 }
 
-// Stata function: Low-level write full varlist with if condition
+// Stata function: Low-level write full varlist (with or without an if
+// condition)
 //
 // matrix
 //     __sparquet_coltypes
+//     __sparquet_colcodecs
 // scalars
 //     __sparquet_ncol
 //     __sparquet_fixedlen
+//     __sparquet_rg_size
+//     __sparquet_rg_bytes
 //     __sparquet_compression
-ST_retcode sf_ll_write_varlist_if(
+//     __sparquet_complevel
+//     __sparquet_encode
+//     __sparquet_dictmax
+ST_retcode sf_ll_write(
     const char *fname,
     const char *fcols,
+    const char *flabels,
     const int verbose,
     const int debug,
-    const int strbuffer)
+    const int strbuffer,
+    const bool useif)
 {
-
-    ST_double z;
     ST_retcode rc = 0, any_rc = 0;
-    SPARQUET_CHAR(vmatrix, 32);
-    SPARQUET_CHAR(vscalar, 32);
-    SPARQUET_CHAR(vstr, strbuffer);
-
-
-    int64_t in1 = SF_in1();
-    int64_t in2 = SF_in2();
-    int64_t N = in2 - in1 + 1;
-    int64_t vtype, i, j, compcode = 1, ncol = 1, fixedlen = 0;
-    int64_t warn_extended = 0;
-    int16_t definition_level = 1;
-    parquet::Compression::type compression;
+    int64_t j, r, ngroup, rgrows, ncol = 1, fixedlen = 0;
+    int64_t rg_size = 0, rg_bytes = 0, rowbytes = 0, colbytes;
+    sf_clock timer = sf_clock_now();
 
     std::string line;
     std::ifstream fstream;
-
-    bool vbool;
-    int32_t vint32;
-    float vfloat;
-    double vdouble;
-    parquet::ByteArray vbytearray;
-    parquet::FixedLenByteArray vfixedlen;
-
-    parquet::BoolWriter* bool_writer;
-    parquet::Int32Writer* int32_writer;
-    parquet::FloatWriter* float_writer;
-    parquet::DoubleWriter* double_writer;
-    parquet::ByteArrayWriter* ba_writer;
-    parquet::FixedLenByteArrayWriter* flba_writer;
+    sf_write_rows rows;
+    sf_write_labels labels;
+    sf_ll_write_batch batch;
 
     // Get column and type info from Stata
     // -----------------------------------
 
-    if ( (rc = sf_scalar_int("__sparquet_fixedlen",    19, &fixedlen))) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_ncol",        15, &ncol))    ) any_rc = rc;
-    if ( (rc = sf_scalar_int("__sparquet_compression", 22, &compcode))) any_rc = rc;
-
-    switch (compcode) {
-        case 0:
-            compression = parquet::Compression::UNCOMPRESSED;
-        case 1:
-            compression = parquet::Compression::SNAPPY;
-        case 2:
-            compression = parquet::Compression::GZIP;
-        case 3:
-            compression = parquet::Compression::LZO;
-        case 4:
-            compression = parquet::Compression::BROTLI;
-        case 5:
-            compression = parquet::Compression::LZ4;
-        case 6:
-            compression = parquet::Compression::ZSTD;
-        default:
-            compression = parquet::Compression::SNAPPY;
-    }
+    if ( (rc = sf_scalar_int("__sparquet_fixedlen", 19, &fixedlen)) ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_ncol",     15, &ncol))     ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_rg_size",  18, &rg_size))  ) any_rc = rc;
+    if ( (rc = sf_scalar_int("__sparquet_rg_bytes", 19, &rg_bytes)) ) any_rc = rc;
 
     sf_printf_debug(debug, "# columns: %ld\n", ncol);
 
     int64_t vtypes[ncol];
     std::string vnames[ncol];
 
-    std::vector<std::shared_ptr<arrow::Field>> vfields(ncol);
-    std::vector<std::shared_ptr<arrow::Array>> varrays(ncol);
-
     if ( (rc = sf_matrix_int("__sparquet_coltypes", 19, ncol, vtypes)) ) any_rc = rc;
 
-    // Get variable names
-    // ------------------
-
     if ( any_rc ) {
         rc = any_rc;
         goto exit;
     }
 
-    if ( N == 0 ) {
+    // Rows to write
+    // -------------
+
+    sf_write_rows_init(&rows, useif);
+
+    if ( rows.nrows == 0 ) {
         sf_errprintf("No observations\n");
         rc = 2000;
         goto exit;
     }
 
+    // Get variable names
+    // ------------------
+
     j = 0;
     fstream.open(fcols);
     if ( fstream.is_open() ) {
@@ -474,6 +317,8 @@ ST_retcode sf_ll_write_varlist_if(
         return(601);
     }
 
+    if ( (rc = sf_write_labels_read(flabels, ncol, &labels)) ) goto exit;
+
     // Write columns to file
     // ---------------------
 
@@ -485,255 +330,58 @@ ST_retcode sf_ll_write_varlist_if(
         std::shared_ptr<parquet::ParquetFileWriter> file_writer;
         parquet::WriterProperties::Builder builder;
         parquet::schema::NodeVector fields;
+        parquet::RowGroupWriter *rg_writer;
 
-        // Get fields
-        // ----------
-
-        // TODO: Logical type is basically format?
-        // TODO: Logical type vs Converted type?
         for (j = 0; j < ncol; j++) {
-            vtype = vtypes[j];
-            if ( vtype == -1 ) {
-                fields.push_back(
-                    PrimitiveNode::Make(
-                        vnames[j].c_str(),
-                        Repetition::REQUIRED,
-                        Type::BOOLEAN,
-                        ConvertedType::NONE
-                    )
-                );
-            }
-            else if ( vtype == -2 ) {
-                fields.push_back(
-                    PrimitiveNode::Make(
-                        vnames[j].c_str(),
-                        Repetition::REQUIRED,
-                        Type::INT32,
-                        ConvertedType::NONE
-                    )
-                );
-            }
-            else if ( vtype == -3 ) {
-                fields.push_back(
-                    PrimitiveNode::Make(
-                        vnames[j].c_str(),
-                        Repetition::REQUIRED,
-                        Type::INT32,
-                        ConvertedType::NONE
-                    )
-                );
-            }
-            else if ( vtype == -4 ) {
-                fields.push_back(
-                    PrimitiveNode::Make(
-                        vnames[j].c_str(),
-                        Repetition::REQUIRED,
-                        Type::FLOAT,
-                        ConvertedType::NONE
-                    )
-                );
-            }
-            else if ( vtype == -5 ) {
-                fields.push_back(
-                    PrimitiveNode::Make(
-                        vnames[j].c_str(),
-                        Repetition::REQUIRED,
-                        Type::DOUBLE,
-                        ConvertedType::NONE
-                    )
-                );
-            }
-            else if ( vtype > 0 ) {
-                if ( fixedlen ) {
-                    fields.push_back(
-                        PrimitiveNode::Make(
-                            vnames[j].c_str(),
-                            Repetition::REQUIRED,
-                            Type::FIXED_LEN_BYTE_ARRAY,
-                            ConvertedType::NONE,
-                            vtype
-                        )
-                    );
-                }
-                else {
-                    fields.push_back(
-                        PrimitiveNode::Make(
-                            vnames[j].c_str(),
-                            Repetition::OPTIONAL,
-                            Type::BYTE_ARRAY,
-                            ConvertedType::NONE
-                        )
-                    );
-                }
+            if ( labels.encode[j] ) {
+                colbytes = labels.maxlen[j] + 4;
+                fields.push_back(PrimitiveNode::Make(vnames[j], Repetition::OPTIONAL, Type::BYTE_ARRAY, ConvertedType::NONE));
             }
             else {
+                fields.push_back(sf_ll_write_node(vnames[j], vtypes[j], fixedlen, &colbytes));
+            }
+            if ( colbytes == 0 ) {
                 sf_errprintf("Unsupported type.\n");
                 rc = 17100;
                 goto exit;
             }
+            rowbytes += colbytes;
         }
 
-        // Write to file
-        // -------------
+        // Rows per row group from the row and byte targets
+        rgrows = rg_size > 0? rg_size: rows.nrows;
+        if ( rg_bytes > 0 ) rgrows = std::min(rgrows, std::max(rg_bytes / rowbytes, (int64_t) 1));
+        ngroup = (rows.nrows + rgrows - 1) / rgrows;
+        sf_printf_debug(verbose, "\t%ld row groups of up to %ld rows\n", ngroup, rgrows);
 
         PARQUET_THROW_NOT_OK(FileClass::Open(fname, &out_file));
         schema = std::static_pointer_cast<GroupNode>(
             GroupNode::Make("schema", Repetition::REQUIRED, fields)
         );
 
-        builder.compression(compression);
+        if ( (rc = sf_write_compression(builder, vnames, ncol, debug)) ) goto exit;
+        if ( (rc = sf_write_dictionary(builder, vnames, vtypes, labels, rows, ncol, strbuffer, verbose)) ) goto exit;
         props = builder.build();
 
         file_writer = parquet::ParquetFileWriter::Open(out_file, schema, props);
-        parquet::RowGroupWriter* rg_writer = file_writer->AppendRowGroup(N);
-
-        clock_t timer = clock();
-        for (j = 0; j < ncol; j++) {
-            vtype = vtypes[j];
-            // TODO: Boolean is only 0/1; keep? Or always int32?
-            if ( vtype == -1 ) {
-                bool_writer = static_cast<parquet::BoolWriter*>(rg_writer->NextColumn());
-                for (i = 0; i < N; i++) {
-                    if ( SF_ifobs(i + in1) ) {
-                        if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                        // sf_printf_debug(2, "\t(bool, %ld, %ld): %9.4f\n", j, i, z);
-                        if ( z < SV_missval ) {
-                            vbool = (bool) z;
-                            bool_writer->WriteBatch(1, nullptr, nullptr, &vbool);
-                        }
-                        else {
-                            sf_errprintf("Low-level writer does not supprot missing values.\n");
-                            rc = 17042;
-                            goto exit;
-                            if ( z > SV_missval ) {
-                                ++warn_extended;
-                            }
-                        }
-                    }
-                }
-            }
-            else if ( vtype == -2 ) {
-                int32_writer = static_cast<parquet::Int32Writer*>(rg_writer->NextColumn());
-                for (i = 0; i < N; i++) {
-                    if ( SF_ifobs(i + in1) ) {
-                        if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                        // sf_printf_debug(2, "\t(int, %ld, %ld): %9.4f\n", j, i, z);
-                        if ( z < SV_missval ) {
-                            vint32 = (int32_t) z;
-                            int32_writer->WriteBatch(1, nullptr, nullptr, &vint32);
-                        }
-                        else {
-                            sf_errprintf("Low-level writer does not supprot missing values.\n");
-                            rc = 17042;
-                            goto exit;
-                            if ( z > SV_missval ) {
-                                ++warn_extended;
-                            }
-                        }
-                    }
-                }
-            }
-            else if ( vtype == -3 ) {
-                int32_writer = static_cast<parquet::Int32Writer*>(rg_writer->NextColumn());
-                for (i = 0; i < N; i++) {
-                    if ( SF_ifobs(i + in1) ) {
-                        if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                        // sf_printf_debug(2, "\t(long, %ld, %ld): %9.4f\n", j, i, z);
-                        if ( z < SV_missval ) {
-                            vint32 = (int32_t) z;
-                            int32_writer->WriteBatch(1, nullptr, nullptr, &vint32);
-                        }
-                        else {
-                            sf_errprintf("Low-level writer does not supprot missing values.\n");
-                            rc = 17042;
-                            goto exit;
-                            if ( z > SV_missval ) {
-                                ++warn_extended;
-                            }
-                        }
-                    }
-                }
-            }
-            else if ( vtype == -4 ) {
-                float_writer = static_cast<parquet::FloatWriter*>(rg_writer->NextColumn());
-                for (i = 0; i < N; i++) {
-                    if ( SF_ifobs(i + in1) ) {
-                        if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                        // sf_printf_debug(2, "\t(float, %ld, %ld): %9.4f\n", j, i, z);
-                        if ( z < SV_missval ) {
-                            vfloat = (float) z;
-                            float_writer->WriteBatch(1, nullptr, nullptr, &vfloat);
-                        }
-                        else {
-                            sf_errprintf("Low-level writer does not supprot missing values.\n");
-                            rc = 17042;
-                            goto exit;
-                            if ( z > SV_missval ) {
-                                ++warn_extended;
-                            }
-                        }
-                    }
-                }
-            }
-            else if ( vtype == -5 ) {
-                double_writer = static_cast<parquet::DoubleWriter*>(rg_writer->NextColumn());
-                for (i = 0; i < N; i++) {
-                    if ( SF_ifobs(i + in1) ) {
-                        if ( (rc = SF_vdata(j + 1, i + in1, &z)) ) goto exit;
-                        // sf_printf_debug(2, "\t(double, %ld, %ld): %9.4f\n", j, i, z);
-                        if ( z < SV_missval ) {
-                            vdouble = (double) z;
-                            double_writer->WriteBatch(1, nullptr, nullptr, &vdouble);
-                        }
-                        else {
-                            sf_errprintf("Low-level writer does not supprot missing values.\n");
-                            rc = 17042;
-                            goto exit;
-                            if ( z > SV_missval ) {
-                                ++warn_extended;
-                            }
-                        }
-                    }
-                }
-            }
-            else if ( vtype > 0 ) {
-                // TODO: At the moment, fixed-length are padded with " "
-                if ( fixedlen ) {
-                    flba_writer = static_cast<parquet::FixedLenByteArrayWriter*>(rg_writer->NextColumn());
-                    for (i = 0; i < N; i++) {
-                        if ( SF_ifobs(i + in1) ) {
-                            // memset(vstr, ' ', vtype);
-                            if ( (rc = SF_sdata(j + 1, i + in1, vstr)) ) goto exit;
-                            vfixedlen.ptr = reinterpret_cast<const uint8_t*>(&vstr[0]);
-                            flba_writer->WriteBatch(1, nullptr, nullptr, &vfixedlen);
-                            memset(vstr, '\0', strbuffer);
-                        }
-                    }
-                }
-                else {
-                    ba_writer = static_cast<parquet::ByteArrayWriter*>(rg_writer->NextColumn());
-                    for (i = 0; i < N; i++) {
-                        if ( SF_ifobs(i + in1) ) {
-                            if ( (rc = SF_sdata(j + 1, i + in1, vstr)) ) goto exit;
-                            vbytearray.ptr = reinterpret_cast<const uint8_t*>(&vstr[0]);
-                            vbytearray.len = strlen(vstr);
-                            ba_writer->WriteBatch(1, &definition_level, nullptr, &vbytearray);
-                            memset(vstr, '\0', strbuffer);
-                        }
-                    }
-                }
-            }
-            else {
-                sf_errprintf("Unsupported type.\n");
-                rc = 17100;
-                goto exit;
+        sf_ll_write_batch_init(&batch, std::max(strbuffer, SPARQUET_NUMTEXT));
+        for (r = 0; r < ngroup; r++) {
+            rg_writer = file_writer->AppendRowGroup();
+            for (j = 0; j < ncol; j++) {
+                rc = sf_ll_write_column(rg_writer, &batch, rows, labels, j, vtypes[j], fixedlen,
+                                        r * rgrows, std::min((r + 1) * rgrows, rows.nrows));
+                if ( rc ) goto exit;
             }
         }
 
-        if ( warn_extended > 0 ) {
-            sf_printf("Warning: %ld extended missing values coerced to NULL.\n", warn_extended);
+        file_writer->Close();
+        PARQUET_THROW_NOT_OK(out_file->Close());
+
+        if ( batch.warn_extended > 0 ) {
+            sf_printf("Warning: %ld extended missing values coerced to NULL.\n", batch.warn_extended);
         }
         sf_running_timer (&timer, "Wrote data from memory");
+        if ( verbose ) sf_write_summary(fname);
     } catch (const std::exception& e) {
         sf_errprintf("Parquet write error: %s\n", e.what());
         return(-1);
@@ -742,3 +390,25 @@ ST_retcode sf_ll_write_varlist_if(
 exit:
     return (rc);
 }
+
+ST_retcode sf_ll_write_varlist(
+    const char *fname,
+    const char *fcols,
+    const char *flabels,
+    const int verbose,
+    const int debug,
+    const int strbuffer)
+{
+    return (sf_ll_write(fname, fcols, flabels, verbose, debug, strbuffer, false));
+}
+
+ST_retcode sf_ll_write_varlist_if(
+    const char *fname,
+    const char *fcols,
+    const char *flabels,
+    const int verbose,
+    const int debug,
+    const int strbuffer)
+{
+    return (sf_ll_write(fname, fcols, flabels, verbose, debug, strbuffer, true));
+}
@@ -0,0 +1,303 @@
+// Writer properties
+// -----------------
+//
+// Both writers build their WriterProperties here. parquet write passes
+// the default codec in a scalar and a codec for each column in
+// __sparquet_colcodecs (the default for columns not in colcompression()).
+// Codes are those of parquet.ado: 0 uncompressed, 1 snappy, 2 gzip,
+// 3 lzo, 4 brotli, 5 lz4, 6 zstd. Parquet 1.5 compresses at each codec's
+// fixed level.
+//
+// The rows to write, the progress messages and dictionary encoding,
+// shared by the writers, are also handled here.
+
+parquet::Compression::type sf_write_codec(int64_t code)
+{
+    switch (code) {
+        case 0:  return (parquet::Compression::UNCOMPRESSED);
+        case 1:  return (parquet::Compression::SNAPPY);
+        case 2:  return (parquet::Compression::GZIP);
+        case 3:  return (parquet::Compression::LZO);
+        case 4:  return (parquet::Compression::BROTLI);
+        case 5:  return (parquet::Compression::LZ4);
+        case 6:  return (parquet::Compression::ZSTD);
+        default: return (parquet::Compression::SNAPPY);
+    }
+}
+
+const char *sf_write_codec_name(parquet::Compression::type codec)
+{
+    switch (codec) {
+        case parquet::Compression::UNCOMPRESSED: return ("uncompressed");
+        case parquet::Compression::SNAPPY:       return ("snappy");
+        case parquet::Compression::GZIP:         return ("gzip");
+        case parquet::Compression::LZO:          return ("lzo");
+        case parquet::Compression::BROTLI:       return ("brotli");
+        case parquet::Compression::LZ4:          return ("lz4");
+        case parquet::Compression::ZSTD:         return ("zstd");
+        default:                                 return ("other");
+    }
+}
+
+// Set the default and per-column codecs on builder
+
+ST_retcode sf_write_compression(
+    parquet::WriterProperties::Builder &builder,
+    const std::string *vnames,
+    int64_t ncol,
+    const int debug)
+{
+    ST_retcode rc = 0;
+    int64_t j, code = 1;
+    int64_t codes[ncol];
+
+    if ( (rc = sf_scalar_int("__sparquet_compression", 22, &code))  ) return (rc);
+    if ( (rc = sf_matrix_int("__sparquet_colcodecs",   20, ncol, codes)) ) return (rc);
+
+    builder.compression(sf_write_codec(code));
+    for (j = 0; j < ncol; j++) {
+        if ( codes[j] == code ) continue;
+        sf_printf_debug(debug, "\t%s: %s\n",
+                        vnames[j].c_str(), sf_write_codec_name(sf_write_codec(codes[j])));
+        builder.compression(vnames[j], sf_write_codec(codes[j]));
+    }
+
+    return (rc);
+}
+
+// Summary of a file just written: codec and compressed and uncompressed
+// bytes of each column, over all row groups, from the file's footer.
+
+void sf_write_summary(const char *fname)
+{
+    int64_t r, j, ncol, csize, usize, ctot = 0, utot = 0;
+    std::unique_ptr<parquet::ParquetFileReader> parquet_reader =
+        parquet::ParquetFileReader::OpenFile(fname, false);
+    std::shared_ptr<parquet::FileMetaData> file_metadata = parquet_reader->metadata();
+    std::unique_ptr<parquet::ColumnChunkMetaData> cc_metadata;
+
+    ncol = file_metadata->num_columns();
+    sf_printf("\t%ld row groups\n", (int64_t) file_metadata->num_row_groups());
+    sf_printf("\t%-32s %-12s %14s %14s\n", "column", "codec", "bytes", "uncompressed");
+    for (j = 0; j < ncol; j++) {
+        csize = usize = 0;
+        for (r = 0; r < file_metadata->num_row_groups(); r++) {
+            cc_metadata = file_metadata->RowGroup(r)->ColumnChunk(j);
+            csize += cc_metadata->total_compressed_size();
+            usize += cc_metadata->total_uncompressed_size();
+        }
+        ctot += csize;
+        utot += usize;
+        sf_printf("\t%-32s %-12s %14ld %14ld\n",
+                  file_metadata->schema()->Column(j)->name().c_str(),
+                  file_metadata->num_row_groups()?
+                      sf_write_codec_name(file_metadata->RowGroup(0)->ColumnChunk(j)->compression()): "",
+                  csize, usize);
+    }
+    sf_printf("\t%-32s %-12s %14ld %14ld\n", "total", "", ctot, utot);
+}
+
+// Rows being written: observations in1 to in2 or, with an if
+// condition, those of them that satisfy it.
+
+struct sf_write_rows {
+    int64_t in1;
+    int64_t nrows;
+    bool useif;
+    std::vector<int64_t> obs;
+};
+
+void sf_write_rows_init(sf_write_rows *rows, bool useif)
+{
+    int64_t i, in1 = SF_in1(), in2 = SF_in2();
+
+    rows->in1   = in1;
+    rows->useif = useif;
+    rows->obs.clear();
+    if ( useif ) {
+        for (i = in1; i <= in2; i++) {
+            if ( SF_ifobs(i) ) rows->obs.push_back(i);
+        }
+        rows->nrows = rows->obs.size();
+    }
+    else {
+        rows->nrows = in2 - in1 + 1;
+    }
+}
+
+inline int64_t sf_write_obs(const sf_write_rows &rows, int64_t i)
+{
+    return (rows.useif? rows.obs[i]: rows.in1 + i);
+}
+
+// Progress while copying data from Stata
+
+struct sf_write_progress {
+    sf_clock timer;
+    sf_clock stimer;
+    ST_double every;  // seconds between progress messages
+    int64_t check;    // rows between checks of the timer
+    int64_t done;
+    int64_t total;
+    int64_t ncol;
+    int64_t nrows;
+};
+
+inline void sf_write_progress_check(sf_write_progress *progress, int64_t j, int64_t i)
+{
+    if ( i % progress->check == 0 ) {
+        progress->done += progress->check;
+        sf_running_progress_write(
+            &progress->timer,
+            &progress->stimer,
+            progress->every,
+            j + 1, progress->ncol,
+            i + 1, progress->nrows,
+            100 * progress->done / progress->total
+        );
+    }
+}
+
+// Dictionary encoding
+// -------------------
+//
+// With encode, parquet write passes the value labels of the labeled
+// numeric variables in a file: for each, a line with the Stata
+// variable index and the number of labels, then per label a "value
+// length" line and the label text, which can contain newlines. Those
+// variables are written as strings of their label text (unlabeled
+// values as the number, missing values as nulls), so Parquet stores
+// each label once in the column's dictionary.
+//
+// String variables get one hash pass counting their distinct values,
+// which stops once there are more than __sparquet_dictmax. Those over
+// the limit are written plain instead of building a dictionary that
+// would be dropped once it outgrew the dictionary page.
+
+#define SPARQUET_NUMTEXT 32  // bytes for the text of an unlabeled value
+
+struct sf_write_labels {
+    std::vector<char> encode;
+    std::vector<std::unordered_map<ST_double, std::string>> text;
+    std::vector<int64_t> maxlen;
+};
+
+ST_retcode sf_write_labels_read(const char *flabels, int64_t ncol, sf_write_labels *labels)
+{
+    int64_t j, k, n, len;
+    ST_double value;
+    char *end;
+    std::string line;
+    std::ifstream fstream;
+
+    labels->encode.assign(ncol, 0);
+    labels->text.assign(ncol, std::unordered_map<ST_double, std::string>());
+    labels->maxlen.assign(ncol, 0);
+    if ( flabels[0] == '\0' ) return (0);
+
+    fstream.open(flabels, std::ios::binary);
+    if ( !fstream.is_open() ) {
+        sf_errprintf("Unable to read file '%s'\n", flabels);
+        return (601);
+    }
+    while ( std::getline(fstream, line) ) {
+        if ( sscanf(line.c_str(), "%ld %ld", &j, &n) != 2 || j < 1 || j > ncol ) {
+            sf_errprintf("Unable to parse value labels in '%s'\n", flabels);
+            return (198);
+        }
+        labels->encode[--j] = 1;
+        labels->maxlen[j] = SPARQUET_NUMTEXT;
+        for (k = 0; k < n && std::getline(fstream, line); k++) {
+            value = strtod(line.c_str(), &end);
+            len   = strtol(end, &end, 10);
+            std::string &text = labels->text[j][value];
+            text.resize(len > 0? len: 0);
+            if ( !fstream.read(&text[0], text.size()) ) {
+                sf_errprintf("Unable to parse value labels in '%s'\n", flabels);
+                return (198);
+            }
+            fstream.ignore(1);
+            labels->maxlen[j] = std::max(labels->maxlen[j], (int64_t) text.size());
+        }
+    }
+    fstream.close();
+
+    return (0);
+}
+
+// Text for value z of an encoded variable: its label or, in buf (of
+// SPARQUET_NUMTEXT bytes), the number; false for missing values.
+
+inline bool sf_write_label(
+    const std::unordered_map<ST_double, std::string> &text,
+    ST_double z,
+    char *buf,
+    const char **ptr,
+    int64_t *len)
+{
+    if ( z >= SV_missval ) return (false);
+    auto label = text.find(z);
+    if ( label != text.end() ) {
+        *ptr = label->second.c_str();
+        *len = label->second.size();
+    }
+    else {
+        *len = snprintf(buf, SPARQUET_NUMTEXT, "%.15g", z);
+        *ptr = buf;
+    }
+    return (true);
+}
+
+// Number of distinct values of string variable j + 1, counting up to
+// one past maxcard
+
+int64_t sf_write_cardinality(const sf_write_rows &rows, int64_t j, int64_t maxcard, char *vstr)
+{
+    int64_t i;
+    std::unordered_set<std::string> seen;
+
+    for (i = 0; i < rows.nrows && (int64_t) seen.size() <= maxcard; i++) {
+        if ( SF_sdata(j + 1, sf_write_obs(rows, i), vstr) ) break;
+        seen.emplace(vstr);
+    }
+    return (seen.size());
+}
+
+// Turn dictionary encoding off for high-cardinality strings (encode
+// only; otherwise every column keeps Parquet's default)
+
+ST_retcode sf_write_dictionary(
+    parquet::WriterProperties::Builder &builder,
+    const std::string *vnames,
+    const int64_t *vtypes,
+    const sf_write_labels &labels,
+    const sf_write_rows &rows,
+    int64_t ncol,
+    int64_t strbuffer,
+    const int verbose)
+{
+    ST_retcode rc = 0;
+    int64_t j, encode = 0, dictmax = 0;
+    std::vector<char> vstr(strbuffer + 1, '\0');
+
+    if ( (rc = sf_scalar_int("__sparquet_encode",  17, &encode))  ) return (rc);
+    if ( (rc = sf_scalar_int("__sparquet_dictmax", 18, &dictmax)) ) return (rc);
+    if ( !encode ) return (rc);
+
+    for (j = 0; j < ncol; j++) {
+        if ( labels.encode[j] ) {
+            sf_printf_debug(verbose, "\t%s: value labels\n", vnames[j].c_str());
+        }
+        else if ( vtypes[j] > 0 ) {
+            if ( sf_write_cardinality(rows, j, dictmax, vstr.data()) > dictmax ) {
+                sf_printf_debug(verbose, "\t%s: over %ld distinct values, plain\n", vnames[j].c_str(), dictmax);
+                builder.disable_dictionary(vnames[j]);
+            }
+            else {
+                sf_printf_debug(verbose, "\t%s: dictionary\n", vnames[j].c_str());
+            }
+        }
+    }
+
+    return (rc);
+}
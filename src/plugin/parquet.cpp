@@ -25,27 +25,50 @@
 #include <array>
 
 #include <cassert>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 #include <list>
 #include <memory>
 #include <locale>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <sys/stat.h>
 
 #define DEBUG     0
 #define VERBOSE   1
 
 #include "reader_writer.h"
 #include "parquet.h"
+#include "parquet-session.cpp"
+#include "parquet-utils-strscan.cpp"
+#include "parquet-utils-convert.cpp"
+#include "parquet-utils-cache.cpp"
 #include "parquet-utils.cpp"
 #include "parquet-utils-multi.cpp"
+#include "parquet-filter.cpp"
+#include "parquet-io.cpp"
+#include "parquet-reader-ll-batch.cpp"
+#include "parquet-reader-ll-select.cpp"
+#include "parquet-reader-ll-threads.cpp"
 #include "parquet-reader-ll.cpp"
+#include "parquet-reader-hl-batch.cpp"
 #include "parquet-reader-hl.cpp"
+#include "parquet-writer-props.cpp"
 #include "parquet-writer-ll.cpp"
+#include "parquet-writer-hl-threads.cpp"
 #include "parquet-writer-hl.cpp"
 #include "parquet-reader-ll-multi.cpp"
 
 // Syntax
-//     plugin call parquet varlist [if] [in], todo file.parquet [file.colnames]
+//     plugin call parquet varlist [if] [in], todo file.parquet [file.colnames|file.filter|file.select] [file.labels]
+//     plugin call parquet, select file.parquet file.filter file.select
 //
 // Scalars
 // 
@@ -61,6 +84,11 @@
 //     __sparquet_verbose
 //     __sparquet_if
 //     __sparquet_compression
+//     __sparquet_filter
+//     __sparquet_nselect
+//     __sparquet_exact
+//     __sparquet_encode
+//     __sparquet_session
 //
 // Matrices
 //
@@ -70,7 +98,7 @@
 STDLL stata_call(int argc, char *argv[])
 {
     ST_retcode rc = 0;
-    int64_t flength, strbuffer, lowlevel, multi, verbose, ifobs;
+    int64_t flength, strbuffer, lowlevel, multi, verbose, ifobs, session;
 
     SPARQUET_CHAR(todo, 16);
     strcpy (todo, argv[0]);
@@ -85,18 +113,18 @@ STDLL stata_call(int argc, char *argv[])
      *     - check:     Exit with 0 status. This just tests the plugin can be *
      *                  called from Stata without crashing.                   *
      *     - version:   Print plugin version                                  *
+     *     - close:     Close the read session                                *
      *                                                                        *
      *     - shape:     (read) Number of rows and columns                     *
-     *     - colnames:  (read) Put column names into file                     *
+     *     - colnames:  (read) Put column names into a local macro            *
      *     - coltypes:  (read) Put column types into matrix                   *
+     *     - select:    (read) Rows to read given in range and if condition   *
      *     - read:      Read parquet file into Stata                          *
      *                                                                        *
      *     - write:     Write Stata varlist to parquet file                   *
      *                                                                        *
      **************************************************************************/
 
-    // We write column names to a temporary file and read it back to Stata
-
     sf_printf_debug(DEBUG, "Stata Parquet Debug: '%s' '%s'\n", todo, fname);
     if ( strcmp(todo, "check") == 0 ) {
         goto exit;
@@ -105,6 +133,21 @@ STDLL stata_call(int argc, char *argv[])
         sf_printf("(note: parquet_plugin v%s successfully loaded)\n", SPARQUET_VERSION);
         goto exit;
     }
+    else if ( strcmp(todo, "close") == 0 ) {
+        sf_session_close();
+        goto exit;
+    }
+
+    // A handle of -1 asks for a new read session; the handle is passed
+    // back so later calls reuse the metadata parsed in this one.
+    if ( sf_scalar_int("__sparquet_session", 18, &session) ) session = 0;
+    if ( session < 0 ) {
+        SPARQUET_CHAR(vscalar, 32);
+        memcpy(vscalar, "__sparquet_session", 18);
+        session = sf_session_open();
+        if ( (rc = SF_scal_save(vscalar, (ST_double) session)) ) goto exit;
+    }
+    sf_session_use(session);
 
     if ( (rc = sf_scalar_int("__sparquet_strbuffer", 20, &strbuffer)) ) goto exit;
     if ( (rc = sf_scalar_int("__sparquet_lowlevel",  20, &lowlevel))  ) goto exit;
@@ -123,36 +166,63 @@ STDLL stata_call(int argc, char *argv[])
         }
     }
     else if ( strcmp(todo, "colnames") == 0 ) {
-        flength = strlen(argv[2]) + 1;
-        SPARQUET_CHAR (fcols, flength);
-        strcpy (fcols, argv[2]);
         if ( multi ) {
-            if ( (rc = sf_ll_colnames_multi(fname, fcols, DEBUG)) ) goto exit;
+            if ( (rc = sf_ll_colnames_multi(fname, DEBUG)) ) goto exit;
         }
         else {
-            if ( (rc = sf_ll_colnames(fname, fcols, DEBUG)) ) goto exit;
+            if ( (rc = sf_ll_colnames(fname, DEBUG)) ) goto exit;
         }
     }
     else if ( strcmp(todo, "coltypes") == 0 ) {
+        // Optional type cache directory
+        flength = argc > 2? strlen(argv[2]) + 1: 1;
+        SPARQUET_CHAR (fcache, flength);
+        if ( argc > 2 ) strcpy (fcache, argv[2]);
+
         // TODO: How to discern string from binary in ByteArray?
         if ( multi ) {
-            if ( (rc = sf_ll_coltypes_multi(fname, strbuffer, DEBUG)) ) goto exit;
+            if ( (rc = sf_ll_coltypes_multi(fname, fcache, strbuffer, DEBUG)) ) goto exit;
         }
         else {
-            if ( (rc = sf_ll_coltypes(fname, strbuffer, DEBUG)) ) goto exit;
+            if ( (rc = sf_ll_coltypes(fname, fcache, strbuffer, DEBUG)) ) goto exit;
+        }
+    }
+    else if ( strcmp(todo, "select") == 0 ) {
+        flength = strlen(argv[2]) + 1;
+        SPARQUET_CHAR (ffilter, flength);
+        strcpy (ffilter, argv[2]);
+
+        flength = strlen(argv[3]) + 1;
+        SPARQUET_CHAR (fselect, flength);
+        strcpy (fselect, argv[3]);
+        if ( multi ) {
+            if ( (rc = sf_ll_select_varlist_multi(fname, ffilter, fselect, verbose, DEBUG)) ) goto exit;
+        }
+        else {
+            if ( (rc = sf_ll_select_varlist(fname, ffilter, fselect, verbose, DEBUG)) ) goto exit;
         }
     }
     else if ( strcmp(todo, "read") == 0 ) {
+        // Optional file with the if condition to prune row groups
+        // (high-level) or with the rows to read (low-level)
+        flength = argc > 2? strlen(argv[2]) + 1: 1;
+        SPARQUET_CHAR (ffilter, flength);
+        if ( argc > 2 ) strcpy (ffilter, argv[2]);
+
+        // Optional file to write value labels to (encode)
+        flength = argc > 3? strlen(argv[3]) + 1: 1;
+        SPARQUET_CHAR (flabels, flength);
+        if ( argc > 3 ) strcpy (flabels, argv[3]);
         if ( lowlevel ) {
             if ( multi ) {
-                if ( (rc = sf_ll_read_varlist_multi(fname, verbose, DEBUG, strbuffer)) ) goto exit;
+                if ( (rc = sf_ll_read_varlist_multi(fname, ffilter, flabels, verbose, DEBUG, strbuffer)) ) goto exit;
             }
             else {
-                if ( (rc = sf_ll_read_varlist(fname, verbose, DEBUG, strbuffer)) ) goto exit;
+                if ( (rc = sf_ll_read_varlist(fname, ffilter, flabels, verbose, DEBUG, strbuffer)) ) goto exit;
             }
         }
         else {
-            if ( (rc = sf_hl_read_varlist(fname, verbose, DEBUG, strbuffer)) ) goto exit;
+            if ( (rc = sf_hl_read_varlist(fname, ffilter, verbose, DEBUG, strbuffer)) ) goto exit;
         }
     }
     else if ( strcmp(todo, "write") == 0 ) {
@@ -160,20 +230,25 @@ STDLL stata_call(int argc, char *argv[])
         flength = strlen(argv[2]) + 1;
         SPARQUET_CHAR (fcols, flength);
         strcpy (fcols, argv[2]);
+
+        // Optional file with the value labels to write (encode)
+        flength = argc > 3? strlen(argv[3]) + 1: 1;
+        SPARQUET_CHAR (flabels, flength);
+        if ( argc > 3 ) strcpy (flabels, argv[3]);
         if ( ifobs ) {
             if ( lowlevel ) {
-                if ( (rc = sf_ll_write_varlist_if(fname, fcols, verbose, DEBUG, strbuffer)) ) goto exit;
+                if ( (rc = sf_ll_write_varlist_if(fname, fcols, flabels, verbose, DEBUG, strbuffer)) ) goto exit;
             }
             else {
-                if ( (rc = sf_hl_write_varlist_if(fname, fcols, verbose, DEBUG, strbuffer)) ) goto exit;
+                if ( (rc = sf_hl_write_varlist_if(fname, fcols, flabels, verbose, DEBUG, strbuffer)) ) goto exit;
             }
         }
         else {
             if ( lowlevel ) {
-                if ( (rc = sf_ll_write_varlist(fname, fcols, verbose, DEBUG, strbuffer)) ) goto exit;
+                if ( (rc = sf_ll_write_varlist(fname, fcols, flabels, verbose, DEBUG, strbuffer)) ) goto exit;
             }
             else {
-                if ( (rc = sf_hl_write_varlist(fname, fcols, verbose, DEBUG, strbuffer)) ) goto exit;
+                if ( (rc = sf_hl_write_varlist(fname, fcols, flabels, verbose, DEBUG, strbuffer)) ) goto exit;
             }
         }
     }
@@ -1,4 +1,6 @@
 #define BUF_MAX 4096
+#define SPARQUET_BATCH 16384
+#define SPARQUET_COLSEP '\x1f'
 #define SPARQUET_VERSION "0.6.5"
 
 #include <stdlib.h>
@@ -37,12 +39,26 @@ void sf_errprintf (const char *fmt, ...)
     va_end (args);
 }
 
-void sf_running_timer (clock_t *timer, const char *msg)
+// Timers are wall-clock; clock() would add up CPU time over threads
+
+typedef std::chrono::steady_clock::time_point sf_clock;
+
+inline sf_clock sf_clock_now ()
+{
+    return (std::chrono::steady_clock::now());
+}
+
+inline double sf_clock_diff (sf_clock since)
+{
+    return (std::chrono::duration<double>(sf_clock_now() - since).count());
+}
+
+void sf_running_timer (sf_clock *timer, const char *msg)
 {
-    double diff  = (double) (clock() - *timer) / CLOCKS_PER_SEC;
+    double diff  = sf_clock_diff(*timer);
     sf_printf (msg);
     sf_printf (" (%.2f sec).\n", diff);
-    *timer = clock();
+    *timer = sf_clock_now();
 }
 
 std::ifstream::pos_type filesize(const char* filename)
@@ -52,8 +68,8 @@ std::ifstream::pos_type filesize(const char* filename)
 }
 
 void sf_running_progress_read (
-    clock_t *timer,
-    clock_t *stimer,
+    sf_clock *timer,
+    sf_clock *stimer,
     ST_double progress,
     int64_t r,
     int64_t nrow_groups,
@@ -63,21 +79,21 @@ void sf_running_progress_read (
     int64_t nobs,
     ST_double pct)
 {
-    ST_double diff  = (ST_double) (clock() - *timer) / CLOCKS_PER_SEC;
-    ST_double sdiff = (ST_double) (clock() - *stimer) / CLOCKS_PER_SEC;
+    ST_double diff  = sf_clock_diff(*timer);
+    ST_double sdiff = sf_clock_diff(*stimer);
 
     if ( sdiff < progress )
         return;
 
-    *stimer = clock();
+    *stimer = sf_clock_now();
     sf_printf("\tReading: %.1f%%, %.1fs (rg %ld / %ld > col %ld / %ld > obs %ld / %ld)\n",
               pct, diff, r, nrow_groups, j, ncol, i, nobs);
 
 }
 
 void sf_running_progress_write (
-    clock_t *timer,
-    clock_t *stimer,
+    sf_clock *timer,
+    sf_clock *stimer,
     ST_double progress,
     int64_t j,
     int64_t ncol,
@@ -85,13 +101,13 @@ void sf_running_progress_write (
     int64_t nobs,
     ST_double pct)
 {
-    ST_double diff  = (ST_double) (clock() - *timer) / CLOCKS_PER_SEC;
-    ST_double sdiff = (ST_double) (clock() - *stimer) / CLOCKS_PER_SEC;
+    ST_double diff  = sf_clock_diff(*timer);
+    ST_double sdiff = sf_clock_diff(*stimer);
 
     if ( sdiff < progress )
         return;
 
-    *stimer = clock();
+    *stimer = sf_clock_now();
     sf_printf("\tWriting: %.1f%%, %.1fs (col %ld / %ld > obs %ld / %ld)\n",
               pct, diff, j, ncol, i, nobs);
 
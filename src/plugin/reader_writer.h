@@ -21,6 +21,7 @@
 #include <arrow/io/api.h>
 #include <parquet/arrow/reader.h>
 #include <parquet/arrow/writer.h>
+#include <parquet/arrow/schema.h>
 #include <parquet/exception.h>
 
 // low-level
@@ -30,6 +31,7 @@
 
 #include <parquet/api/reader.h>
 #include <parquet/api/writer.h>
+#include <parquet/column_page.h>
 
 // using parquet::LogicalType;
 using parquet::ConvertedType;